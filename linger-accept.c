@@ -0,0 +1,916 @@
+/* linger-accept.c fires bursts of connections over loopback at a server
+ * thread that drains them with a batched, non-blocking accept4() loop, for
+ * each listen() backlog in a sweep, with TCP_DEFER_ACCEPT off and on. It
+ * reports how long connections waited to be accepted, the accept rate the
+ * server achieved, and how many the kernel dropped when the accept queue
+ * overflowed - which is what happens to a server that is stuck in
+ * lingering close() calls. It is released under the same license as
+ * linger-server.c.
+ */
+/*************************************************************************\
+*                  Copyright (C) Nybek Limited, 2015.                     *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Affero General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the file COPYING.agpl-v3 for details.                               *
+\************************************************************************/
+
+#ifdef __linux__
+#define _GNU_SOURCE         /* accept4() */
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#ifdef TRUE
+#undef TRUE
+#endif
+
+#ifdef FALSE
+#undef FALSE
+#endif
+
+typedef enum { FALSE, TRUE } Boolean;
+
+#define BURST_SIZE 2000
+#define ROUNDS 3
+#define TIME_MAX 86400
+#define MAX_THREADS 256
+#define MAX_BACKLOGS 16
+#define MAX_EVENTS 256
+#define SERVER_POLL_MS 100
+#define ROUND_GAP_MS 200
+#define DEFER_ACCEPT_SECS 1
+#define NSECS_PER_SEC 1000000000ULL
+#define NETSTAT_FILE "/proc/net/netstat"
+#define SOMAXCONN_FILE "/proc/sys/net/core/somaxconn"
+
+#define FMT_CSV 0
+#define FMT_JSON 1
+
+#define CONN_CONNECTING 0
+#define CONN_WAITING 1
+
+#define printable(ch) (isprint((unsigned char) ch) ? ch : '#')
+
+static const char *defer_names[2] = { "off", "on" };
+
+typedef struct {
+    int backlogs[MAX_BACKLOGS];
+    int nbacklogs;
+    Boolean defer[2];           /* Indexed by TCP_DEFER_ACCEPT off/on */
+    long burst;                 /* Connections per burst */
+    int rounds;                 /* Bursts per configuration */
+    int threads;                /* Client threads firing each burst */
+    int batch;                  /* Most accept4() calls per wakeup */
+    long stall;                 /* usecs the server stalls after a batch */
+    int timeout;                /* Seconds a burst may take */
+    int format;
+} Options;
+
+static void fatal(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static void die(const char *where)
+{
+    perror(where);
+    exit(EXIT_FAILURE);
+}
+
+static void usage_exit(const char *prog_name, const char *msg, int opt)
+{
+    if (msg != NULL && opt != 0)
+        fprintf(stderr, "%s (-%c)\n", msg, printable(opt));
+    fprintf(stderr, "Usage: %s [-b backlog,...] [-D off,on] [-c conns] "
+                    "[-r rounds] [-j threads]\n"
+                    "       [-B batch] [-s usecs] [-T secs] [-f csv|json]\n",
+                    prog_name);
+    fprintf(stderr,
+            "     -h             Print usage and exit.\n"
+            "     -b backlog,... listen() backlogs to sweep (default\n"
+            "                    16,128,1024). The kernel caps them at\n"
+            "                    net.core.somaxconn.\n"
+            "     -D off,on      Run with TCP_DEFER_ACCEPT off, on (%d sec), or\n"
+            "                    both (default).\n"
+            "     -c conns       Connections in each burst (default %d).\n"
+            "     -r rounds      Bursts per backlog and TCP_DEFER_ACCEPT\n"
+            "                    setting (default %d).\n"
+            "     -j threads     Client threads firing each burst (default 4).\n"
+            "     -B batch       Most connections the server accepts per\n"
+            "                    wakeup (default 64).\n"
+            "     -s usecs       Stall the server for usecs after each batch,\n"
+            "                    as if it were stuck in lingering close()\n"
+            "                    calls (default 0).\n"
+            "     -T secs        How long a burst may take before the\n"
+            "                    connections left are given up on (default 10).\n"
+            "     -f format      Output csv (default) or json.\n"
+            "\n"
+            "One row is printed per backlog and TCP_DEFER_ACCEPT setting. The\n"
+            "ListenOverflows and ListenDrops columns are deltas of the\n"
+            "system-wide counters in /proc/net/netstat, so they include any\n"
+            "other listener on the host.\n",
+            DEFER_ACCEPT_SECS, BURST_SIZE, ROUNDS);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_backlogs(const char *prog_name, const char *arg, int opt,
+                           Options *options)
+{
+    char *copy, *tok, *save;
+    int backlog;
+
+    copy = strdup(arg);
+    if (copy == NULL)
+        fatal("out of memory");
+    options->nbacklogs = 0;
+    for (tok = strtok_r(copy, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (sscanf(tok, "%d", &backlog) != 1 || backlog <= 0)
+            usage_exit(prog_name, "Backlogs must be > 0", opt);
+        if (options->nbacklogs == MAX_BACKLOGS)
+            usage_exit(prog_name, "At most 16 backlogs", opt);
+        options->backlogs[options->nbacklogs++] = backlog;
+    }
+    free(copy);
+    if (options->nbacklogs == 0)
+        usage_exit(prog_name, "Backlogs must be > 0", opt);
+}
+
+static void parse_defer(const char *prog_name, const char *arg, int opt,
+                        Options *options)
+{
+    char *copy, *tok, *save;
+    int i;
+
+    copy = strdup(arg);
+    if (copy == NULL)
+        fatal("out of memory");
+    options->defer[0] = options->defer[1] = FALSE;
+    for (tok = strtok_r(copy, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        for (i = 0; i < 2; i++)
+            if (strcmp(tok, defer_names[i]) == 0)
+                break;
+        if (i == 2)
+            usage_exit(prog_name, "Expected off, on or off,on", opt);
+        options->defer[i] = TRUE;
+    }
+    free(copy);
+}
+
+static void parse_opts(int argc, char *argv[], Options *options)
+{
+    int opt;
+    char *prog_name;
+
+    options->backlogs[0] = 16;
+    options->backlogs[1] = 128;
+    options->backlogs[2] = 1024;
+    options->nbacklogs = 3;
+    options->defer[0] = options->defer[1] = TRUE;
+    options->burst = BURST_SIZE;
+    options->rounds = ROUNDS;
+    options->threads = 4;
+    options->batch = 64;
+    options->stall = 0;
+    options->timeout = 10;
+    options->format = FMT_CSV;
+    prog_name = argv[0] ? argv[0] : "[prog_name]";
+
+    while ((opt = getopt(argc, argv, ":hb:D:c:r:j:B:s:T:f:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage_exit(prog_name, NULL, opt);
+            break;
+        case 'b':
+            parse_backlogs(prog_name, optarg, opt, options);
+            break;
+        case 'D':
+            parse_defer(prog_name, optarg, opt, options);
+            break;
+        case 'c':
+            if (sscanf(optarg, "%ld", &options->burst) != 1 ||
+                options->burst <= 0)
+                usage_exit(prog_name, "Positive integer expected", opt);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%d", &options->rounds) != 1 ||
+                options->rounds <= 0)
+                usage_exit(prog_name, "Positive integer expected", opt);
+            break;
+        case 'j':
+            if (sscanf(optarg, "%d", &options->threads) != 1 ||
+                options->threads <= 0 || options->threads > MAX_THREADS)
+                usage_exit(prog_name, "Thread count must be 1 to 256", opt);
+            break;
+        case 'B':
+            if (sscanf(optarg, "%d", &options->batch) != 1 ||
+                options->batch <= 0)
+                usage_exit(prog_name, "Positive integer expected", opt);
+            break;
+        case 's':
+            if (sscanf(optarg, "%ld", &options->stall) != 1 ||
+                options->stall < 0)
+                usage_exit(prog_name, "Integer >= 0 expected", opt);
+            break;
+        case 'T':
+            if (sscanf(optarg, "%d", &options->timeout) != 1 ||
+                options->timeout <= 0 || options->timeout > TIME_MAX)
+                usage_exit(prog_name, "Timeout must be > 0 and <= 86400",
+                           opt);
+            break;
+        case 'f':
+            if (strcmp("csv", optarg) == 0)
+                options->format = FMT_CSV;
+            else if (strcmp("json", optarg) == 0)
+                options->format = FMT_JSON;
+            else
+                usage_exit(prog_name, "Bad output format", opt);
+            break;
+        case ':':
+            usage_exit(prog_name, "Missing argument", optopt);
+            break;
+        case '?':
+            usage_exit(prog_name, "Unrecognised option", optopt);
+            break;
+        default:
+            fatal("Unexpected case in switch()");
+        }
+    }
+}
+
+#ifdef __linux__
+
+static uint64_t timestamp(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        die("clock_gettime() failure");
+    return (uint64_t) ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+/* Log-bucketed latency histogram in the style of HdrHistogram, as in
+ * linger-server.c */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_HALF_BUCKETS (HIST_SUB_BUCKETS / 2)
+#define HIST_BUCKETS (HIST_SUB_BUCKETS + (64 - HIST_SUB_BITS) * HIST_HALF_BUCKETS)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+static int hist_index(uint64_t value)
+{
+    int shift;
+
+    if (value < HIST_SUB_BUCKETS)
+        return (int) value;
+    shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return HIST_SUB_BUCKETS + (shift - 1) * HIST_HALF_BUCKETS +
+           (int) (value >> shift) - HIST_HALF_BUCKETS;
+}
+
+/* The highest value that is counted in bucket i */
+static uint64_t hist_value(int i)
+{
+    int shift;
+    uint64_t top;
+
+    if (i < HIST_SUB_BUCKETS)
+        return i;
+    i -= HIST_SUB_BUCKETS;
+    shift = i / HIST_HALF_BUCKETS + 1;
+    top = i % HIST_HALF_BUCKETS + HIST_HALF_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+static void hist_record(Histogram *h, uint64_t value)
+{
+    h->counts[hist_index(value)]++;
+    h->total++;
+    if (value > h->max)
+        h->max = value;
+}
+
+static void hist_merge(Histogram *into, const Histogram *from)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+/* In usecs, for printing */
+static double hist_percentile(const Histogram *h, double pct)
+{
+    uint64_t rank, seen;
+    int i;
+
+    if (h->total == 0)
+        return 0;
+    rank = (uint64_t) (pct / 100 * h->total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    seen = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            break;
+    }
+    return (hist_value(i) < h->max ? hist_value(i) : h->max) / 1000.0;
+}
+
+/* One backlog and TCP_DEFER_ACCEPT setting. Each round gets its own
+ * listener and server thread; the server fields are only touched by the
+ * server thread until it has been joined, and add up over the rounds. */
+typedef struct {
+    const Options *options;
+    int listenfd;
+    int port;
+    uint64_t round_start;
+    volatile Boolean stop;
+    uint64_t *accepted_at;      /* By fd; 0 when the fd is not open */
+    int max_fds;
+    long accepted;
+    long wakeups;               /* Times the listener was found readable */
+    long read_errors;           /* Gone before sending its timestamp */
+    long stale;                 /* Connected before the round started */
+    uint64_t last_accept;
+    Histogram accept_lat;       /* Client's connect() to our accept4() */
+} Run;
+
+/* One client thread's share of a burst */
+typedef struct {
+    Run *run;
+    pthread_t tid;
+    long conns;
+    long connect_errors;
+    long resets;
+    long timeouts;
+    Histogram connect_lat;      /* connect() to writable */
+} Client;
+
+typedef struct {
+    int fd;
+    int state;
+    uint64_t start;
+} Conn;
+
+static void stall(long usecs)
+{
+    struct timespec ts;
+
+    ts.tv_sec = usecs / 1000000;
+    ts.tv_nsec = (usecs % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+/* Drain up to a batch of connections from the accept queue */
+static void accept_batch(Run *run, int epfd)
+{
+    struct epoll_event ev;
+    uint64_t now;
+    int fd, i;
+
+    run->wakeups++;
+    for (i = 0; i < run->options->batch; i++) {
+        fd = accept4(run->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            die("accept4()");
+        }
+        if (fd >= run->max_fds)
+            fatal("fd beyond RLIMIT_NOFILE");
+        now = timestamp();
+        run->accepted_at[fd] = now;
+        __atomic_store_n(&run->last_accept, now, __ATOMIC_RELAXED);
+        run->accepted++;
+
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            die("epoll_ctl() EPOLL_CTL_ADD");
+    }
+    if (run->options->stall > 0)
+        stall(run->options->stall);
+}
+
+/* Each client sends the time it called connect(), which dates the
+ * connection's wait in the queues */
+static void server_read(Run *run, int fd)
+{
+    uint64_t start;
+    ssize_t n;
+
+    n = recv(fd, &start, sizeof(start), 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINTR))
+        return;
+    if (n == sizeof(start) && start < run->round_start) {
+        run->stale++;
+        run->accepted--;
+    } else if (n == sizeof(start) && start <= run->accepted_at[fd]) {
+        hist_record(&run->accept_lat, run->accepted_at[fd] - start);
+    } else {
+        run->read_errors++;
+    }
+    run->accepted_at[fd] = 0;
+    if (close(fd) == -1)
+        die("closing connfd");
+}
+
+static void *server_thread(void *arg)
+{
+    Run *run = arg;
+    struct epoll_event events[MAX_EVENTS], ev;
+    int epfd, fd, i, n;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+        die("epoll_create1()");
+    ev.events = EPOLLIN;
+    ev.data.fd = run->listenfd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, run->listenfd, &ev) == -1)
+        die("epoll_ctl() EPOLL_CTL_ADD");
+
+    while (!run->stop) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, SERVER_POLL_MS);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait()");
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd == run->listenfd)
+                accept_batch(run, epfd);
+            else
+                server_read(run, events[i].data.fd);
+        }
+    }
+
+    for (fd = 0; fd < run->max_fds; fd++) {
+        if (run->accepted_at[fd] != 0) {
+            run->read_errors++;
+            close(fd);
+        }
+    }
+    close(epfd);
+    return NULL;
+}
+
+static void client_finish(Conn *c, long *done)
+{
+    close(c->fd);
+    c->fd = -1;
+    (*done)++;
+}
+
+static void client_connected(Client *cl, Conn *c, int epfd, long *done)
+{
+    struct epoll_event ev;
+    socklen_t len = sizeof(int);
+    int err;
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        die("getsockopt() SO_ERROR");
+    if (err != 0) {
+        cl->connect_errors++;
+        client_finish(c, done);
+        return;
+    }
+    hist_record(&cl->connect_lat, timestamp() - c->start);
+
+    /* 8 bytes always go in one segment over loopback */
+    if (send(c->fd, &c->start, sizeof(c->start), MSG_NOSIGNAL) !=
+        sizeof(c->start)) {
+        cl->connect_errors++;
+        client_finish(c, done);
+        return;
+    }
+    c->state = CONN_WAITING;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+        die("epoll_ctl() EPOLL_CTL_MOD");
+}
+
+/* The server closes as soon as it has the timestamp */
+static void client_read(Client *cl, Conn *c, long *done)
+{
+    char buf[64];
+    ssize_t n;
+
+    n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINTR))
+        return;
+    if (n == -1 && errno == ECONNRESET)
+        cl->resets++;
+    if (n != 0 && n != -1)
+        return;
+    client_finish(c, done);
+}
+
+/* Open every connection of the thread's share at once, then see each one
+ * through until the server closes it or the burst times out */
+static void *client_thread(void *arg)
+{
+    Client *cl = arg;
+    const Options *options = cl->run->options;
+    struct epoll_event events[MAX_EVENTS], ev;
+    struct sockaddr_in addr;
+    uint64_t deadline, now;
+    Conn *conns, *c;
+    long i, done = 0;
+    int epfd, n, j;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(cl->run->port);
+
+    conns = calloc(cl->conns, sizeof(Conn));
+    if (conns == NULL)
+        fatal("out of memory");
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+        die("epoll_create1()");
+
+    for (i = 0; i < cl->conns; i++) {
+        c = &conns[i];
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c->fd == -1)
+            die("socket() failed");
+        c->state = CONN_CONNECTING;
+        c->start = timestamp();
+        if (connect(c->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 &&
+            errno != EINPROGRESS) {
+            cl->connect_errors++;
+            client_finish(c, &done);
+            continue;
+        }
+        ev.events = EPOLLOUT;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+            die("epoll_ctl() EPOLL_CTL_ADD");
+    }
+
+    deadline = timestamp() + options->timeout * NSECS_PER_SEC;
+    while (done < cl->conns) {
+        now = timestamp();
+        if (now >= deadline)
+            break;
+        n = epoll_wait(epfd, events, MAX_EVENTS,
+                       (int) ((deadline - now) / 1000000) + 1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait()");
+        }
+        for (j = 0; j < n; j++) {
+            c = events[j].data.ptr;
+            if (c->state == CONN_CONNECTING)
+                client_connected(cl, c, epfd, &done);
+            else
+                client_read(cl, c, &done);
+        }
+    }
+
+    for (i = 0; i < cl->conns; i++) {
+        if (conns[i].fd != -1) {
+            cl->timeouts++;
+            close(conns[i].fd);
+        }
+    }
+    close(epfd);
+    free(conns);
+    return NULL;
+}
+
+static int open_listener(int backlog, Boolean defer, int *port)
+{
+    int listenfd, val;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenfd == -1)
+        die("socket");
+    val = 1;
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) == -1)
+        die("setting SO_REUSEADDR");
+    /* The connection is not queued for accept() until its first data
+     * arrives, so an idle handshake can't take up a place in the queue */
+    if (defer) {
+        val = DEFER_ACCEPT_SECS;
+        if (setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &val,
+                       sizeof(val)) == -1)
+            die("setting TCP_DEFER_ACCEPT");
+    }
+
+    /* A fresh ephemeral port per round, so that no connection left over
+     * from one is counted against the next */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        die("bind()");
+    if (listen(listenfd, backlog) == -1)
+        die("listen()");
+    if (getsockname(listenfd, (struct sockaddr *) &addr, &len) == -1)
+        die("getsockname()");
+    *port = ntohs(addr.sin_port);
+
+    return listenfd;
+}
+
+/* Read the ListenOverflows and ListenDrops counters from the TcpExt
+ * section of /proc/net/netstat, which comes as a line of names followed by
+ * a line of values */
+static void read_listen_counters(long *overflows, long *drops)
+{
+    static char names[16384], values[16384];
+    char *name, *value, *nsave, *vsave;
+    FILE *fp;
+
+    *overflows = *drops = 0;
+    fp = fopen(NETSTAT_FILE, "r");
+    if (fp == NULL)
+        return;
+    while (fgets(names, sizeof(names), fp) != NULL &&
+           fgets(values, sizeof(values), fp) != NULL) {
+        if (strncmp(names, "TcpExt:", 7) != 0)
+            continue;
+        name = strtok_r(names, " \n", &nsave);
+        value = strtok_r(values, " \n", &vsave);
+        while (name != NULL && value != NULL) {
+            if (strcmp(name, "ListenOverflows") == 0)
+                *overflows = atol(value);
+            else if (strcmp(name, "ListenDrops") == 0)
+                *drops = atol(value);
+            name = strtok_r(NULL, " \n", &nsave);
+            value = strtok_r(NULL, " \n", &vsave);
+        }
+        break;
+    }
+    fclose(fp);
+}
+
+static int read_somaxconn(void)
+{
+    FILE *fp;
+    int somaxconn = 0;
+
+    fp = fopen(SOMAXCONN_FILE, "r");
+    if (fp == NULL)
+        return 0;
+    if (fscanf(fp, "%d", &somaxconn) != 1)
+        somaxconn = 0;
+    fclose(fp);
+    return somaxconn;
+}
+
+/* A burst holds two fds per connection, so lift the soft limit as far as
+ * it will go */
+static int raise_fd_limit(const Options *options)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        die("getrlimit()");
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+        die("setrlimit()");
+    if (rl.rlim_cur < (rlim_t) options->burst * 2 + 64)
+        fatal("RLIMIT_NOFILE is too low for the burst size (-c)");
+    return rl.rlim_cur > INT_MAX ? INT_MAX : (int) rl.rlim_cur;
+}
+
+typedef struct {
+    int backlog;
+    int defer;
+    long conns;
+    long accepted;
+    double accept_rate;
+    double per_wakeup;
+    long connect_errors;
+    long resets;
+    long timeouts;
+    long read_errors;
+    long stale;
+    long overflows;
+    long drops;
+    Histogram accept_lat;
+    Histogram connect_lat;
+} Result;
+
+static void print_header(const Options *options)
+{
+    if (options->format != FMT_CSV)
+        return;
+    puts("defer_accept,backlog,effective_backlog,conns,accepted,"
+         "accepts_per_sec,accepts_per_wakeup,accept_p50_us,accept_p90_us,"
+         "accept_p99_us,accept_max_us,connect_p50_us,connect_p99_us,"
+         "connect_max_us,connect_errors,resets,timeouts,read_errors,"
+         "stale,listen_overflows,listen_drops");
+}
+
+static void print_result(const Options *options, const Result *res,
+                         int somaxconn)
+{
+    const char *fmt;
+
+    if (options->format == FMT_CSV)
+        fmt = "%s,%d,%d,%ld,%ld,%.1f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,"
+              "%.1f,%ld,%ld,%ld,%ld,%ld,%ld,%ld\n";
+    else
+        fmt = "{\"defer_accept\":\"%s\",\"backlog\":%d,"
+              "\"effective_backlog\":%d,\"conns\":%ld,\"accepted\":%ld,"
+              "\"accepts_per_sec\":%.1f,\"accepts_per_wakeup\":%.2f,"
+              "\"accept_p50_us\":%.1f,\"accept_p90_us\":%.1f,"
+              "\"accept_p99_us\":%.1f,\"accept_max_us\":%.1f,"
+              "\"connect_p50_us\":%.1f,\"connect_p99_us\":%.1f,"
+              "\"connect_max_us\":%.1f,\"connect_errors\":%ld,"
+              "\"resets\":%ld,\"timeouts\":%ld,\"read_errors\":%ld,"
+              "\"stale\":%ld,\"listen_overflows\":%ld,\"listen_drops\":%ld}\n";
+    printf(fmt, defer_names[res->defer], res->backlog,
+           somaxconn > 0 && somaxconn < res->backlog ? somaxconn :
+           res->backlog, res->conns, res->accepted, res->accept_rate,
+           res->per_wakeup, hist_percentile(&res->accept_lat, 50),
+           hist_percentile(&res->accept_lat, 90),
+           hist_percentile(&res->accept_lat, 99),
+           res->accept_lat.max / 1000.0,
+           hist_percentile(&res->connect_lat, 50),
+           hist_percentile(&res->connect_lat, 99),
+           res->connect_lat.max / 1000.0, res->connect_errors, res->resets,
+           res->timeouts, res->read_errors, res->stale, res->overflows,
+           res->drops);
+    fflush(stdout);
+}
+
+static void run_config(const Options *options, int backlog, int defer,
+                       int max_fds, Result *res)
+{
+    Client clients[MAX_THREADS];
+    pthread_t server;
+    Run *run;
+    uint64_t round_start, last_accept, busy_ns = 0;
+    long overflows, drops;
+    int i, r, round;
+
+    run = calloc(1, sizeof(Run));
+    if (run == NULL)
+        fatal("out of memory");
+    run->options = options;
+    run->max_fds = max_fds;
+    run->accepted_at = calloc(max_fds, sizeof(uint64_t));
+    if (run->accepted_at == NULL)
+        fatal("out of memory");
+
+    memset(res, 0, sizeof(Result));
+    res->backlog = backlog;
+    res->defer = defer;
+    read_listen_counters(&overflows, &drops);
+
+    for (round = 0; round < options->rounds; round++) {
+        /* A new listener each round, so that connections a timed-out
+         * round left in the accept queue are reset with the old one */
+        memset(clients, 0, options->threads * sizeof(Client));
+        run->listenfd = open_listener(backlog, defer, &run->port);
+        run->stop = FALSE;
+        run->last_accept = 0;
+        round_start = timestamp();
+        run->round_start = round_start;
+        r = pthread_create(&server, NULL, server_thread, run);
+        if (r != 0) {
+            errno = r;
+            die("pthread_create()");
+        }
+        for (i = 0; i < options->threads; i++) {
+            clients[i].run = run;
+            clients[i].conns = options->burst / options->threads +
+                               (i < options->burst % options->threads);
+            r = pthread_create(&clients[i].tid, NULL, client_thread,
+                               &clients[i]);
+            if (r != 0) {
+                errno = r;
+                die("pthread_create()");
+            }
+        }
+        for (i = 0; i < options->threads; i++) {
+            r = pthread_join(clients[i].tid, NULL);
+            if (r != 0) {
+                errno = r;
+                die("pthread_join()");
+            }
+            res->conns += clients[i].conns;
+            res->connect_errors += clients[i].connect_errors;
+            res->resets += clients[i].resets;
+            res->timeouts += clients[i].timeouts;
+            hist_merge(&res->connect_lat, &clients[i].connect_lat);
+        }
+        /* The server's clock for the round stops at its last accept */
+        last_accept = __atomic_load_n(&run->last_accept, __ATOMIC_RELAXED);
+        if (last_accept > round_start)
+            busy_ns += last_accept - round_start;
+        stall(ROUND_GAP_MS * 1000);
+
+        run->stop = TRUE;
+        r = pthread_join(server, NULL);
+        if (r != 0) {
+            errno = r;
+            die("pthread_join()");
+        }
+        close(run->listenfd);
+    }
+
+    read_listen_counters(&res->overflows, &res->drops);
+    res->overflows -= overflows;
+    res->drops -= drops;
+    res->accepted = run->accepted;
+    res->accept_rate = busy_ns > 0 ?
+                       run->accepted * (double) NSECS_PER_SEC / busy_ns : 0;
+    res->per_wakeup = run->wakeups > 0 ?
+                      (double) run->accepted / run->wakeups : 0;
+    res->read_errors = run->read_errors;
+    res->stale = run->stale;
+    res->accept_lat = run->accept_lat;
+
+    free(run->accepted_at);
+    free(run);
+}
+
+int main(int argc, char *argv[])
+{
+    Options aopts, *options = &aopts;
+    Result *res;
+    int b, defer, max_fds, somaxconn;
+
+    parse_opts(argc, argv, options);
+
+    max_fds = raise_fd_limit(options);
+    somaxconn = read_somaxconn();
+    res = malloc(sizeof(Result));
+    if (res == NULL)
+        fatal("out of memory");
+
+    print_header(options);
+    for (defer = 0; defer < 2; defer++) {
+        if (!options->defer[defer])
+            continue;
+        for (b = 0; b < options->nbacklogs; b++) {
+            run_config(options, options->backlogs[b], defer, max_fds, res);
+            print_result(options, res, somaxconn);
+        }
+    }
+
+    free(res);
+    exit(EXIT_SUCCESS);
+}
+
+#else
+
+int main(int argc, char *argv[])
+{
+    Options aopts;
+
+    parse_opts(argc, argv, &aopts);
+    fatal("linger-accept requires Linux");
+}
+
+#endif /* __linux__ */
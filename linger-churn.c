@@ -0,0 +1,730 @@
+/* linger-churn.c churns short-lived connections over loopback as fast as it
+ * can - connect, receive a small payload, close - once for each of the
+ * server's close policies, and reports the sustained connection rate, the
+ * CPU spent per connection, and how many sockets pile up in TIME_WAIT and
+ * FIN_WAIT as it goes. It is released under the same license as
+ * linger-server.c.
+ */
+/*************************************************************************\
+*                  Copyright (C) Nybek Limited, 2015.                     *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Affero General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the file COPYING.agpl-v3 for details.                               *
+\************************************************************************/
+
+#ifdef __linux__
+#define _GNU_SOURCE         /* RUSAGE_THREAD */
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#ifdef __linux__
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#endif
+
+#ifdef TRUE
+#undef TRUE
+#endif
+
+#ifdef FALSE
+#undef FALSE
+#endif
+
+typedef enum { FALSE, TRUE } Boolean;
+
+#define PAYLOAD_SIZE 1024
+#define READ_SIZE 16384
+#define BACKLOG 1024
+#define TIME_MAX 86400
+#define MAX_THREADS 256
+#define NSECS_PER_SEC 1000000000ULL
+#define PORT_RANGE_FILE "/proc/sys/net/ipv4/ip_local_port_range"
+
+#define POLICY_RST 0
+#define POLICY_CLOSE 1
+#define POLICY_SHUTDOWN 2
+#define NUM_POLICIES 3
+
+#define FMT_CSV 0
+#define FMT_JSON 1
+
+/* From the kernel's tcp_states.h */
+#define TCP_STATE_FIN_WAIT1 4
+#define TCP_STATE_FIN_WAIT2 5
+#define TCP_STATE_TIME_WAIT 6
+#define TCP_STATE_LISTEN 10
+
+#define printable(ch) (isprint((unsigned char) ch) ? ch : '#')
+
+static const char *policy_names[NUM_POLICIES] = {
+    "rst", "close", "shutdown"
+};
+
+typedef struct {
+    Boolean policies[NUM_POLICIES];
+    int duration;               /* Seconds per policy */
+    int threads;
+    long payload_size;
+    long sample_interval;       /* msecs */
+    int shutdown_time;
+    int format;
+} Options;
+
+/* Counters shared by every thread of a run. Each is only ever added to. */
+typedef struct {
+    long conns;
+    long resets;
+    long errors;
+    long connect_errors;
+    long port_errors;           /* EADDRNOTAVAIL from connect() */
+    long eof_timeouts;
+    uint64_t server_cpu_ns;
+    uint64_t client_cpu_ns;
+} Counters;
+
+/* Socket counts for the run's listening port, from sock_diag */
+typedef struct {
+    long time_wait;
+    long fin_wait1;
+    long fin_wait2;
+    long ports;                 /* Ephemeral ports tied up, at either end */
+} Census;
+
+typedef struct {
+    const Options *options;
+    int policy;
+    int listenfd;
+    int port;
+    const char *payload;
+    volatile Boolean stop;
+    Counters counters;
+} Run;
+
+static void fatal(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static void die(const char *where)
+{
+    perror(where);
+    exit(EXIT_FAILURE);
+}
+
+static void usage_exit(const char *prog_name, const char *msg, int opt)
+{
+    if (msg != NULL && opt != 0)
+        fprintf(stderr, "%s (-%c)\n", msg, printable(opt));
+    fprintf(stderr, "Usage: %s [-p rst,close,shutdown] [-d secs] "
+                    "[-j threads] [-P bytes] [-i msecs]\n"
+                    "       [-T eof_wait_secs] [-f csv|json]\n",
+                    prog_name);
+    fprintf(stderr,
+            "     -h             Print usage and exit.\n"
+            "     -p policy,...  Close policies to run (default all):\n"
+            "                        rst - SO_LINGER with a 0 timeout\n"
+            "                        close - a plain close()\n"
+            "                        shutdown - shutdown(), wait for EOF,\n"
+            "                                then close()\n"
+            "     -d secs        How long to churn each policy (default 10).\n"
+            "     -j threads     Client threads, each with a server thread\n"
+            "                    (default 4).\n"
+            "     -P bytes       Payload sent on each connection (default %d).\n"
+            "     -i msecs       Sample interval (default 1000).\n"
+            "     -T secs        EOF wait timeout for shutdown (default 1).\n"
+            "     -f format      Output csv (default) or json.\n"
+            "\n"
+            "A time series is printed while each policy runs, and a summary\n"
+            "row per policy at the end.\n", PAYLOAD_SIZE);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_policies(const char *prog_name, const char *arg, int opt,
+                           Options *options)
+{
+    char *copy, *tok, *save;
+    int i;
+
+    copy = strdup(arg);
+    if (copy == NULL)
+        fatal("out of memory");
+    memset(options->policies, 0, sizeof(options->policies));
+    for (tok = strtok_r(copy, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        for (i = 0; i < NUM_POLICIES; i++)
+            if (strcmp(tok, policy_names[i]) == 0)
+                break;
+        if (i == NUM_POLICIES)
+            usage_exit(prog_name, "Bad policy", opt);
+        options->policies[i] = TRUE;
+    }
+    free(copy);
+}
+
+static void parse_opts(int argc, char *argv[], Options *options)
+{
+    int opt, i;
+    char *prog_name;
+
+    for (i = 0; i < NUM_POLICIES; i++)
+        options->policies[i] = TRUE;
+    options->duration = 10;
+    options->threads = 4;
+    options->payload_size = PAYLOAD_SIZE;
+    options->sample_interval = 1000;
+    options->shutdown_time = 1;
+    options->format = FMT_CSV;
+    prog_name = argv[0] ? argv[0] : "[prog_name]";
+
+    while ((opt = getopt(argc, argv, ":hp:d:j:P:i:T:f:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage_exit(prog_name, NULL, opt);
+            break;
+        case 'p':
+            parse_policies(prog_name, optarg, opt, options);
+            break;
+        case 'd':
+            if (sscanf(optarg, "%d", &options->duration) != 1 ||
+                options->duration <= 0 || options->duration > TIME_MAX)
+                usage_exit(prog_name, "Duration must be > 0 and <= 86400",
+                           opt);
+            break;
+        case 'j':
+            if (sscanf(optarg, "%d", &options->threads) != 1 ||
+                options->threads <= 0 || options->threads > MAX_THREADS)
+                usage_exit(prog_name, "Thread count must be 1 to 256", opt);
+            break;
+        case 'P':
+            if (sscanf(optarg, "%ld", &options->payload_size) != 1 ||
+                options->payload_size < 0)
+                usage_exit(prog_name, "Integer >= 0 expected", opt);
+            break;
+        case 'i':
+            if (sscanf(optarg, "%ld", &options->sample_interval) != 1 ||
+                options->sample_interval <= 0)
+                usage_exit(prog_name, "Positive integer expected", opt);
+            break;
+        case 'T':
+            if (sscanf(optarg, "%d", &options->shutdown_time) != 1 ||
+                options->shutdown_time <= 0 ||
+                options->shutdown_time > TIME_MAX)
+                usage_exit(prog_name,
+                           "Shutdown timeout must be > 0 and <= 86400", opt);
+            break;
+        case 'f':
+            if (strcmp("csv", optarg) == 0)
+                options->format = FMT_CSV;
+            else if (strcmp("json", optarg) == 0)
+                options->format = FMT_JSON;
+            else
+                usage_exit(prog_name, "Bad output format", opt);
+            break;
+        case ':':
+            usage_exit(prog_name, "Missing argument", optopt);
+            break;
+        case '?':
+            usage_exit(prog_name, "Unrecognised option", optopt);
+            break;
+        default:
+            fatal("Unexpected case in switch()");
+        }
+    }
+}
+
+static uint64_t timestamp(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        die("clock_gettime() failure");
+    return (uint64_t) ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+/* CPU time, user and system, of the calling thread */
+static uint64_t thread_cpu(void)
+{
+#ifdef RUSAGE_THREAD
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_THREAD, &ru) == -1)
+        die("getrusage()");
+    return ((uint64_t) ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+           NSECS_PER_SEC +
+           ((uint64_t) ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+#else
+    /* RUSAGE_SELF would charge each thread with the whole process */
+    struct timespec ts;
+    clockid_t cid;
+    int r;
+
+    r = pthread_getcpuclockid(pthread_self(), &cid);
+    if (r != 0) {
+        errno = r;
+        die("pthread_getcpuclockid()");
+    }
+    if (clock_gettime(cid, &ts) == -1)
+        die("clock_gettime()");
+    return (uint64_t) ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+#endif
+}
+
+static void set_linger(int fd, int linger_time)
+{
+    int r;
+    struct linger ling;
+
+    ling.l_onoff = 1;
+    ling.l_linger = linger_time;
+    r = setsockopt(fd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+    if (r == -1)
+        die("setting SO_LINGER");
+}
+
+static void add(long *counter, long n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static void add_cpu(uint64_t *counter, uint64_t n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static Boolean send_payload(int fd, const char *payload, long size)
+{
+    ssize_t n;
+
+    while (size > 0) {
+        n = send(fd, payload, size, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        payload += n;
+        size -= n;
+    }
+    return TRUE;
+}
+
+/* The close policy under test, applied once the payload is sent */
+static void close_conn(Run *run, int connfd)
+{
+    struct pollfd pfds[1];
+    char c;
+
+    switch (run->policy) {
+    case POLICY_RST:
+        set_linger(connfd, 0);
+        break;
+    case POLICY_SHUTDOWN:
+        if (shutdown(connfd, SHUT_WR) == -1)
+            break;
+        pfds[0].fd = connfd;
+        pfds[0].events = POLLIN;
+        if (poll(pfds, 1, 1000 * run->options->shutdown_time) == 0)
+            add(&run->counters.eof_timeouts, 1);
+        else
+            (void) read(connfd, &c, 1);
+        break;
+    }
+    if (close(connfd) == -1)
+        die("closing connfd");
+}
+
+static void *server_thread(void *arg)
+{
+    Run *run = arg;
+    int connfd;
+
+    for (;;) {
+        connfd = accept(run->listenfd, NULL, NULL);
+        if (connfd == -1) {
+            if (run->stop)
+                break;              /* Woken by shutdown() of listenfd */
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            die("accept()");
+        }
+        send_payload(connfd, run->payload, run->options->payload_size);
+        close_conn(run, connfd);
+    }
+
+    add_cpu(&run->counters.server_cpu_ns, thread_cpu());
+    return NULL;
+}
+
+/* connect, read until EOF or reset, close - until told to stop */
+static void *client_thread(void *arg)
+{
+    Run *run = arg;
+    struct sockaddr_in addr;
+    char buf[READ_SIZE];
+    ssize_t n;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(run->port);
+
+    while (!run->stop) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1)
+            die("socket() failed");
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+            if (errno == EADDRNOTAVAIL) {
+                add(&run->counters.port_errors, 1);
+                usleep(1000);       /* Out of ports - let some drain */
+            } else {
+                add(&run->counters.connect_errors, 1);
+            }
+            close(fd);
+            continue;
+        }
+
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+            ;
+        if (n == -1) {
+            if (errno == ECONNRESET)
+                add(&run->counters.resets, 1);
+            else
+                add(&run->counters.errors, 1);
+        }
+        close(fd);
+        add(&run->counters.conns, 1);
+    }
+
+    add_cpu(&run->counters.client_cpu_ns, thread_cpu());
+    return NULL;
+}
+
+static int open_listener(int *port)
+{
+    int listenfd, val;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd == -1)
+        die("socket");
+    val = 1;
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) == -1)
+        die("setting SO_REUSEADDR");
+
+    /* A fresh ephemeral port per policy, so the TIME_WAIT sockets that one
+     * policy leaves behind are not counted against the next */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        die("bind()");
+    if (listen(listenfd, BACKLOG) == -1)
+        die("listen()");
+    if (getsockname(listenfd, (struct sockaddr *) &addr, &len) == -1)
+        die("getsockname()");
+    *port = ntohs(addr.sin_port);
+
+    return listenfd;
+}
+
+static long port_range(void)
+{
+    FILE *fp;
+    int low, high;
+
+    fp = fopen(PORT_RANGE_FILE, "r");
+    if (fp == NULL)
+        return 0;
+    if (fscanf(fp, "%d %d", &low, &high) != 2)
+        low = high + 1;
+    fclose(fp);
+    return high - low + 1;
+}
+
+#ifdef __linux__
+
+/* Count the TCP sockets on either end of the listening port by dumping
+ * them all over sock_diag. An ephemeral port is tied up while any socket
+ * holds its 4-tuple: the client's own, which it gives up as soon as it
+ * has closed, and just as much the server's TIME_WAIT or FIN_WAIT one,
+ * which a new connect() from that port would run into. So each client
+ * port is counted once, from whichever end still holds it. */
+static void take_census(int nlfd, int port, Census *census)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct inet_diag_req_v2 req;
+    } request;
+    static char buf[65536];
+    static unsigned char held[65536 / 8];
+    unsigned client;
+    struct nlmsghdr *nlh;
+    struct inet_diag_msg *msg;
+    ssize_t n;
+
+    memset(census, 0, sizeof(Census));
+    memset(held, 0, sizeof(held));
+    memset(&request, 0, sizeof(request));
+    request.nlh.nlmsg_len = sizeof(request);
+    request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.req.sdiag_family = AF_INET;
+    request.req.sdiag_protocol = IPPROTO_TCP;
+    request.req.idiag_states = ~0U;
+
+    if (send(nlfd, &request, sizeof(request), 0) == -1)
+        die("send() sock_diag request");
+
+    for (;;) {
+        n = recv(nlfd, buf, sizeof(buf), 0);
+        if (n == -1)
+            die("recv() sock_diag reply");
+        for (nlh = (struct nlmsghdr *) buf; NLMSG_OK(nlh, n);
+             nlh = NLMSG_NEXT(nlh, n)) {
+            if (nlh->nlmsg_type == NLMSG_DONE)
+                return;
+            if (nlh->nlmsg_type == NLMSG_ERROR)
+                fatal("sock_diag dump failed");
+            msg = NLMSG_DATA(nlh);
+            if (ntohs(msg->id.idiag_dport) == port)
+                client = ntohs(msg->id.idiag_sport);
+            else if (ntohs(msg->id.idiag_sport) == port &&
+                     msg->idiag_state != TCP_STATE_LISTEN)
+                client = ntohs(msg->id.idiag_dport);
+            else
+                continue;
+            if (!(held[client / 8] & (1 << client % 8))) {
+                held[client / 8] |= 1 << client % 8;
+                census->ports++;
+            }
+            if (ntohs(msg->id.idiag_sport) == port) {
+                if (msg->idiag_state == TCP_STATE_TIME_WAIT)
+                    census->time_wait++;
+                else if (msg->idiag_state == TCP_STATE_FIN_WAIT1)
+                    census->fin_wait1++;
+                else if (msg->idiag_state == TCP_STATE_FIN_WAIT2)
+                    census->fin_wait2++;
+            }
+        }
+    }
+}
+
+#else
+
+static void take_census(int nlfd, int port, Census *census)
+{
+    (void) nlfd;
+    (void) port;
+    memset(census, 0, sizeof(Census));
+}
+
+#endif /* __linux__ */
+
+static void print_sample_header(const Options *options)
+{
+    if (options->format != FMT_CSV)
+        return;
+    puts("policy,secs,conns,conns_per_sec,time_wait,fin_wait1,fin_wait2,"
+         "ports_in_use");
+}
+
+static void print_sample(const Options *options, int policy, double secs,
+                         long conns, double rate, const Census *census)
+{
+    const char *fmt;
+
+    if (options->format == FMT_CSV)
+        fmt = "%s,%.3f,%ld,%.1f,%ld,%ld,%ld,%ld\n";
+    else
+        fmt = "{\"type\":\"sample\",\"policy\":\"%s\",\"secs\":%.3f,"
+              "\"conns\":%ld,\"conns_per_sec\":%.1f,\"time_wait\":%ld,"
+              "\"fin_wait1\":%ld,\"fin_wait2\":%ld,\"ports_in_use\":%ld}\n";
+    printf(fmt, policy_names[policy], secs, conns, rate, census->time_wait,
+           census->fin_wait1, census->fin_wait2, census->ports);
+    fflush(stdout);
+}
+
+typedef struct {
+    double secs;
+    Counters counters;
+    Census peak;
+} Summary;
+
+static void print_summaries(const Options *options, const Summary *sums,
+                            long range)
+{
+    const Summary *s;
+    const Counters *c;
+    const char *fmt;
+    long conns;
+    int p;
+
+    if (options->format == FMT_CSV) {
+        puts("policy,secs,conns,conns_per_sec,server_cpu_us_per_conn,"
+             "client_cpu_us_per_conn,resets,errors,connect_errors,"
+             "port_errors,eof_timeouts,peak_time_wait,peak_fin_wait1,"
+             "peak_fin_wait2,peak_ports_in_use,port_range,peak_port_pct");
+        fmt = "%s,%.3f,%ld,%.1f,%.2f,%.2f,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,"
+              "%ld,%ld,%.1f\n";
+    } else {
+        fmt = "{\"type\":\"summary\",\"policy\":\"%s\",\"secs\":%.3f,"
+              "\"conns\":%ld,\"conns_per_sec\":%.1f,"
+              "\"server_cpu_us_per_conn\":%.2f,"
+              "\"client_cpu_us_per_conn\":%.2f,\"resets\":%ld,"
+              "\"errors\":%ld,\"connect_errors\":%ld,\"port_errors\":%ld,"
+              "\"eof_timeouts\":%ld,\"peak_time_wait\":%ld,"
+              "\"peak_fin_wait1\":%ld,\"peak_fin_wait2\":%ld,"
+              "\"peak_ports_in_use\":%ld,\"port_range\":%ld,"
+              "\"peak_port_pct\":%.1f}\n";
+    }
+
+    for (p = 0; p < NUM_POLICIES; p++) {
+        if (!options->policies[p])
+            continue;
+        s = &sums[p];
+        c = &s->counters;
+        conns = c->conns > 0 ? c->conns : 1;
+        printf(fmt, policy_names[p], s->secs, c->conns,
+               s->secs > 0 ? c->conns / s->secs : 0.0,
+               c->server_cpu_ns / 1000.0 / conns,
+               c->client_cpu_ns / 1000.0 / conns,
+               c->resets, c->errors, c->connect_errors, c->port_errors,
+               c->eof_timeouts, s->peak.time_wait, s->peak.fin_wait1,
+               s->peak.fin_wait2, s->peak.ports, range,
+               range > 0 ? 100.0 * s->peak.ports / range : 0.0);
+    }
+}
+
+static void update_peak(Census *peak, const Census *census)
+{
+    if (census->time_wait > peak->time_wait)
+        peak->time_wait = census->time_wait;
+    if (census->fin_wait1 > peak->fin_wait1)
+        peak->fin_wait1 = census->fin_wait1;
+    if (census->fin_wait2 > peak->fin_wait2)
+        peak->fin_wait2 = census->fin_wait2;
+    if (census->ports > peak->ports)
+        peak->ports = census->ports;
+}
+
+static void run_policy(const Options *options, int policy, int nlfd,
+                       const char *payload, Summary *sum)
+{
+    pthread_t servers[MAX_THREADS], clients[MAX_THREADS];
+    Run run;
+    Census census;
+    uint64_t start, end, now, last;
+    long conns, last_conns;
+    int i, r;
+
+    memset(&run, 0, sizeof(run));
+    run.options = options;
+    run.policy = policy;
+    run.payload = payload;
+    run.listenfd = open_listener(&run.port);
+
+    for (i = 0; i < options->threads; i++) {
+        r = pthread_create(&servers[i], NULL, server_thread, &run);
+        if (r == 0)
+            r = pthread_create(&clients[i], NULL, client_thread, &run);
+        if (r != 0) {
+            errno = r;
+            die("pthread_create()");
+        }
+    }
+
+    start = last = timestamp();
+    end = start + options->duration * NSECS_PER_SEC;
+    last_conns = 0;
+    memset(&sum->peak, 0, sizeof(Census));
+    do {
+        usleep(options->sample_interval * 1000);
+        now = timestamp();
+        conns = __atomic_load_n(&run.counters.conns, __ATOMIC_RELAXED);
+        take_census(nlfd, run.port, &census);
+        update_peak(&sum->peak, &census);
+        print_sample(options, policy, (double) (now - start) / NSECS_PER_SEC,
+                     conns, (conns - last_conns) * (double) NSECS_PER_SEC /
+                     (now - last), &census);
+        last = now;
+        last_conns = conns;
+    } while (now < end);
+
+    run.stop = TRUE;
+    for (i = 0; i < options->threads; i++) {
+        r = pthread_join(clients[i], NULL);
+        if (r != 0) {
+            errno = r;
+            die("pthread_join()");
+        }
+    }
+    sum->secs = (double) (timestamp() - start) / NSECS_PER_SEC;
+
+    /* Wake the servers blocked in accept() */
+    shutdown(run.listenfd, SHUT_RDWR);
+    for (i = 0; i < options->threads; i++) {
+        r = pthread_join(servers[i], NULL);
+        if (r != 0) {
+            errno = r;
+            die("pthread_join()");
+        }
+    }
+    close(run.listenfd);
+    sum->counters = run.counters;
+}
+
+int main(int argc, char *argv[])
+{
+    Options copts, *options = &copts;
+    Summary sums[NUM_POLICIES];
+    char *payload;
+    int p, nlfd = -1;
+
+    parse_opts(argc, argv, options);
+
+    payload = malloc(options->payload_size + 1);
+    if (payload == NULL)
+        fatal("out of memory");
+    memset(payload, '.', options->payload_size);
+
+#ifdef __linux__
+    nlfd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+    if (nlfd == -1)
+        die("socket() NETLINK_SOCK_DIAG");
+#endif
+
+    memset(sums, 0, sizeof(sums));
+    print_sample_header(options);
+    for (p = 0; p < NUM_POLICIES; p++)
+        if (options->policies[p])
+            run_policy(options, p, nlfd, payload, &sums[p]);
+    print_summaries(options, sums, port_range());
+
+    if (nlfd != -1)
+        close(nlfd);
+    free(payload);
+    exit(EXIT_SUCCESS);
+}
@@ -22,17 +22,40 @@
 * See the files COPYING.lgpl-v3 and COPYING.gpl-v3 for details.           *
 \*************************************************************************/
 
+#ifdef __linux__
+#define _GNU_SOURCE         /* splice(), pipe2() */
+#endif
+
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <netdb.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
 #ifdef TRUE
 #undef TRUE
 #endif
@@ -47,6 +70,69 @@ typedef enum { FALSE, TRUE } Boolean;
 #define RCVBUF_SIZE 8192
 #define WAIT_TIME 4
 #define READ_SIZE 512
+#define LOAD_READ_SIZE 16384
+#define MAX_EVENTS 256
+#define MAX_THREADS 1024
+#define WHEEL_TICK 1000000ULL       /* 1 ms */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 5
+#define NSECS_PER_SEC 1000000000ULL
+#define READY_BYTE 'R'
+#define PATTERN_STEP 0x9E3779B97F4A7C15ULL
+#define TIME_MAX 86400
+#define DRAIN_IOVS 16
+#define DRAIN_IOV_SIZE (64 * 1024)
+#define DRAIN_CHUNK (DRAIN_IOVS * DRAIN_IOV_SIZE)
+
+#define DRAIN_NONE 0
+#define DRAIN_READV 1
+#define DRAIN_TRUNC 2
+#define DRAIN_SPLICE 3
+
+#define RATE_NONE 0
+#define RATE_FIXED 1
+#define RATE_UNIFORM 2
+#define RATE_PARETO 3
+#define RATE_MAX 1e9                    /* bytes/sec, caps Pareto draws */
+#define LN2 0.69314718055994530942
+
+#define EVENT_EOF 0
+#define EVENT_RESET 1
+#define EVENT_TIMEOUT 2
+#define EVENT_ERROR 3
+
+#ifdef POLLRDHUP
+#define POLL_HANGUP POLLRDHUP
+#else
+#define POLL_HANGUP 0               /* A FIN then shows only on reading */
+#endif
+
+#define printable(ch) (isprint((unsigned char) ch) ? ch : '#')
+
+typedef struct {
+    Boolean interactive;
+    long conns;
+    int threads;
+    double rate;
+    Boolean fast;
+    long read_bytes;
+    long read_interval;         /* usecs between reads, 0 = unthrottled */
+    size_t expected;            /* Bytes the server wrote, 0 = unknown */
+    int timeout;                /* secs to wait for the stream to end */
+    int drain;                  /* DRAIN_* */
+    const char *port;
+    const char *timeline_name;
+    long batch;                 /* Connects at a time, 0 = default */
+    Boolean fastopen;
+    uint32_t src_first;         /* Source addresses, host order */
+    long src_count;             /* 0 = let the kernel pick */
+    int rate_dist;              /* RATE_*, for -L */
+    double rate_min;            /* bytes/sec: the fixed rate, or the least */
+    double rate_param;          /* uniform: the most, pareto: the shape */
+} Options;
+
+static const char *event_names[] = { "EOF", "reset", "timeout", "error" };
 
 static void fatal(const char* where, const char *msg)
 {
@@ -62,39 +148,732 @@ static void die(const char *where)
     exit(EXIT_FAILURE);
 }
 
-static void usage_exit(const char *prog_name, const char *err_msg)
+static void usage_exit(const char *prog_name, const char *err_msg, int opt)
 {
-    if (err_msg != NULL)
+    if (err_msg != NULL && opt != 0)
+        fprintf(stderr, "%s (-%c)\n", err_msg, printable(opt));
+    else if (err_msg != NULL)
         fprintf(stderr, "%s\n", err_msg);
     fprintf(stderr,
-            "usage: %s [-i] hostname\n"
-            "    -h      Print usage and exit.\n"
-            "    -i      Interactive. Require user confirmation before each\n"
-            "            read of the stream.\n",
-            prog_name);
+            "usage: %s [-i] [-c conns] [-j threads] [-r rate] "
+            "[-F bytes:usecs]\n"
+            "       [-P size] [-T secs] [-D readv|trunc|splice] [-p port]\n"
+            "       [-M name] [-B batch] [-O] [-S first[-last]]\n"
+            "       [-L fixed:rate|uniform:min:max|pareto:min:shape] hostname\n"
+            "    -h          Print usage and exit.\n"
+            "    -i          Interactive. Require user confirmation before each\n"
+            "                read of the stream.\n"
+            "    -c conns    Load mode (Linux only). Open conns connections and\n"
+            "                drain each one as fast as possible, then report\n"
+            "                receive time, bytes and outcome distributions.\n"
+            "    -j threads  Number of load threads, each with its own event\n"
+            "                loop (default 1).\n"
+            "    -r rate     Connection arrival rate in connections/sec across\n"
+            "                all threads. 0 (default) opens them all at once.\n"
+            "    -F bytes:usecs\n"
+            "                Fast mode (Linux only). Send the server a ready\n"
+            "                byte on connecting (use with linger-server -F),\n"
+            "                then read at most bytes every usecs, paced by a\n"
+            "                timerfd rather than sleep(%d). usecs of 0 reads\n"
+            "                as fast as possible.\n"
+            "    -P size     Payload size the server was given with -P, so\n"
+            "                that lost bytes can be reported (K, M or G\n"
+            "                suffix).\n"
+            "    -T secs     Give up on a stream that hasn't ended after secs\n"
+            "                and report it as a timeout (default: wait).\n"
+            "    -D method   Drain mode. Read as fast as possible with the\n"
+            "                default receive buffer, by readv() into %d x %dK\n"
+            "                buffers, recv(MSG_TRUNC) discarding the data or\n"
+            "                splice() to /dev/null (trunc and splice are\n"
+            "                Linux only, and can't verify the payload). With\n"
+            "                -F bytes:0 the ready byte is sent first. Applies\n"
+            "                to load mode too.\n"
+            "    -p port     Connect to port rather than %s, e.g. that of a\n"
+            "                linger-proxy in front of the server.\n"
+            "    -M name     Stamp each connection's connect(), first read\n"
+            "                and end into the shared memory timeline name\n"
+            "                that linger-server -M name fills in on the same\n"
+            "                host, and report the delay from the server's\n"
+            "                shutdown() or close() to seeing the FIN or RST.\n"
+            "    -B batch    In load mode, open connections batch at a time:\n"
+            "                at each arrival with -r (default 1), or on each\n"
+            "                pass of the event loop without it, so that\n"
+            "                handshakes are reaped in between (default: all\n"
+            "                at once).\n"
+            "    -O          TCP Fast Open in load mode with -F: the ready\n"
+            "                byte goes out in the SYN once the server\n"
+            "                (linger-server -O) has handed us a cookie.\n"
+            "    -S first[-last]\n"
+            "                Spread load connections over the IPv4 source\n"
+            "                addresses first to last, each bound with\n"
+            "                IP_BIND_ADDRESS_NO_PORT so that connect() picks\n"
+            "                a port per destination (not with -M).\n"
+            "    -L dist     Slow consumers in load mode: each connection reads\n"
+            "                at its own rate in bytes/sec (K, M or G suffix),\n"
+            "                drawn from dist - one fixed rate, uniform between\n"
+            "                min and max, or Pareto from min with the given\n"
+            "                shape (a long tail of faster readers) - in reads\n"
+            "                of at most -F bytes, paced by a timer wheel.\n"
+            "                Not with -F usecs > 0.\n",
+            prog_name, WAIT_TIME, DRAIN_IOVS, DRAIN_IOV_SIZE / 1024, PORT);
     exit(EXIT_FAILURE);
 }
 
-static void set_socket_options(int fd)
+static size_t parse_size(const char *str)
+{
+    unsigned long long size;
+    char suffix = '\0', extra;
+    int n;
+
+    n = sscanf(str, "%llu%c%c", &size, &suffix, &extra);
+    if (n < 1 || n > 2)
+        return 0;
+    switch (toupper((unsigned char) suffix)) {
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        /* fall through */
+    case '\0':
+        break;
+    default:
+        return 0;
+    }
+    return (size_t) size;
+}
+
+/* An IPv4 address, or a range of them as first-last */
+static void parse_sources(const char *prog_name, const char *arg,
+                          Options *options)
+{
+    char first[INET_ADDRSTRLEN], *dash;
+    struct in_addr a, b;
+    size_t len;
+
+    dash = strchr(arg, '-');
+    len = dash != NULL ? (size_t) (dash - arg) : strlen(arg);
+    if (len >= sizeof(first))
+        usage_exit(prog_name, "Bad source address", 'S');
+    memcpy(first, arg, len);
+    first[len] = '\0';
+    if (inet_pton(AF_INET, first, &a) != 1)
+        usage_exit(prog_name, "Bad source address", 'S');
+    b = a;
+    if (dash != NULL && inet_pton(AF_INET, dash + 1, &b) != 1)
+        usage_exit(prog_name, "Bad source address", 'S');
+    if (ntohl(b.s_addr) < ntohl(a.s_addr))
+        usage_exit(prog_name, "Source range runs backwards", 'S');
+    options->src_first = ntohl(a.s_addr);
+    options->src_count = (long) ntohl(b.s_addr) - ntohl(a.s_addr) + 1;
+}
+
+/* fixed:rate, uniform:min:max or pareto:min:shape */
+static void parse_rates(const char *prog_name, const char *arg,
+                        Options *options)
+{
+    char name[16], first[32], second[32];
+    int n;
+
+    n = sscanf(arg, "%15[a-z]:%31[^:]:%31s", name, first, second);
+    if (n < 2)
+        usage_exit(prog_name, "Bad rate distribution", 'L');
+    options->rate_min = (double) parse_size(first);
+    if (options->rate_min <= 0 || options->rate_min > RATE_MAX)
+        usage_exit(prog_name, "Bad rate", 'L');
+
+    if (strcmp(name, "fixed") == 0 && n == 2) {
+        options->rate_dist = RATE_FIXED;
+    } else if (strcmp(name, "uniform") == 0 && n == 3) {
+        options->rate_dist = RATE_UNIFORM;
+        options->rate_param = (double) parse_size(second);
+        if (options->rate_param < options->rate_min ||
+            options->rate_param > RATE_MAX)
+            usage_exit(prog_name, "Bad rate", 'L');
+    } else if (strcmp(name, "pareto") == 0 && n == 3) {
+        options->rate_dist = RATE_PARETO;
+        if (sscanf(second, "%lf", &options->rate_param) != 1 ||
+            options->rate_param <= 0)
+            usage_exit(prog_name, "Pareto shape must be > 0", 'L');
+    } else {
+        usage_exit(prog_name, "Bad rate distribution", 'L');
+    }
+}
+
+static void parse_opts(int argc, char *argv[], Options *options,
+                       char **hostname)
+{
+    int opt;
+    char *prog_name;
+
+    options->interactive = FALSE;
+    options->conns = 0;
+    options->threads = 1;
+    options->rate = 0;
+    options->fast = FALSE;
+    options->read_bytes = READ_SIZE;
+    options->read_interval = 0;
+    options->expected = 0;
+    options->timeout = 0;
+    options->drain = DRAIN_NONE;
+    options->port = PORT;
+    options->timeline_name = NULL;
+    options->batch = 0;
+    options->fastopen = FALSE;
+    options->src_first = 0;
+    options->src_count = 0;
+    options->rate_dist = RATE_NONE;
+    options->rate_min = 0;
+    options->rate_param = 0;
+    prog_name = argv[0] ? argv[0] : "[prog_name]";
+
+    while ((opt = getopt(argc, argv, ":hic:j:r:F:P:T:D:p:M:B:OS:L:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage_exit(prog_name, NULL, 0);
+            break;
+        case 'i':
+            options->interactive = TRUE;
+            break;
+        case 'c':
+#ifdef __linux__
+            if (sscanf(optarg, "%ld", &options->conns) != 1 ||
+                options->conns <= 0)
+                usage_exit(prog_name, "Positive integer expected", opt);
+#else
+            usage_exit(prog_name, "Load mode requires Linux", opt);
+#endif
+            break;
+        case 'j':
+            if (sscanf(optarg, "%d", &options->threads) != 1 ||
+                options->threads <= 0 || options->threads > MAX_THREADS)
+                usage_exit(prog_name, "Thread count must be 1-1024", opt);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%lf", &options->rate) != 1 ||
+                options->rate < 0)
+                usage_exit(prog_name, "Non-negative rate expected", opt);
+            break;
+        case 'F':
+#ifdef __linux__
+            if (sscanf(optarg, "%ld:%ld", &options->read_bytes,
+                       &options->read_interval) != 2 ||
+                options->read_bytes <= 0 || options->read_interval < 0)
+                usage_exit(prog_name, "bytes:usecs expected", opt);
+            options->fast = TRUE;
+#else
+            usage_exit(prog_name, "Fast mode requires Linux", opt);
+#endif
+            break;
+        case 'P':
+            options->expected = parse_size(optarg);
+            if (options->expected == 0)
+                usage_exit(prog_name, "Bad payload size", opt);
+            break;
+        case 'T':
+            if (sscanf(optarg, "%d", &options->timeout) != 1 ||
+                options->timeout <= 0 || options->timeout > TIME_MAX)
+                usage_exit(prog_name, "Timeout out of range", opt);
+            break;
+        case 'D':
+            if (strcmp(optarg, "readv") == 0)
+                options->drain = DRAIN_READV;
+#ifdef __linux__
+            else if (strcmp(optarg, "trunc") == 0)
+                options->drain = DRAIN_TRUNC;
+            else if (strcmp(optarg, "splice") == 0)
+                options->drain = DRAIN_SPLICE;
+#else
+            else if (strcmp(optarg, "trunc") == 0 ||
+                     strcmp(optarg, "splice") == 0)
+                usage_exit(prog_name, "Drain method requires Linux", opt);
+#endif
+            else
+                usage_exit(prog_name, "Unknown drain method", opt);
+            break;
+        case 'p':
+            options->port = optarg;
+            break;
+        case 'M':
+            options->timeline_name = optarg;
+            break;
+        case 'B':
+            if (sscanf(optarg, "%ld", &options->batch) != 1 ||
+                options->batch <= 0)
+                usage_exit(prog_name, "Positive integer expected", opt);
+            break;
+        case 'O':
+#ifdef __linux__
+            options->fastopen = TRUE;
+#else
+            usage_exit(prog_name, "TCP Fast Open requires Linux", opt);
+#endif
+            break;
+        case 'S':
+            parse_sources(prog_name, optarg, options);
+            break;
+        case 'L':
+            parse_rates(prog_name, optarg, options);
+            break;
+        case ':':
+            usage_exit(prog_name, "Missing argument", optopt);
+            break;
+        case '?':
+            usage_exit(prog_name, "Unrecognised option", optopt);
+            break;
+        default:
+            fatal(NULL, "Unexpected case in switch()");
+        }
+    }
+
+    if (options->conns == 0 && (options->batch > 0 || options->fastopen ||
+                                options->src_count > 0))
+        usage_exit(prog_name, "-B, -O and -S need -c", 0);
+    if (options->rate_dist != RATE_NONE && options->conns == 0)
+        usage_exit(prog_name, "Needs -c", 'L');
+    if (options->rate_dist != RATE_NONE && options->read_interval > 0)
+        usage_exit(prog_name, "Can't be combined with -F usecs > 0", 'L');
+    if (options->fastopen && !options->fast)
+        usage_exit(prog_name, "Needs -F, for data to put in the SYN", 'O');
+    if (options->src_count > 0 && options->timeline_name != NULL)
+        usage_exit(prog_name, "Can't be combined with -M", 'S');
+    if (options->drain != DRAIN_NONE && options->read_interval > 0)
+        usage_exit(prog_name, "Drain mode can't be paced, use -F bytes:0",
+                   'D');
+    if (optind != argc - 1)
+        usage_exit(prog_name, NULL, 0);
+    *hostname = argv[optind];
+}
+
+/* Drain mode leaves the receive buffer to autotuning, as the small one
+ * that makes the server's send buffer fill would make us the bottleneck */
+static void set_socket_options(int fd, const Options *options)
 {
     int r, val;
 
+    if (options->drain != DRAIN_NONE)
+        return;
+
     val = RCVBUF_SIZE,
     r = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
     if (r == -1)
         die("setting SO_RCVBUF");
 }
 
-static int connect_to(const char *host)
+static uint64_t timestamp(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        die("clock_gettime() failure");
+    return (uint64_t) ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+static double time_diff(uint64_t before, uint64_t after)
+{
+    return (double) (int64_t) (after - before) / NSECS_PER_SEC;
+}
+
+/* Log-bucketed histogram in the style of HdrHistogram. Values below
+ * HIST_SUB_BUCKETS are counted exactly; above that every power of two is
+ * split into HIST_SUB_BUCKETS / 2 linear sub-buckets, which keeps the
+ * relative error under 2% across the whole 64-bit range.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_HALF_BUCKETS (HIST_SUB_BUCKETS / 2)
+#define HIST_BUCKETS (HIST_SUB_BUCKETS + (64 - HIST_SUB_BITS) * HIST_HALF_BUCKETS)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+static int hist_index(uint64_t value)
+{
+    int shift;
+
+    if (value < HIST_SUB_BUCKETS)
+        return (int) value;
+    shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return HIST_SUB_BUCKETS + (shift - 1) * HIST_HALF_BUCKETS +
+           (int) (value >> shift) - HIST_HALF_BUCKETS;
+}
+
+/* The highest value that is counted in bucket i */
+static uint64_t hist_value(int i)
+{
+    int shift;
+    uint64_t top;
+
+    if (i < HIST_SUB_BUCKETS)
+        return i;
+    i -= HIST_SUB_BUCKETS;
+    shift = i / HIST_HALF_BUCKETS + 1;
+    top = i % HIST_HALF_BUCKETS + HIST_HALF_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
+
+static void hist_record(Histogram *h, uint64_t value)
+{
+    h->counts[hist_index(value)]++;
+    h->total++;
+    if (value > h->max)
+        h->max = value;
+}
+
+static void hist_merge(Histogram *dst, const Histogram *src)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+static uint64_t hist_percentile(const Histogram *h, double pct)
+{
+    uint64_t rank, seen;
+    int i;
+
+    if (h->total == 0)
+        return 0;
+    rank = (uint64_t) (pct / 100 * h->total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    seen = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            break;
+    }
+    return hist_value(i) < h->max ? hist_value(i) : h->max;
+}
+
+/* Print the percentiles of h, each divided by scale */
+static void hist_print(const char *label, const Histogram *h, double scale,
+                       int decimals)
+{
+    if (h->total == 0)
+        return;
+    printf("%s: n %llu  p50 %.*f  p90 %.*f  p99 %.*f  p99.9 %.*f  "
+           "max %.*f\n", label, (unsigned long long) h->total,
+           decimals, hist_percentile(h, 50) / scale,
+           decimals, hist_percentile(h, 90) / scale,
+           decimals, hist_percentile(h, 99) / scale,
+           decimals, hist_percentile(h, 99.9) / scale,
+           decimals, h->max / scale);
+}
+
+/* The server's payload: byte i is byte i % 8, least significant first, of
+ * the 64-bit word (i / 8 + 1) * PATTERN_STEP. The Verifier follows the
+ * stream through however it is split into reads and records the first
+ * byte that does not match, so that a truncated stream can be told apart
+ * from a corrupted one.
+ */
+typedef struct {
+    uint64_t offset;            /* Stream offset of the next byte */
+    uint64_t bad_offset;        /* First byte that did not match */
+    Boolean bad;
+    Boolean blind;              /* Some bytes were discarded unseen */
+} Verifier;
+
+#ifndef __SSE2__
+/* A pattern word laid out as it goes in the stream, least significant
+ * byte first, whatever the host's byte order. This compiles to a plain
+ * move, or a byte swap on big-endian hosts. SSE2 means x86, which is
+ * little-endian already. */
+static uint64_t pattern_word(uint64_t word)
+{
+    unsigned char bytes[8];
+    uint64_t laid;
+    int j;
+
+    for (j = 0; j < 8; j++)
+        bytes[j] = (unsigned char) (word >> (8 * j));
+    memcpy(&laid, bytes, 8);
+    return laid;
+}
+#endif
+
+static unsigned char pattern_byte(uint64_t offset)
+{
+    return (unsigned char) (((offset >> 3) + 1) * PATTERN_STEP >>
+                            (8 * (offset & 7)));
+}
+
+/* Return the index of the first byte of buf that doesn't match the pattern
+ * from offset on, or n if they all do */
+static size_t pattern_check(uint64_t offset, const unsigned char *buf,
+                            size_t n)
+{
+    size_t i = 0;
+    uint64_t word;
+#ifdef __SSE2__
+    __m128i expect, step, a, b, c, d;
+#else
+    uint64_t got;
+#endif
+
+    /* Byte at a time up to a word boundary of the stream, then as many
+     * bytes at a time as the machine allows */
+    while (i < n && ((offset + i) & 7) != 0) {
+        if (buf[i] != pattern_byte(offset + i))
+            return i;
+        i++;
+    }
+    word = ((offset + i) >> 3) + 1;
+#ifdef __SSE2__
+    /* 64 bytes per iteration, each 16 compared to two consecutive words */
+    expect = _mm_set_epi64x((long long) ((word + 1) * PATTERN_STEP),
+                            (long long) (word * PATTERN_STEP));
+    step = _mm_set1_epi64x((long long) (2 * PATTERN_STEP));
+    for (; i + 64 <= n; i += 64) {
+        a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buf + i)),
+                           expect);
+        expect = _mm_add_epi64(expect, step);
+        b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buf + i + 16)),
+                           expect);
+        expect = _mm_add_epi64(expect, step);
+        c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buf + i + 32)),
+                           expect);
+        expect = _mm_add_epi64(expect, step);
+        d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buf + i + 48)),
+                           expect);
+        expect = _mm_add_epi64(expect, step);
+        if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b),
+                                            _mm_and_si128(c, d))) != 0xFFFF)
+            break;              /* Found below, byte at a time */
+    }
+#else
+    /* A word at a time, as linger-server stores it */
+    for (; i + 8 <= n; i += 8, word++) {
+        memcpy(&got, buf + i, 8);
+        if (got != pattern_word(word * PATTERN_STEP))
+            break;
+    }
+#endif
+    for (; i < n; i++)
+        if (buf[i] != pattern_byte(offset + i))
+            return i;
+    return n;
+}
+
+static void verify(Verifier *v, const void *buf, size_t n)
+{
+    size_t i;
+
+    if (!v->bad) {
+        i = pattern_check(v->offset, buf, n);
+        if (i < n) {
+            v->bad = TRUE;
+            v->bad_offset = v->offset + i;
+        }
+    }
+    v->offset += n;
+}
+
+/* Account for n bytes that were drained without being looked at */
+static void verify_skip(Verifier *v, size_t n)
+{
+    v->blind = TRUE;
+    v->offset += n;
+}
+
+/* Bytes received intact, up to the first that was not */
+static uint64_t verified(const Verifier *v)
+{
+    return v->bad ? v->bad_offset : v->offset;
+}
+
+/* What the stream came to: how much of it arrived intact, where it was cut
+ * off if the connection was reset, and how much of what the server sent
+ * never arrived, if we were told how much that was */
+static void print_verifier(const Verifier *v, Boolean reset, size_t expected)
+{
+    printf("Bytes received: %llu\n", (unsigned long long) v->offset);
+    if (v->blind)
+        puts("Bytes verified: unchecked");
+    else
+        printf("Bytes verified: %llu\n", (unsigned long long) verified(v));
+    if (v->bad)
+        printf("Pattern mismatch at offset: %llu\n",
+               (unsigned long long) v->bad_offset);
+    if (reset)
+        printf("Reset at offset: %llu\n", (unsigned long long) v->offset);
+    if (expected > 0)
+        printf("Bytes lost: %lld of %zu\n",
+               (long long) expected - (long long) verified(v), expected);
+}
+
+/* Shared timeline: with -M name, linger-server -M name on the same host
+ * stamps each connection's accept, writes, shutdown() and close() into a
+ * POSIX shared memory segment, in the slot of the client's port, and we
+ * stamp our connect(), first read, the arrival of the FIN or RST and the
+ * read that ended the stream beside them. Both sides use CLOCK_MONOTONIC,
+ * so the delay from the server's shutdown() or close() to the FIN or RST
+ * arriving falls out directly, apart from however far behind our reads
+ * were. linger-trace -t name prints the merged timeline.
+ *
+ * The layout is shared with linger-server.c and linger-trace.c.
+ */
+
+#define TIMELINE_MAGIC "LNGTIME2"
+#define TIMELINE_SLOTS 65536            /* One per client port */
+
+/* CLOCK_MONOTONIC ns, 0 until it has happened */
+typedef struct {
+    uint64_t connect;                   /* Client: connect() called */
+    uint64_t first_byte;                /* ...first payload read */
+    uint64_t end;                       /* ...the read that ended it */
+    uint64_t end_event;                 /* ...its EVENT_* + 1 */
+    uint64_t hangup;                    /* ...FIN or RST seen to arrive */
+    uint64_t accept;                    /* Server: accept() returned */
+    uint64_t write;                     /* ...first write called */
+    uint64_t write_done;                /* ...last byte taken by the socket */
+    uint64_t shutdown;                  /* ...shutdown() called */
+    uint64_t close;                     /* ...close() called */
+    uint64_t closed;                    /* ...close() returned */
+} TimelineSlot;
+
+typedef struct {
+    char magic[8];
+    uint64_t start;                     /* When the server cleared it */
+    TimelineSlot slots[TIMELINE_SLOTS];
+} Timeline;
+
+#define timeline_mark(slot, field, time) \
+    do { \
+        if ((slot) != NULL) \
+            __atomic_store_n(&(slot)->field, (time), __ATOMIC_RELEASE); \
+    } while (0)
+
+#define timeline_get(slot, field) \
+    __atomic_load_n(&(slot)->field, __ATOMIC_ACQUIRE)
+
+static Timeline *timeline = NULL;
+
+/* The server normally creates the segment, but if we get there first it is
+ * created here and the server clears it when it starts */
+static void timeline_open(const char *name)
+{
+    char path[NAME_MAX];
+    struct stat sb;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    fd = shm_open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1)
+        die("shm_open() timeline");
+    if (fstat(fd, &sb) == -1)
+        die("fstat() timeline");
+    if (sb.st_size < (off_t) sizeof(Timeline) &&
+        ftruncate(fd, sizeof(Timeline)) == -1)
+        die("ftruncate() timeline");
+    timeline = mmap(NULL, sizeof(Timeline), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    if (timeline == MAP_FAILED)
+        die("mmap() timeline");
+    close(fd);
+}
+
+static TimelineSlot *timeline_slot(int fd)
+{
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+
+    if (timeline == NULL)
+        return NULL;
+    if (getsockname(fd, (struct sockaddr *) &local, &len) == -1)
+        die("getsockname()");
+    return &timeline->slots[ntohs(local.sin_port)];
+}
+
+/* Claim the slot of a socket that connect() has just been called on, which
+ * is when it got its port */
+static TimelineSlot *timeline_connect(int fd, uint64_t connecting)
+{
+    TimelineSlot *slot;
+
+    slot = timeline_slot(fd);
+    timeline_mark(slot, first_byte, 0);
+    timeline_mark(slot, end, 0);
+    timeline_mark(slot, end_event, 0);
+    timeline_mark(slot, hangup, 0);
+    timeline_mark(slot, connect, connecting);
+    return slot;
+}
+
+/* Stamp the arrival of the FIN or RST the first time poll() or epoll
+ * reports it, which can be long before a paced reader reads that far */
+static void timeline_hangup(TimelineSlot *slot, uint64_t now)
+{
+    if (slot != NULL && timeline_get(slot, hangup) == 0)
+        timeline_mark(slot, hangup, now);
+}
+
+/* Stamp the end of the stream and work out how long after the server call
+ * that sent what ended it - shutdown() for a FIN, if it was called, and
+ * close() for a RST or otherwise - it arrived, and how long after it our
+ * last read returned. A hangup that nothing reported before the read is
+ * taken to have arrived then, as is one stamped before the call, which
+ * was an earlier FIN ahead of the RST. Returns FALSE if there is no such
+ * call stamped for this connection. */
+static Boolean timeline_end(TimelineSlot *slot, int event, uint64_t end,
+                            int64_t *arrived, int64_t *read,
+                            const char **call)
+{
+    uint64_t accept, shutdown_at, close_at, at, hangup;
+
+    if (slot == NULL)
+        return FALSE;
+    timeline_mark(slot, end, end);
+    timeline_mark(slot, end_event, event + 1);
+    if (event == EVENT_EOF || event == EVENT_RESET)
+        timeline_hangup(slot, end);
+
+    accept = timeline_get(slot, accept);
+    if (accept == 0 || accept < timeline_get(slot, connect))
+        return FALSE;               /* Left over from an earlier run */
+    shutdown_at = timeline_get(slot, shutdown);
+    close_at = timeline_get(slot, close);
+    if (event == EVENT_EOF && shutdown_at != 0) {
+        *call = "shutdown()";
+        at = shutdown_at;
+    } else if ((event == EVENT_EOF || event == EVENT_RESET) && close_at != 0) {
+        *call = "close()";
+        at = close_at;
+    } else if (event == EVENT_RESET && shutdown_at != 0) {
+        *call = "shutdown()";
+        at = shutdown_at;
+    } else {
+        return FALSE;
+    }
+    hangup = timeline_get(slot, hangup);
+    if (hangup < at)
+        hangup = end;
+    *arrived = hangup - at;
+    *read = end - at;
+    return TRUE;
+}
+
+static int connect_to(const char *host, const Options *options)
 {
     int sockfd, n;
+    uint64_t before;
     struct addrinfo hints = {0};
     struct addrinfo *result, *rp;
 
     hints.ai_family = AF_INET;              /* IPv4 */
     hints.ai_socktype = SOCK_STREAM;        /* TCP */
 
-    n = getaddrinfo(host, PORT, &hints, &result);
+    n = getaddrinfo(host, options->port, &hints, &result);
     if (n != 0)
         fatal("getaddrinfo() failed", gai_strerror(n));
 
@@ -103,10 +882,13 @@ static int connect_to(const char *host)
         if (sockfd == -1)
             die("socket() failed");
 
-        set_socket_options(sockfd);
+        set_socket_options(sockfd, options);
 
-        if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) != -1)
+        before = timestamp();
+        if (connect(sockfd, rp->ai_addr, rp->ai_addrlen) != -1) {
+            timeline_connect(sockfd, before);
             break;                  /* Success */
+        }
         perror("connect() failed");
 
         close(sockfd);
@@ -120,77 +902,1357 @@ static int connect_to(const char *host)
     return sockfd;
 }
 
-static void timestamp(struct timeval *tp)
+/* How a single stream ended and how long after connecting it did */
+typedef struct {
+    Verifier verifier;
+    uint64_t start;
+    uint64_t deadline;          /* 0 = wait for ever */
+    uint64_t end;
+    int event;                  /* EVENT_* */
+    int error;                  /* errno behind EVENT_ERROR */
+    TimelineSlot *slot;         /* -M only */
+    Boolean delay_known;        /* From the server call behind the end */
+    int64_t delay;              /* ...to the FIN or RST arriving */
+    int64_t read_delay;         /* ...to the read that saw it */
+    const char *delay_call;
+} Stream;
+
+static void stream_init(Stream *st, int fd, const Options *options)
+{
+    memset(st, 0, sizeof(Stream));
+    st->slot = timeline_slot(fd);
+    st->start = timestamp();
+    if (options->timeout > 0)
+        st->deadline = st->start + options->timeout * NSECS_PER_SEC;
+}
+
+static void stream_end(Stream *st, int event, int error)
+{
+    st->event = event;
+    st->error = error;
+    st->end = timestamp();
+    st->delay_known = timeline_end(st->slot, event, st->end, &st->delay,
+                                   &st->read_delay, &st->delay_call);
+}
+
+/* -M: stamp the FIN or RST if poll() says it has arrived */
+static void stream_hangup(Stream *st, short revents)
 {
-    if (gettimeofday(tp, NULL) == -1)
-        die("gettimeofday() failure");
+    if (revents & (POLL_HANGUP | POLLHUP | POLLERR))
+        timeline_hangup(st->slot, timestamp());
+}
+
+/* Wait for msecs (-1 for ever) or until waitfd is readable, if it isn't
+ * -1, watching fd for the FIN or RST in the meantime so that a paced
+ * reader stamps when it arrived rather than when a read got to it */
+static void stream_pause(Stream *st, int fd, int waitfd, int msecs)
+{
+    struct pollfd pfds[2];
+    uint64_t until = 0, now;
+    int timeout = msecs;
+
+    if (msecs >= 0)
+        until = timestamp() + msecs * 1000000ULL;
+    for (;;) {
+        /* Once stamped, the hangup would only wake us again */
+        pfds[0].fd = st->slot != NULL &&
+                     timeline_get(st->slot, hangup) == 0 ? fd : -1;
+        pfds[0].events = POLL_HANGUP;
+        pfds[0].revents = 0;
+        pfds[1].fd = waitfd;
+        pfds[1].events = POLLIN;
+        pfds[1].revents = 0;
+        if (poll(pfds, 2, timeout) == -1 && errno != EINTR)
+            die("poll()");
+        if (pfds[0].fd != -1)
+            stream_hangup(st, pfds[0].revents);
+        if (waitfd != -1 && (pfds[1].revents & POLLIN))
+            return;
+        if (msecs >= 0) {
+            now = timestamp();
+            if (now >= until)
+                return;
+            timeout = (int) ((until - now + 999999) / 1000000);
+        }
+    }
 }
 
-static double time_diff(const struct timeval *before,
-                        const struct timeval *after)
+/* Wait for the socket to become readable. Return FALSE, having ended the
+ * stream with a timeout, if the deadline passes first. */
+static Boolean stream_wait(Stream *st, int fd)
 {
-    double x, y;
+    struct pollfd pfds[1];
+    uint64_t now;
+    int r;
 
-    x = (double) before->tv_sec + (double) before->tv_usec / 1000000;
-    y = (double) after->tv_sec + (double) after->tv_usec / 1000000;
+    if (st->deadline == 0)
+        return TRUE;
+    for (;;) {
+        now = timestamp();
+        if (now >= st->deadline) {
+            stream_end(st, EVENT_TIMEOUT, 0);
+            return FALSE;
+        }
+        pfds[0].fd = fd;
+        pfds[0].events = POLLIN | POLL_HANGUP;
+        r = poll(pfds, 1, (int) ((st->deadline - now + 999999) / 1000000));
+        if (r > 0) {
+            stream_hangup(st, pfds[0].revents);
+            return TRUE;
+        }
+        if (r == -1 && errno != EINTR)
+            die("poll()");
+    }
+}
+
+/* Look at what a read returned. Return TRUE if it ended the stream. */
+static Boolean stream_read(Stream *st, ssize_t n)
+{
+    if (n > 0) {
+        if (st->slot != NULL && timeline_get(st->slot, first_byte) == 0)
+            timeline_mark(st->slot, first_byte, timestamp());
+        return FALSE;
+    }
+    if (n == 0)
+        stream_end(st, EVENT_EOF, 0);
+    else if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+        return FALSE;
+    else if (errno == ECONNRESET)
+        stream_end(st, EVENT_RESET, 0);
+    else
+        stream_end(st, EVENT_ERROR, errno);
+    return TRUE;
+}
 
-    return y - x;
+/* For readers that only wake up on a timer: end the stream with a timeout
+ * if its deadline has passed */
+static Boolean stream_expired(Stream *st)
+{
+    if (st->deadline == 0 || timestamp() < st->deadline)
+        return FALSE;
+    stream_end(st, EVENT_TIMEOUT, 0);
+    return TRUE;
 }
 
-static void recv_all(int fd, Boolean opt_interactive)
+static void print_stream(const Stream *st, const Options *options)
+{
+    switch (st->event) {
+    case EVENT_EOF:
+        puts("Connection closed");
+        break;
+    case EVENT_RESET:
+        puts("Connection reset");
+        break;
+    case EVENT_TIMEOUT:
+        puts("Connection timed out");
+        break;
+    default:
+        printf("Connection error: %s\n", strerror(st->error));
+        break;
+    }
+    printf("Time to %s (secs): %.9f\n", event_names[st->event],
+           time_diff(st->start, st->end));
+    if (st->delay_known) {
+        printf("Server %s to %s arriving (usecs): %.3f\n", st->delay_call,
+               event_names[st->event], st->delay / 1000.0);
+        printf("Server %s to %s read (usecs): %.3f\n", st->delay_call,
+               event_names[st->event], st->read_delay / 1000.0);
+    }
+    else if (st->slot != NULL)
+        puts("Server shutdown()/close() not in the timeline");
+    print_verifier(&st->verifier, st->event == EVENT_RESET,
+                   options->expected);
+}
+
+/* Drain mode. readv() scatters each read over DRAIN_IOVS page-sized-and-up
+ * buffers, MSG_TRUNC has TCP throw the data away without copying it and
+ * splice() moves it through a pipe to /dev/null, so that the client
+ * keeps up with whatever the server can push. */
+typedef struct {
+    int method;                 /* DRAIN_* */
+    char *buf;
+    struct iovec iov[DRAIN_IOVS];
+    int pipefd[2];
+    int nullfd;
+} Drain;
+
+static void drain_init(Drain *d, int method)
+{
+    int i;
+
+    memset(d, 0, sizeof(Drain));
+    d->method = method;
+    d->pipefd[0] = d->pipefd[1] = d->nullfd = -1;
+
+    if (method == DRAIN_READV) {
+        d->buf = malloc(DRAIN_CHUNK);
+        if (d->buf == NULL)
+            fatal(NULL, "out of memory");
+        for (i = 0; i < DRAIN_IOVS; i++) {
+            d->iov[i].iov_base = d->buf + i * DRAIN_IOV_SIZE;
+            d->iov[i].iov_len = DRAIN_IOV_SIZE;
+        }
+    }
+#ifdef __linux__
+    if (method == DRAIN_SPLICE) {
+        if (pipe2(d->pipefd, O_CLOEXEC) == -1)
+            die("pipe2()");
+        /* One splice() per DRAIN_CHUNK if the pipe can be made that big */
+        fcntl(d->pipefd[1], F_SETPIPE_SZ, DRAIN_CHUNK);
+        d->nullfd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (d->nullfd == -1)
+            die("open() /dev/null");
+    }
+#endif
+}
+
+static void drain_free(Drain *d)
+{
+    free(d->buf);
+    if (d->pipefd[0] != -1) {
+        close(d->pipefd[0]);
+        close(d->pipefd[1]);
+    }
+    if (d->nullfd != -1)
+        close(d->nullfd);
+}
+
+/* Take at most max bytes off the socket, returning what read() would */
+static ssize_t drain_recv(Drain *d, int fd, size_t max, Verifier *v)
+{
+    ssize_t n;
+    int iovcnt;
+#ifdef __linux__
+    ssize_t m, done;
+#endif
+
+    if (max > DRAIN_CHUNK)
+        max = DRAIN_CHUNK;
+
+    switch (d->method) {
+#ifdef __linux__
+    case DRAIN_TRUNC:
+        n = recv(fd, NULL, max, MSG_TRUNC);
+        if (n > 0)
+            verify_skip(v, n);
+        return n;
+    case DRAIN_SPLICE:
+        n = splice(fd, NULL, d->pipefd[1], NULL, max, SPLICE_F_MOVE);
+        /* The pipe is emptied every time, so the next splice() from the
+         * socket never waits on it */
+        for (done = 0; done < n; done += m) {
+            m = splice(d->pipefd[0], NULL, d->nullfd, NULL, n - done,
+                       SPLICE_F_MOVE);
+            if (m == -1) {
+                if (errno != EINTR)
+                    die("splice() to /dev/null");
+                m = 0;
+            }
+        }
+        if (n > 0)
+            verify_skip(v, n);
+        return n;
+#endif
+    default:
+        iovcnt = (int) ((max + DRAIN_IOV_SIZE - 1) / DRAIN_IOV_SIZE);
+        d->iov[iovcnt - 1].iov_len = max - (iovcnt - 1) * DRAIN_IOV_SIZE;
+        n = readv(fd, d->iov, iovcnt);
+        d->iov[iovcnt - 1].iov_len = DRAIN_IOV_SIZE;
+        if (n > 0)
+            verify(v, d->buf, n);
+        return n;
+    }
+}
+
+#ifdef __linux__
+
+static void send_ready(int fd)
+{
+    char c = READY_BYTE;
+
+    if (send(fd, &c, 1, MSG_NOSIGNAL) != 1)
+        die("sending ready byte");
+}
+
+#endif
+
+static void recv_drain(int fd, const Options *options)
+{
+    Drain d;
+    Stream st;
+    ssize_t n;
+
+    drain_init(&d, options->drain);
+#ifdef __linux__
+    if (options->fast)
+        send_ready(fd);
+#endif
+
+    stream_init(&st, fd, options);
+    for (;;) {
+        if (!stream_wait(&st, fd))
+            break;
+        n = drain_recv(&d, fd, DRAIN_CHUNK, &st.verifier);
+        if (stream_read(&st, n))
+            break;
+    }
+
+    printf("RECV: %llu bytes\n", (unsigned long long) st.verifier.offset);
+    print_stream(&st, options);
+    drain_free(&d);
+}
+
+static void recv_all(int fd, const Options *options)
 {
     char buf[READ_SIZE];
+    Stream st;
     int n, total;
 
+    stream_init(&st, fd, options);
     total = 0;
-    while ((n = read(fd, buf, READ_SIZE)) != 0) {
+    for (;;) {
+        if (!stream_wait(&st, fd))
+            break;
+        n = read(fd, buf, READ_SIZE);
+        if (stream_read(&st, n))
+            break;
         if (n == -1)
-            die("socket read()");
+            continue;
+        verify(&st.verifier, buf, n);
         total += n;
         printf("RECV: %d (%d)\n", n, total);
 
-        if (opt_interactive) {
+        if (options->interactive) {
             printf("Press RETURN to read next %d bytes: ", READ_SIZE);
             while (getchar() != '\n')
                 ;
         } else {
-            sleep(WAIT_TIME);
+            stream_pause(&st, fd, -1, WAIT_TIME * 1000);
         }
     }
-    puts("Connection closed");
+    print_stream(&st, options);
 }
 
-int main(int argc, char *argv[])
+#ifdef __linux__
+
+static int start_read_timer(long interval)
 {
-    int sockfd;
-    struct timeval tv1, *tp_start = &tv1;
-    struct timeval tv2, *tp_end = &tv2;
-    char *hostname;
-    Boolean opt_interactive = FALSE;
+    struct itimerspec its;
+    int tfd;
+
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (tfd == -1)
+        die("timerfd_create()");
+    its.it_value.tv_sec = interval / 1000000;
+    its.it_value.tv_nsec = interval % 1000000 * 1000;
+    its.it_interval = its.it_value;
+    if (timerfd_settime(tfd, 0, &its, NULL) == -1)
+        die("timerfd_settime()");
+    return tfd;
+}
+
+/* Return the number of timer expirations since the last call, waiting for
+ * at least one if block is set */
+static uint64_t timer_ticks(int tfd, Boolean block)
+{
+    struct pollfd pfds[1];
+    uint64_t ticks;
+
+    for (;;) {
+        if (read(tfd, &ticks, sizeof(ticks)) == sizeof(ticks))
+            return ticks;
+        if (errno != EAGAIN)
+            die("read() timerfd");
+        if (!block)
+            return 0;
+        pfds[0].fd = tfd;
+        pfds[0].events = POLLIN;
+        if (poll(pfds, 1, -1) == -1 && errno != EINTR)
+            die("poll()");
+    }
+}
+
+/* Fast mode: tell the server we're ready and then read read_bytes on every
+ * tick of a timerfd. Missed ticks are made up on the next one, so the
+ * average receive rate is exact and the server's send buffer still fills
+ * up the way it does with sleep(WAIT_TIME) - just in milliseconds rather
+ * than minutes. */
+static void recv_paced(int fd, const Options *options)
+{
+    char *buf;
+    long total, budget;
+    Stream st;
+    ssize_t n;
+    int tfd;
+
+    buf = malloc(options->read_bytes);
+    if (buf == NULL)
+        fatal(NULL, "out of memory");
+
+    send_ready(fd);
+    if (options->read_interval > 0) {
+        printf("Read schedule: %ld bytes every %ld usecs\n",
+               options->read_bytes, options->read_interval);
+        tfd = start_read_timer(options->read_interval);
+    } else {
+        tfd = -1;
+    }
+
+    stream_init(&st, fd, options);
+    total = 0;
+    for (;;) {
+        if (tfd != -1) {
+            stream_pause(&st, fd, tfd, -1);
+            budget = timer_ticks(tfd, FALSE) * options->read_bytes;
+            if (stream_expired(&st))
+                goto closed;
+        } else {
+            budget = LONG_MAX;
+        }
+        while (budget > 0) {
+            if (tfd == -1 && !stream_wait(&st, fd))
+                goto closed;
+            n = recv(fd, buf, budget < options->read_bytes ?
+                              budget : options->read_bytes,
+                     tfd != -1 ? MSG_DONTWAIT : 0);
+            if (stream_read(&st, n))
+                goto closed;
+            if (n == -1) {
+                if (errno == EINTR)
+                    continue;
+                break;          /* Nothing more until the next tick */
+            }
+            verify(&st.verifier, buf, n);
+            total += n;
+            budget -= n;
+        }
+    }
+
+closed:
+    printf("RECV: %ld bytes\n", total);
+    print_stream(&st, options);
+    if (tfd != -1)
+        close(tfd);
+    free(buf);
+}
+
+/* Hierarchical timer wheel: WHEEL_LEVELS rings of WHEEL_SLOTS lists, each
+ * level WHEEL_SLOTS times coarser than the one below, with a tick of
+ * WHEEL_TICK ns. A timer goes into the finest level whose span covers its
+ * expiry, and is moved down a level whenever the level below wraps, so
+ * adding and cancelling are O(1) and each timer is touched at most
+ * WHEEL_LEVELS times before it fires. Timers are embedded in the objects
+ * that own them; firing one calls its function, which may free it. The
+ * same wheel as linger-server.c's.
+ */
+
+typedef struct Timer Timer;
+typedef void (*TimerFn)(void *owner, void *data);
+
+struct Timer {
+    Timer *next;
+    Timer **pprev;              /* NULL when not armed */
+    uint64_t expires;           /* In ticks */
+    TimerFn fn;
+    void *owner;
+    void *data;
+};
+
+typedef struct {
+    uint64_t now;               /* Every tick before this one has been run */
+    long count;
+    Timer *due;                 /* Expired, waiting for wheel_expire() */
+    Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+static void wheel_init(TimerWheel *wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(TimerWheel));
+    wheel->now = now / WHEEL_TICK;
+}
+
+static void timer_init(Timer *t, TimerFn fn, void *owner, void *data)
+{
+    memset(t, 0, sizeof(Timer));
+    t->fn = fn;
+    t->owner = owner;
+    t->data = data;
+}
+
+static void timer_link(Timer **head, Timer *t)
+{
+    t->next = *head;
+    if (t->next != NULL)
+        t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+static void timer_unlink(Timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+}
+
+static void wheel_place(TimerWheel *wheel, Timer *t)
+{
+    uint64_t delta;
+    int level;
 
-    if (argc == 2) {
-        if (strcmp("-h", argv[1]) == 0)
-            usage_exit(argv[0], NULL);
+    if (t->expires <= wheel->now) {
+        timer_link(&wheel->due, t);
+        return;
+    }
+    delta = t->expires - wheel->now;
+    /* The span of the top level (about 12 days) is well past any pacing
+     * period, so every timer fits */
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+        if (delta < 1ULL << (WHEEL_BITS * (level + 1)))
+            break;
+    timer_link(&wheel->slots[level][(t->expires >> (WHEEL_BITS * level)) &
+                                    (WHEEL_SLOTS - 1)], t);
+}
+
+static void wheel_add(TimerWheel *wheel, Timer *t, uint64_t expires)
+{
+    t->expires = (expires + WHEEL_TICK - 1) / WHEEL_TICK;
+    wheel_place(wheel, t);
+    wheel->count++;
+}
+
+static void wheel_cancel(TimerWheel *wheel, Timer *t)
+{
+    if (t->pprev == NULL)
+        return;
+    timer_unlink(t);
+    wheel->count--;
+}
+
+/* Move every timer in a slot of a coarser level down to where it now
+ * belongs */
+static void wheel_cascade(TimerWheel *wheel, int level)
+{
+    Timer *t, **slot;
+
+    slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) &
+                                (WHEEL_SLOTS - 1)];
+    while ((t = *slot) != NULL) {
+        timer_unlink(t);
+        wheel_place(wheel, t);
+    }
+}
+
+/* Run the wheel up to now, then fire everything that has expired */
+static void wheel_expire(TimerWheel *wheel, uint64_t now)
+{
+    uint64_t target = now / WHEEL_TICK;
+    Timer *t, **slot;
+    int level;
+
+    while (wheel->now < target) {
+        if (wheel->count == 0) {
+            wheel->now = target;
+            break;
+        }
+        wheel->now++;
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel->now & ((1ULL << (WHEEL_BITS * level)) - 1))
+                break;
+            wheel_cascade(wheel, level);
+        }
+        slot = &wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)];
+        while ((t = *slot) != NULL) {
+            timer_unlink(t);
+            timer_link(&wheel->due, t);
+        }
+    }
+
+    while ((t = wheel->due) != NULL) {
+        timer_unlink(t);
+        wheel->count--;
+        t->fn(t->owner, t->data);
+    }
+}
+
+/* Milliseconds until wheel_expire() next has work, or -1 if it has none.
+ * Only the finest level is searched; anything further out is woken for
+ * at the next cascade, at most WHEEL_SLOTS ticks away. */
+static int wheel_timeout(const TimerWheel *wheel, uint64_t now)
+{
+    uint64_t next, i;
+
+    if (wheel->count == 0)
+        return -1;
+    if (wheel->due != NULL)
+        return 0;
+    next = (wheel->now | (WHEEL_SLOTS - 1)) + 1;
+    for (i = wheel->now + 1; i < next; i++) {
+        if (wheel->slots[0][i & (WHEEL_SLOTS - 1)] != NULL) {
+            next = i;
+            break;
+        }
+    }
+    next *= WHEEL_TICK;
+    if (next <= now)
+        return 0;
+    return (int) ((next - now + 999999) / 1000000);
+}
+
+/* Load mode: each thread runs its own epoll loop, opening its share of the
+ * connections at its share of the arrival rate and draining every one of
+ * them as fast as it can. The outcome of each connection is kept so that
+ * distributions can be reported once all threads have finished.
+ */
+
+#define CONN_CONNECTING 0
+#define CONN_RECEIVING 1
+
+#define OUTCOME_EOF 0
+#define OUTCOME_RESET 1
+#define OUTCOME_TIMEOUT 2
+#define OUTCOME_ERROR 3
+#define OUTCOME_CONNECT_FAILED 4
+#define NUM_OUTCOMES 5
+
+static const char *outcome_names[NUM_OUTCOMES] = {
+    "EOF", "Reset", "Timeout", "Error", "Connect failed"
+};
+
+typedef struct {
+    long count;
+    long corrupt;               /* Connections with a pattern mismatch */
+    Histogram recv_time;
+    Histogram bytes;
+    Histogram lost;             /* Bytes short of options->expected */
+    Histogram fin_delay;        /* Server shutdown()/close() to FIN/RST */
+    Histogram last_read;        /* ...to the read that ended the stream */
+} Results;
+
+typedef struct Conn Conn;
+
+struct Conn {
+    int fd;
+    int state;
+    long bytes;
+    uint64_t connecting;        /* connect() called, 0 if it returned 0 */
+    uint64_t start;
+    TimelineSlot *slot;         /* -M only */
+    Timer pace;                 /* -L: next read */
+    double rate;                /* -L: bytes/sec */
+    double credit;              /* -L: bytes that may be read now */
+    double burst;               /* -L: most credit that can build up */
+    uint64_t period;            /* -L: ns between reads */
+    uint64_t paced;             /* -L: when credit was last added */
+    Verifier verifier;
+    Conn *prev;                 /* Links in the receiving list */
+    Conn *next;
+};
+
+typedef struct {
+    pthread_t tid;
+    const Options *options;
+    const struct sockaddr *addr;
+    socklen_t addrlen;
+    long conns;                 /* Connections this thread opens */
+    double interval;            /* Seconds between connects, 0 = no pacing */
+    int epfd;
+    long opened;
+    long active;
+    uint64_t next_connect;
+    int tfd;                    /* Read pacing timer, fast mode only */
+    Conn *head;                 /* Receiving connections, oldest first, */
+    Conn *tail;                 /* read on each timer tick if paced */
+    Drain drain;
+    Results results[NUM_OUTCOMES];
+    long next_src;              /* -S: next source address to bind */
+    Histogram connect_call;     /* Time in connect() itself */
+    Histogram handshake;        /* connect() to writable */
+    uint64_t first_connect;
+    uint64_t last_connect;
+    long deferred;              /* -O: connect() left the SYN to the write */
+    long syn_data;              /* ...and the server acked the SYN's data */
+    TimerWheel wheel;           /* -L: every connection's next read */
+    unsigned seed;              /* -L: rand_r() state */
+    Histogram rates;            /* -L: drawn, bytes/sec */
+    Histogram achieved;         /* -L: bytes over recv time, bytes/sec */
+    Histogram share;            /* -L: achieved as a percentage of drawn */
+} LoadThread;
+
+static void resolve_addr(const char *host, const char *port,
+                         struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    int n;
+    struct addrinfo hints = {0};
+    struct addrinfo *result;
+
+    hints.ai_family = AF_INET;              /* IPv4 */
+    hints.ai_socktype = SOCK_STREAM;        /* TCP */
+
+    n = getaddrinfo(host, port, &hints, &result);
+    if (n != 0)
+        fatal("getaddrinfo() failed", gai_strerror(n));
+
+    memcpy(addr, result->ai_addr, result->ai_addrlen);
+    *addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+}
+
+static void add_result(LoadThread *t, Conn *c, int outcome)
+{
+    Results *res = &t->results[outcome];
+    const char *call;
+    uint64_t now;
+    int64_t delay, read_delay;
+
+    res->count++;
+    if (outcome == OUTCOME_CONNECT_FAILED)
+        return;
+    now = timestamp();
+    hist_record(&res->recv_time, now - c->start);
+    /* The other outcomes are numbered as the EVENT_*s */
+    if (timeline_end(c->slot, outcome, now, &delay, &read_delay, &call)) {
+        hist_record(&res->fin_delay, delay > 0 ? delay : 0);
+        hist_record(&res->last_read, read_delay > 0 ? read_delay : 0);
+    }
+    hist_record(&res->bytes, c->bytes);
+    if (c->verifier.bad)
+        res->corrupt++;
+    if (t->options->expected > verified(&c->verifier))
+        hist_record(&res->lost, t->options->expected - verified(&c->verifier));
+    else if (t->options->expected > 0)
+        hist_record(&res->lost, 0);
+}
+
+/* -L: the rate a stream that ran to EOF was read at, and how close that
+ * came to the rate it drew. Short of 100% means the server, not the
+ * reader, was the bottleneck. A reset is left out, as it cut the stream
+ * short wherever the reader had got to. */
+static void pace_account(LoadThread *t, Conn *c)
+{
+    double elapsed, achieved;
+
+    elapsed = time_diff(c->start, timestamp());
+    if (elapsed <= 0 || c->bytes == 0)
+        return;
+    achieved = c->bytes / elapsed;
+    hist_record(&t->achieved, (uint64_t) achieved);
+    hist_record(&t->share, (uint64_t) (100 * achieved / c->rate + 0.5));
+}
+
+static void load_conn_end(LoadThread *t, Conn *c, int outcome)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    wheel_cancel(&t->wheel, &c->pace);
+    if (t->options->rate_dist != RATE_NONE && outcome == OUTCOME_EOF)
+        pace_account(t, c);
+    if (t->options->fastopen && c->state == CONN_RECEIVING &&
+        getsockopt(c->fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+        (info.tcpi_options & TCPI_OPT_SYN_DATA))
+        t->syn_data++;
+    if (c->state == CONN_RECEIVING) {
+        if (c->prev != NULL)
+            c->prev->next = c->next;
         else
-            hostname = argv[1];
-    } else if (argc == 3) {
-        if (strcmp("-i", argv[1]) == 0)
-            opt_interactive = TRUE;
+            t->head = c->next;
+        if (c->next != NULL)
+            c->next->prev = c->prev;
         else
-            usage_exit(argv[0], "invalid option");
-        hostname = argv[2];
+            t->tail = c->prev;
+    }
+    add_result(t, c, outcome);
+    close(c->fd);
+    free(c);
+    t->active--;
+}
+
+/* Read until the socket would block or budget bytes have been read.
+ * Returns FALSE if the connection ended, and c has been freed. */
+static Boolean load_recv(LoadThread *t, Conn *c, long budget)
+{
+    char buf[LOAD_READ_SIZE];
+    ssize_t n;
+
+    while (budget > 0) {
+        if (t->drain.method != DRAIN_NONE) {
+            n = drain_recv(&t->drain, c->fd, budget, &c->verifier);
+        } else {
+            n = read(c->fd, buf, budget < LOAD_READ_SIZE ?
+                                 budget : LOAD_READ_SIZE);
+            if (n > 0)
+                verify(&c->verifier, buf, n);
+        }
+        if (n > 0) {
+            if (c->bytes == 0)
+                timeline_mark(c->slot, first_byte, timestamp());
+            c->bytes += n;
+            budget -= n;
+            continue;
+        }
+        if (n == 0) {
+            load_conn_end(t, c, OUTCOME_EOF);
+        } else if (errno == ECONNRESET) {
+            load_conn_end(t, c, OUTCOME_RESET);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                   errno != EINTR) {
+            load_conn_end(t, c, OUTCOME_ERROR);
+        } else {
+            return TRUE;
+        }
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* -L: slow consumers. Each connection draws a read rate when it connects
+ * and gets a timer on the thread's wheel. Every period it is credited
+ * with rate x elapsed bytes, up to two periods' worth so that a late tick
+ * catches up but an empty socket doesn't bank credit, and reads up to
+ * that much. The period is one read of -F bytes at the drawn rate, but no
+ * less than a wheel tick, so thousands of readers cost one epoll loop and
+ * a timer each.
+ */
+
+/* u^(-1/shape) for u in (0, 1), without libm: -ln(u) from the atanh
+ * series once u has been doubled into [0.5, 1), then e^x from the Taylor
+ * series once x has been halved below 1, squared back up */
+static double pareto_scale(double u, double shape)
+{
+    double x = 0, z, z2, term, sum;
+    int i, halvings = 0;
+
+    while (u < 0.5) {
+        u *= 2;
+        x += LN2;
+    }
+    z = (u - 1) / (u + 1);
+    z2 = z * z;
+    term = z;
+    sum = 0;
+    for (i = 1; i < 40; i += 2) {
+        sum += term / i;
+        term *= z2;
+    }
+    x = (x - 2 * sum) / shape;
+    if (x > 40)                 /* e^40 is past RATE_MAX / 1 byte/sec */
+        return RATE_MAX;
+
+    while (x > 1) {
+        x /= 2;
+        halvings++;
+    }
+    sum = 1;
+    term = 1;
+    for (i = 1; i < 20; i++) {
+        term *= x / i;
+        sum += term;
+    }
+    while (halvings-- > 0)
+        sum *= sum;
+    return sum;
+}
+
+static double draw_rate(LoadThread *t)
+{
+    const Options *options = t->options;
+    double u, rate;
+
+    u = (rand_r(&t->seed) + 1.0) / (RAND_MAX + 2.0);
+    switch (options->rate_dist) {
+    case RATE_UNIFORM:
+        return options->rate_min +
+               u * (options->rate_param - options->rate_min);
+    case RATE_PARETO:
+        rate = options->rate_min * pareto_scale(u, options->rate_param);
+        return rate < RATE_MAX ? rate : RATE_MAX;
+    default:
+        return options->rate_min;
+    }
+}
+
+static void load_pace(void *owner, void *data)
+{
+    LoadThread *t = owner;
+    Conn *c = data;
+    uint64_t now;
+    long before;
+
+    now = timestamp();
+    c->credit += c->rate * time_diff(c->paced, now);
+    if (c->credit > c->burst)
+        c->credit = c->burst;
+    c->paced = now;
+    if (c->credit >= 1) {
+        before = c->bytes;
+        if (!load_recv(t, c, (long) c->credit))
+            return;
+        c->credit -= c->bytes - before;
+    }
+    wheel_add(&t->wheel, &c->pace, now + c->period);
+}
+
+static void pace_start(LoadThread *t, Conn *c)
+{
+    double period;
+
+    c->rate = draw_rate(t);
+    hist_record(&t->rates, (uint64_t) c->rate);
+    period = t->options->read_bytes / c->rate;
+    if (period < (double) WHEEL_TICK / NSECS_PER_SEC)
+        period = (double) WHEEL_TICK / NSECS_PER_SEC;
+    else if (period > TIME_MAX)
+        period = TIME_MAX;
+    c->period = (uint64_t) (period * NSECS_PER_SEC);
+    c->burst = 2 * c->rate * period;
+    c->credit = 0;
+    c->paced = c->start;
+    timer_init(&c->pace, load_pace, t, c);
+    wheel_add(&t->wheel, &c->pace, c->start + c->period);
+}
+
+static Boolean load_paced(const LoadThread *t)
+{
+    return t->tfd != -1 || t->options->rate_dist != RATE_NONE;
+}
+
+static void load_connected(LoadThread *t, Conn *c)
+{
+    struct epoll_event ev;
+    int err;
+    socklen_t len = sizeof(err);
+    char ready = READY_BYTE;
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        die("getsockopt() SO_ERROR");
+    if (err != 0) {
+        load_conn_end(t, c, OUTCOME_CONNECT_FAILED);
+        return;
+    }
+
+    /* Appending keeps the list in deadline order for -T */
+    c->start = timestamp();
+    if (c->connecting != 0)
+        hist_record(&t->handshake, c->start - c->connecting);
+    c->state = CONN_RECEIVING;
+    c->prev = t->tail;
+    c->next = NULL;
+    if (t->tail != NULL)
+        t->tail->next = c;
+    else
+        t->head = c;
+    t->tail = c;
+
+    if (t->options->fast && send(c->fd, &ready, 1, MSG_NOSIGNAL) != 1) {
+        load_conn_end(t, c, OUTCOME_ERROR);
+        return;
+    }
+
+    /* Paced connections are read from the timer tick or the wheel. Epoll
+     * is left to report, once, that the FIN or RST has arrived. */
+    if (load_paced(t)) {
+        ev.events = EPOLLRDHUP | EPOLLET;
     } else {
-        usage_exit(argv[0], NULL);
+        ev.events = EPOLLIN | EPOLLRDHUP;
+    }
+    ev.data.ptr = c;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+        die("epoll_ctl() EPOLL_CTL_MOD");
+    if (t->options->rate_dist != RATE_NONE)
+        pace_start(t, c);
+}
+
+/* -S: bind fd to the next source address, leaving its port to connect(),
+ * which can then reuse a port across destinations */
+static void bind_source(LoadThread *t, int fd)
+{
+    struct sockaddr_in src;
+    int one = 1;
+
+    if (setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one,
+                   sizeof(one)) == -1)
+        die("setting IP_BIND_ADDRESS_NO_PORT");
+    memset(&src, 0, sizeof(src));
+    src.sin_family = AF_INET;
+    src.sin_addr.s_addr = htonl(t->options->src_first +
+                                t->next_src++ % t->options->src_count);
+    if (bind(fd, (struct sockaddr *) &src, sizeof(src)) == -1)
+        die("bind() source address");
+}
+
+static void load_connect(LoadThread *t)
+{
+    struct epoll_event ev;
+    uint64_t before, after;
+    Conn *c;
+    int fd, r, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1)
+        die("socket() failed");
+    set_socket_options(fd, t->options);
+    if (t->options->src_count > 0)
+        bind_source(t, fd);
+    /* connect() returns 0 at once if we hold a cookie, and the SYN waits
+     * for the ready byte to carry */
+    if (t->options->fastopen &&
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one,
+                   sizeof(one)) == -1)
+        die("setting TCP_FASTOPEN_CONNECT");
+
+    c = calloc(1, sizeof(Conn));
+    if (c == NULL)
+        fatal(NULL, "out of memory");
+    c->fd = fd;
+    t->opened++;
+    t->active++;
+
+    before = timestamp();
+    r = connect(fd, t->addr, t->addrlen);
+    after = timestamp();
+    hist_record(&t->connect_call, after - before);
+    if (t->first_connect == 0)
+        t->first_connect = before;
+    t->last_connect = after;
+    if (r == -1 && errno != EINPROGRESS) {
+        load_conn_end(t, c, OUTCOME_CONNECT_FAILED);
+        return;
+    }
+    c->slot = timeline_connect(fd, before);
+    c->state = CONN_CONNECTING;
+    c->connecting = r == 0 ? 0 : before;
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        die("epoll_ctl() EPOLL_CTL_ADD");
+    if (r == 0) {
+        t->deferred++;
+        load_connected(t, c);
+    }
+}
+
+static void load_tick(LoadThread *t)
+{
+    Conn *c, *next;
+    long budget;
+
+    budget = timer_ticks(t->tfd, FALSE) * t->options->read_bytes;
+    if (budget == 0)
+        return;
+    for (c = t->head; c != NULL; c = next) {
+        next = c->next;
+        load_recv(t, c, budget);
+    }
+}
+
+/* Open whichever connections are due and return the epoll timeout (ms)
+ * until the next batch is. Unpaced, one batch is opened per call and the
+ * rest wait for the events in between. */
+static int load_arrivals(LoadThread *t)
+{
+    uint64_t now;
+    long i, batch;
+
+    batch = t->options->batch;
+    if (batch == 0)
+        batch = t->interval > 0 ? 1 : LONG_MAX;
+    while (t->opened < t->conns) {
+        if (t->interval > 0) {
+            now = timestamp();
+            if (t->next_connect > now)
+                return (int) ((t->next_connect - now) / 1000000) + 1;
+            t->next_connect += (uint64_t) (t->interval * batch *
+                                           NSECS_PER_SEC);
+        }
+        for (i = 0; i < batch && t->opened < t->conns; i++)
+            load_connect(t);
+        if (t->interval == 0)
+            return t->opened < t->conns ? 0 : -1;
     }
+    return -1;
+}
 
-    sockfd = connect_to(hostname);
-    timestamp(tp_start);
+/* End every connection that has been receiving for longer than -T and
+ * return the epoll timeout (ms) until the next one will have */
+static int load_expire(LoadThread *t)
+{
+    uint64_t now, limit;
 
-    recv_all(sockfd, opt_interactive);
+    if (t->options->timeout == 0)
+        return -1;
+    limit = t->options->timeout * NSECS_PER_SEC;
+    now = timestamp();
+    while (t->head != NULL && now - t->head->start >= limit)
+        load_conn_end(t, t->head, OUTCOME_TIMEOUT);
+    if (t->head == NULL)
+        return -1;
+    return (int) ((t->head->start + limit - now) / 1000000) + 1;
+}
+
+static void *load_thread(void *arg)
+{
+    LoadThread *t = arg;
+    struct epoll_event events[MAX_EVENTS], ev;
+    Conn *c;
+    uint64_t now;
+    int i, n, timeout, expiry, pacing;
+
+    drain_init(&t->drain, t->options->drain);
+    t->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (t->epfd == -1)
+        die("epoll_create1()");
+    t->next_connect = timestamp();
+    wheel_init(&t->wheel, t->next_connect);
+
+    t->tfd = -1;
+    if (t->options->fast && t->options->read_interval > 0) {
+        t->tfd = start_read_timer(t->options->read_interval);
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->tfd, &ev) == -1)
+            die("epoll_ctl() EPOLL_CTL_ADD");
+    }
+
+    for (;;) {
+        timeout = load_arrivals(t);
+        expiry = load_expire(t);
+        if (t->opened == t->conns && t->active == 0)
+            break;
+        if (expiry != -1 && (timeout == -1 || expiry < timeout))
+            timeout = expiry;
+        pacing = wheel_timeout(&t->wheel, timestamp());
+        if (pacing != -1 && (timeout == -1 || pacing < timeout))
+            timeout = pacing;
+
+        n = epoll_wait(t->epfd, events, MAX_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait()");
+        }
+        now = timestamp();
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+            if (c == NULL) {
+                load_tick(t);
+            } else if (c->state == CONN_CONNECTING) {
+                load_connected(t, c);
+            } else {
+                if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    timeline_hangup(c->slot, now);
+                if (!load_paced(t))
+                    load_recv(t, c, LONG_MAX);
+            }
+        }
+        wheel_expire(&t->wheel, timestamp());
+    }
+
+    if (t->tfd != -1)
+        close(t->tfd);
+    close(t->epfd);
+    drain_free(&t->drain);
+    return NULL;
+}
+
+/* How fast connections were set up: the time in connect() and to the
+ * handshake, and the rate over the span from the first connect() to the
+ * last - the most one process managed, when nothing held it back */
+static void print_connects(LoadThread *threads, int nthreads,
+                           const Options *options)
+{
+    Histogram *call, *handshake;
+    uint64_t first = 0, last = 0;
+    long opened = 0, deferred = 0, syn_data = 0;
+    int t;
+
+    call = calloc(1, sizeof(Histogram));
+    handshake = calloc(1, sizeof(Histogram));
+    if (call == NULL || handshake == NULL)
+        fatal(NULL, "out of memory");
+    for (t = 0; t < nthreads; t++) {
+        hist_merge(call, &threads[t].connect_call);
+        hist_merge(handshake, &threads[t].handshake);
+        opened += threads[t].opened;
+        deferred += threads[t].deferred;
+        syn_data += threads[t].syn_data;
+        if (threads[t].first_connect != 0 &&
+            (first == 0 || threads[t].first_connect < first))
+            first = threads[t].first_connect;
+        if (threads[t].last_connect > last)
+            last = threads[t].last_connect;
+    }
+
+    printf("Connects/sec: %.1f (%ld connect() calls in %.6f secs)\n",
+           last > first ? opened / time_diff(first, last) : 0.0, opened,
+           last > first ? time_diff(first, last) : 0.0);
+    hist_print("Time in connect() (usecs)", call, 1000, 3);
+    hist_print("Handshake (usecs)", handshake, 1000, 3);
+    if (options->fastopen)
+        printf("Fast Open: %ld connects deferred to the SYN with data, "
+               "%ld had it acked\n", deferred, syn_data);
+    free(call);
+    free(handshake);
+}
+
+/* -L: the rates drawn and the rates achieved */
+static void print_pacing(LoadThread *threads, int nthreads)
+{
+    Histogram *rates, *achieved, *share;
+    int t;
+
+    rates = calloc(1, sizeof(Histogram));
+    achieved = calloc(1, sizeof(Histogram));
+    share = calloc(1, sizeof(Histogram));
+    if (rates == NULL || achieved == NULL || share == NULL)
+        fatal(NULL, "out of memory");
+    for (t = 0; t < nthreads; t++) {
+        hist_merge(rates, &threads[t].rates);
+        hist_merge(achieved, &threads[t].achieved);
+        hist_merge(share, &threads[t].share);
+    }
+
+    hist_print("Read rate drawn (KB/sec)", rates, 1024, 1);
+    hist_print("Read rate achieved to EOF (KB/sec)", achieved, 1024, 1);
+    hist_print("Achieved / drawn (%)", share, 1, 0);
+    free(rates);
+    free(achieved);
+    free(share);
+}
+
+static void print_load_results(LoadThread *threads, int nthreads,
+                               long total, double elapsed)
+{
+    Results *sum;
+    int t, outcome;
+
+    sum = calloc(1, sizeof(Results));
+    if (sum == NULL)
+        fatal(NULL, "out of memory");
+
+    printf("Connections: %ld\n", total);
+    printf("Elapsed (secs): %.3f\n", elapsed);
+    printf("Connections/sec: %.1f\n", elapsed > 0 ? total / elapsed : 0.0);
+    print_connects(threads, nthreads, threads[0].options);
+    if (threads[0].options->rate_dist != RATE_NONE)
+        print_pacing(threads, nthreads);
+
+    for (outcome = 0; outcome < NUM_OUTCOMES; outcome++) {
+        memset(sum, 0, sizeof(Results));
+        for (t = 0; t < nthreads; t++) {
+            sum->count += threads[t].results[outcome].count;
+            sum->corrupt += threads[t].results[outcome].corrupt;
+            hist_merge(&sum->recv_time, &threads[t].results[outcome].recv_time);
+            hist_merge(&sum->bytes, &threads[t].results[outcome].bytes);
+            hist_merge(&sum->lost, &threads[t].results[outcome].lost);
+            hist_merge(&sum->fin_delay,
+                       &threads[t].results[outcome].fin_delay);
+            hist_merge(&sum->last_read,
+                       &threads[t].results[outcome].last_read);
+        }
+        if (sum->count == 0)
+            continue;
+        printf("%s: %ld\n", outcome_names[outcome], sum->count);
+        hist_print("    Recv time (usecs)", &sum->recv_time, 1000, 3);
+        hist_print("    Bytes received", &sum->bytes, 1, 0);
+        hist_print("    Bytes lost", &sum->lost, 1, 0);
+        hist_print("    Server shutdown()/close() to FIN/RST (usecs)",
+                   &sum->fin_delay, 1000, 3);
+        hist_print("    Server shutdown()/close() to last read (usecs)",
+                   &sum->last_read, 1000, 3);
+        if (sum->corrupt > 0)
+            printf("    Pattern mismatches: %ld\n", sum->corrupt);
+    }
+
+    free(sum);
+}
+
+static void run_load(const char *host, const Options *options)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    LoadThread *threads;
+    uint64_t start, end;
+    int i, r, nthreads;
+
+    resolve_addr(host, options->port, &addr, &addrlen);
+
+    nthreads = options->threads < options->conns ?
+               options->threads : (int) options->conns;
+    threads = calloc(nthreads, sizeof(LoadThread));
+    if (threads == NULL)
+        fatal(NULL, "out of memory");
+
+    printf("-- opening %ld connections from %d threads\n",
+           options->conns, nthreads);
+    start = timestamp();
+    for (i = 0; i < nthreads; i++) {
+        threads[i].options = options;
+        threads[i].addr = (struct sockaddr *) &addr;
+        threads[i].addrlen = addrlen;
+        threads[i].next_src = i;
+        threads[i].seed = i + 1;        /* Same rates on every run */
+        threads[i].conns = options->conns / nthreads +
+                           (i < options->conns % nthreads);
+        if (options->rate > 0)
+            threads[i].interval = nthreads / options->rate;
+        r = pthread_create(&threads[i].tid, NULL, load_thread, &threads[i]);
+        if (r != 0) {
+            errno = r;
+            die("pthread_create()");
+        }
+    }
+    for (i = 0; i < nthreads; i++) {
+        r = pthread_join(threads[i].tid, NULL);
+        if (r != 0) {
+            errno = r;
+            die("pthread_join()");
+        }
+    }
+    end = timestamp();
+
+    print_load_results(threads, nthreads, options->conns,
+                       time_diff(start, end));
+    free(threads);
+}
+
+#endif /* __linux__ */
+
+int main(int argc, char *argv[])
+{
+    int sockfd;
+    uint64_t start, end;
+    char *hostname;
+    Options copts, *options = &copts;
+
+    parse_opts(argc, argv, options, &hostname);
+    if (options->timeline_name != NULL)
+        timeline_open(options->timeline_name);
+
+#ifdef __linux__
+    if (options->conns > 0) {
+        run_load(hostname, options);
+        exit(EXIT_SUCCESS);
+    }
+#endif
+
+    sockfd = connect_to(hostname, options);
+    start = timestamp();
+
+    if (options->drain != DRAIN_NONE)
+        recv_drain(sockfd, options);
+#ifdef __linux__
+    else if (options->fast)
+        recv_paced(sockfd, options);
+#endif
+    else
+        recv_all(sockfd, options);
 
     close(sockfd);
-    timestamp(tp_end);
-    printf("Total recv time (secs): %.3f\n", time_diff(tp_start, tp_end));
+    end = timestamp();
+    printf("Total recv time (secs): %.9f\n", time_diff(start, end));
 
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,769 @@
+/* linger-matrix.c runs the linger-server/linger-client test over loopback for
+ * every combination of the server's options, all within one process, and
+ * prints one CSV or JSON row per run. It is released under the same license
+ * as linger-server.c.
+ */
+/*************************************************************************\
+*                  Copyright (C) Nybek Limited, 2015.                     *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Affero General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the file COPYING.agpl-v3 for details.                               *
+\************************************************************************/
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+
+#ifdef TRUE
+#undef TRUE
+#endif
+
+#ifdef FALSE
+#undef FALSE
+#endif
+
+typedef enum { FALSE, TRUE } Boolean;
+
+#define SNDBUF_SIZE (50 * 1024)
+#define RCVBUF_SIZE 8192
+#define PAYLOAD_SIZE (20 * 1024)
+#define READ_SIZE 512
+#define BACKLOG 128
+#define TIME_MAX 86400
+#define MAX_VALUES 16
+#define NSECS_PER_SEC 1000000000ULL
+#define READY_BYTE 'R'
+#define PATTERN_STEP 0x9E3779B97F4A7C15ULL
+
+#define OPT_NOSOCK 0
+#define OPT_LSOCK 1
+#define OPT_CSOCK 2
+#define OPT_CSOCK_LATE 3
+#define NUM_POLICIES 4
+
+#define FMT_CSV 0
+#define FMT_JSON 1
+
+#define printable(ch) (isprint((unsigned char) ch) ? ch : '#')
+
+static const char *policy_names[NUM_POLICIES] = {
+    "none", "lsock", "csock", "csock_late"
+};
+
+typedef struct {
+    int values[MAX_VALUES];
+    int count;
+} IntList;
+
+typedef struct {
+    int repeats;
+    IntList linger_times;
+    IntList shutdown_times;
+    IntList sndbufs;            /* Server SO_SNDBUF, 0 = autotuned */
+    IntList rcvbufs;            /* Client SO_RCVBUF, 0 = autotuned */
+    IntList lowats;             /* Server TCP_NOTSENT_LOWAT, 0 = unset */
+    size_t payload_size;
+    long read_bytes;
+    long read_interval;         /* usecs between client reads, 0 = unpaced */
+    int format;
+} Options;
+
+/* One point in the matrix - the same knobs as linger-server's options */
+typedef struct {
+    int linger_sock;
+    int linger_time;
+    Boolean nonblocking;
+    Boolean use_shutdown;
+    int shutdown_time;
+    int sndbuf;
+    int rcvbuf;
+    int lowat;
+    int rep;
+} Config;
+
+typedef struct {
+    uint64_t write_ns;
+    long written;
+    const char *write_result;
+    uint64_t shutdown_ns;
+    const char *shutdown_result;
+    uint64_t eof_ns;
+    const char *eof_result;
+    uint64_t close_ns;
+    const char *close_result;
+    long client_bytes;
+    const char *client_result;
+    uint64_t client_recv_ns;
+    long client_verified;       /* Bytes that matched, up to the first not */
+    long reset_offset;          /* Stream offset of the reset, -1 if none */
+} Result;
+
+typedef struct {
+    pthread_t tid;
+    int port;
+    const Options *options;
+    const Config *cfg;
+    Result *result;
+} Client;
+
+static void fatal(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static void die(const char *where)
+{
+    perror(where);
+    exit(EXIT_FAILURE);
+}
+
+static void usage_exit(const char *prog_name, const char *msg, int opt)
+{
+    if (msg != NULL && opt != 0)
+        fprintf(stderr, "%s (-%c)\n", msg, printable(opt));
+    fprintf(stderr, "Usage: %s [-r repeats] [-t linger_secs,...] "
+                    "[-T eof_wait_secs,...] [-b bytes] [-d usecs] "
+                    "[-f csv|json]\n"
+                    "       [-S sndbuf,...] [-R rcvbuf,...] "
+                    "[-L lowat,...] [-P size]\n",
+                    prog_name);
+    fprintf(stderr,
+            "     -h             Print usage and exit.\n"
+            "     -r repeats     Runs of each combination (default 3).\n"
+            "     -t secs,...    SO_LINGER timeouts to test (default 0,1).\n"
+            "     -T secs,...    EOF wait timeouts to test with shutdown()\n"
+            "                    (default 1). Each must be > 0.\n"
+            "     -b bytes       Bytes the client reads per tick (default %d).\n"
+            "     -d usecs       Client read tick interval (default 1000). 0\n"
+            "                    reads as fast as possible, for throughput.\n"
+            "     -f format      Output csv (default) or json, one row per run.\n"
+            "     -S size,...    Server SO_SNDBUF sizes to sweep (default\n"
+            "                    %dK). auto leaves it to autotuning.\n"
+            "     -R size,...    Client SO_RCVBUF sizes to sweep (default\n"
+            "                    %dK). auto leaves it to autotuning.\n"
+            "     -L bytes,...   Server TCP_NOTSENT_LOWAT values to sweep\n"
+            "                    (default off). off leaves it unset.\n"
+            "     -P size        Payload size (default %dK). Sizes take a K,\n"
+            "                    M or G suffix.\n"
+            "\n"
+            "Every combination of -s lsock|csock|csock_late (or no linger),\n"
+            "-t, -N and -S/-T is run over loopback, for every combination of\n"
+            "the buffer settings above.\n", READ_SIZE, SNDBUF_SIZE / 1024,
+            RCVBUF_SIZE / 1024, PAYLOAD_SIZE / 1024);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_list(const char *prog_name, const char *arg, int opt,
+                       int min, IntList *list)
+{
+    char *copy, *tok, *save;
+    int val;
+
+    copy = strdup(arg);
+    if (copy == NULL)
+        fatal("out of memory");
+    list->count = 0;
+    for (tok = strtok_r(copy, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (sscanf(tok, "%d", &val) != 1)
+            usage_exit(prog_name, "Integer list expected", opt);
+        if (val < min || val > TIME_MAX)
+            usage_exit(prog_name, "Timeout out of range", opt);
+        if (list->count == MAX_VALUES)
+            usage_exit(prog_name, "Too many values", opt);
+        list->values[list->count++] = val;
+    }
+    free(copy);
+    if (list->count == 0)
+        usage_exit(prog_name, "Integer list expected", opt);
+}
+
+static size_t parse_size(const char *str)
+{
+    unsigned long long size;
+    char suffix = '\0', extra;
+    int n;
+
+    n = sscanf(str, "%llu%c%c", &size, &suffix, &extra);
+    if (n < 1 || n > 2)
+        return 0;
+    switch (toupper((unsigned char) suffix)) {
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        /* fall through */
+    case '\0':
+        break;
+    default:
+        return 0;
+    }
+    return (size_t) size;
+}
+
+/* Parse a comma separated list of sizes, in which the word unset stands
+ * for leaving the option alone and is stored as 0 */
+static void parse_size_list(const char *prog_name, const char *arg, int opt,
+                            const char *unset, IntList *list)
+{
+    char *copy, *tok, *save;
+    size_t size;
+
+    copy = strdup(arg);
+    if (copy == NULL)
+        fatal("out of memory");
+    list->count = 0;
+    for (tok = strtok_r(copy, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (strcmp(tok, unset) == 0)
+            size = 0;
+        else if ((size = parse_size(tok)) == 0 || size > INT_MAX)
+            usage_exit(prog_name, "Bad size", opt);
+        if (list->count == MAX_VALUES)
+            usage_exit(prog_name, "Too many values", opt);
+        list->values[list->count++] = (int) size;
+    }
+    free(copy);
+    if (list->count == 0)
+        usage_exit(prog_name, "Size list expected", opt);
+}
+
+static void parse_opts(int argc, char *argv[], Options *options)
+{
+    int opt;
+    char *prog_name;
+
+    options->repeats = 3;
+    options->linger_times.values[0] = 0;
+    options->linger_times.values[1] = 1;
+    options->linger_times.count = 2;
+    options->shutdown_times.values[0] = 1;
+    options->shutdown_times.count = 1;
+    options->sndbufs.values[0] = SNDBUF_SIZE;
+    options->sndbufs.count = 1;
+    options->rcvbufs.values[0] = RCVBUF_SIZE;
+    options->rcvbufs.count = 1;
+    options->lowats.values[0] = 0;
+    options->lowats.count = 1;
+    options->payload_size = PAYLOAD_SIZE;
+    options->read_bytes = READ_SIZE;
+    options->read_interval = 1000;
+    options->format = FMT_CSV;
+    prog_name = argv[0] ? argv[0] : "[prog_name]";
+
+    while ((opt = getopt(argc, argv, ":hr:t:T:b:d:f:S:R:L:P:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage_exit(prog_name, NULL, opt);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%d", &options->repeats) != 1 ||
+                options->repeats <= 0)
+                usage_exit(prog_name, "Positive integer expected", opt);
+            break;
+        case 't':
+            parse_list(prog_name, optarg, opt, 0, &options->linger_times);
+            break;
+        case 'T':
+            parse_list(prog_name, optarg, opt, 1, &options->shutdown_times);
+            break;
+        case 'b':
+            if (sscanf(optarg, "%ld", &options->read_bytes) != 1 ||
+                options->read_bytes <= 0)
+                usage_exit(prog_name, "Positive integer expected", opt);
+            break;
+        case 'd':
+            if (sscanf(optarg, "%ld", &options->read_interval) != 1 ||
+                options->read_interval < 0)
+                usage_exit(prog_name, "Non-negative integer expected", opt);
+            break;
+        case 'f':
+            if (strcmp("csv", optarg) == 0)
+                options->format = FMT_CSV;
+            else if (strcmp("json", optarg) == 0)
+                options->format = FMT_JSON;
+            else
+                usage_exit(prog_name, "Bad output format", opt);
+            break;
+        case 'S':
+            parse_size_list(prog_name, optarg, opt, "auto", &options->sndbufs);
+            break;
+        case 'R':
+            parse_size_list(prog_name, optarg, opt, "auto", &options->rcvbufs);
+            break;
+        case 'L':
+            parse_size_list(prog_name, optarg, opt, "off", &options->lowats);
+            break;
+        case 'P':
+            options->payload_size = parse_size(optarg);
+            if (options->payload_size == 0)
+                usage_exit(prog_name, "Bad payload size", opt);
+            break;
+        case ':':
+            usage_exit(prog_name, "Missing argument", optopt);
+            break;
+        case '?':
+            usage_exit(prog_name, "Unrecognised option", optopt);
+            break;
+        default:
+            fatal("Unexpected case in switch()");
+        }
+    }
+}
+
+static uint64_t timestamp(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        die("clock_gettime() failure");
+    return (uint64_t) ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+static void set_linger(int fd, int linger_time)
+{
+    int r;
+    struct linger ling;
+
+    ling.l_onoff = 1;
+    ling.l_linger = linger_time;
+    r = setsockopt(fd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+    if (r == -1)
+        die("setting SO_LINGER");
+}
+
+static void set_nonblocking(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1)
+        die("fcntl F_GETFL");
+    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        die("fcntl F_SETFL");
+}
+
+static int start_read_timer(long interval)
+{
+    struct itimerspec its;
+    int tfd;
+
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd == -1)
+        die("timerfd_create()");
+    its.it_value.tv_sec = interval / 1000000;
+    its.it_value.tv_nsec = interval % 1000000 * 1000;
+    its.it_interval = its.it_value;
+    if (timerfd_settime(tfd, 0, &its, NULL) == -1)
+        die("timerfd_settime()");
+    return tfd;
+}
+
+/* The same position-dependent pattern linger-server sends: byte i is byte
+ * i % 8, least significant first, of (i / 8 + 1) * PATTERN_STEP */
+static unsigned char pattern_byte(uint64_t offset)
+{
+    return (unsigned char) (((offset >> 3) + 1) * PATTERN_STEP >>
+                            (8 * (offset & 7)));
+}
+
+static void get_payload(char *buf, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        buf[i] = (char) pattern_byte(i);
+}
+
+/* The client half: linger-client -F. It sends the ready byte, then reads
+ * read_bytes per timerfd tick, and records a reset rather than dying. */
+static void *client_thread(void *arg)
+{
+    Client *cl = arg;
+    const Options *options = cl->options;
+    Result *res = cl->result;
+    const Config *cfg = cl->cfg;
+    struct sockaddr_in addr;
+    char *buf, ready = READY_BYTE;
+    uint64_t start, ticks;
+    long budget;
+    ssize_t n, i;
+    Boolean intact = TRUE;
+    int fd, tfd, val;
+
+    buf = malloc(options->read_bytes);
+    if (buf == NULL)
+        fatal("out of memory");
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        die("socket() failed");
+    /* Before connect(), so that the window scale reflects it */
+    val = cfg->rcvbuf;
+    if (val > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)) == -1)
+        die("setting SO_RCVBUF");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(cl->port);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        die("connect() failed");
+    start = timestamp();
+    if (send(fd, &ready, 1, MSG_NOSIGNAL) != 1)
+        die("sending ready byte");
+    tfd = options->read_interval > 0 ?
+          start_read_timer(options->read_interval) : -1;
+
+    res->client_result = "eof";
+    res->reset_offset = -1;
+    for (;;) {
+        if (tfd == -1)
+            ticks = 1;          /* Unpaced - block in recv() instead */
+        else if (read(tfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+            die("read() timerfd");
+        for (budget = ticks * options->read_bytes; budget > 0; budget -= n) {
+            n = recv(fd, buf, budget < options->read_bytes ?
+                              budget : options->read_bytes,
+                     tfd != -1 ? MSG_DONTWAIT : 0);
+            if (n == 0)
+                goto done;
+            if (n == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                res->client_result = errno == ECONNRESET ? "reset" : "error";
+                if (errno == ECONNRESET)
+                    res->reset_offset = res->client_bytes;
+                goto done;
+            }
+            for (i = 0; intact && i < n; i++) {
+                if ((unsigned char) buf[i] !=
+                    pattern_byte(res->client_bytes + i))
+                    intact = FALSE;
+                else
+                    res->client_verified++;
+            }
+            res->client_bytes += n;
+        }
+    }
+
+done:
+    res->client_recv_ns = timestamp() - start;
+    if (tfd != -1)
+        close(tfd);
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static void wait_client_ready(int connfd)
+{
+    struct pollfd pfds[1];
+    ssize_t n;
+    char c;
+
+    pfds[0].fd = connfd;
+    pfds[0].events = POLLIN;
+    if (poll(pfds, 1, -1) == -1)
+        die("poll()");
+    n = read(connfd, &c, 1);
+    if (n == -1)
+        die("read() waiting for client");
+    if (n == 0 || c != READY_BYTE)
+        fatal("Bad ready signal from client");
+}
+
+static int open_listener(const Config *cfg, int *port)
+{
+    int listenfd, val;
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd == -1)
+        die("socket");
+
+    val = 1;
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) == -1)
+        die("setting SO_REUSEADDR");
+    val = cfg->sndbuf;
+    if (val > 0 &&
+        setsockopt(listenfd, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val)) == -1)
+        die("setting SO_SNDBUF");
+    val = cfg->lowat;
+    if (val > 0 && setsockopt(listenfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                              &val, sizeof(val)) == -1)
+        die("setting TCP_NOTSENT_LOWAT");
+    if (cfg->linger_sock == OPT_LSOCK)
+        set_linger(listenfd, cfg->linger_time);
+
+    /* An ephemeral port, so runs never collide with a lingering socket or
+     * a real linger-server */
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        die("bind()");
+    if (listen(listenfd, BACKLOG) == -1)
+        die("listen()");
+    if (getsockname(listenfd, (struct sockaddr *) &addr, &len) == -1)
+        die("getsockname()");
+    *port = ntohs(addr.sin_port);
+
+    return listenfd;
+}
+
+static void wait_eof(int connfd, const Config *cfg, Result *res)
+{
+    struct pollfd pfds[1];
+    uint64_t before;
+    ssize_t n;
+    char c;
+    int r;
+
+    before = timestamp();
+    pfds[0].fd = connfd;
+    pfds[0].events = POLLIN;
+    r = poll(pfds, 1, 1000 * cfg->shutdown_time);
+    if (r == -1)
+        die("poll()");
+    if (r == 0) {
+        res->eof_ns = timestamp() - before;
+        res->eof_result = "timeout";
+        return;
+    }
+
+    n = read(connfd, &c, 1);
+    res->eof_ns = timestamp() - before;
+    if (n == 0)
+        res->eof_result = "eof";
+    else if (n > 0)
+        res->eof_result = "data";
+    else if (errno == EWOULDBLOCK)
+        res->eof_result = "ewouldblock";
+    else if (errno == ECONNRESET)
+        res->eof_result = "reset";
+    else
+        res->eof_result = "error";
+}
+
+/* The server half: linger-server's main() for a single connection */
+static void run_one(const Config *cfg, const Options *options,
+                    const char *payload, Result *res)
+{
+    Client client;
+    int listenfd, connfd, r;
+    uint64_t before;
+    ssize_t n;
+
+    memset(res, 0, sizeof(Result));
+    res->shutdown_result = "skipped";
+    res->eof_result = "skipped";
+
+    listenfd = open_listener(cfg, &client.port);
+    client.options = options;
+    client.cfg = cfg;
+    client.result = res;
+    r = pthread_create(&client.tid, NULL, client_thread, &client);
+    if (r != 0) {
+        errno = r;
+        die("pthread_create()");
+    }
+
+    connfd = accept(listenfd, NULL, NULL);
+    if (connfd == -1)
+        die("accept()");
+    if (cfg->nonblocking)
+        set_nonblocking(connfd);
+    if (close(listenfd) == -1)
+        die("closing listenfd");
+    if (cfg->linger_sock == OPT_CSOCK)
+        set_linger(connfd, cfg->linger_time);
+    wait_client_ready(connfd);
+
+    before = timestamp();
+    n = send(connfd, payload, options->payload_size, MSG_NOSIGNAL);
+    res->write_ns = timestamp() - before;
+    res->written = n == -1 ? 0 : n;
+    if (n == -1)
+        res->write_result = errno == EWOULDBLOCK ? "ewouldblock" : "error";
+    else
+        res->write_result = (size_t) n == options->payload_size ?
+                            "ok" : "short";
+
+    if (cfg->use_shutdown) {
+        before = timestamp();
+        r = shutdown(connfd, SHUT_WR);
+        res->shutdown_ns = timestamp() - before;
+        if (r == 0)
+            res->shutdown_result = "ok";
+        else
+            res->shutdown_result = errno == EWOULDBLOCK ?
+                                   "ewouldblock" : "error";
+        if (cfg->linger_sock == OPT_CSOCK_LATE)
+            set_linger(connfd, cfg->linger_time);
+        wait_eof(connfd, cfg, res);
+    }
+
+    before = timestamp();
+    r = close(connfd);
+    res->close_ns = timestamp() - before;
+    if (r == 0)
+        res->close_result = "ok";
+    else
+        res->close_result = errno == EWOULDBLOCK ? "ewouldblock" : "error";
+
+    r = pthread_join(client.tid, NULL);
+    if (r != 0) {
+        errno = r;
+        die("pthread_join()");
+    }
+}
+
+static void print_header(const Options *options)
+{
+    if (options->format != FMT_CSV)
+        return;
+    puts("policy,linger_secs,nonblocking,shutdown,eof_wait_secs,"
+         "sndbuf,rcvbuf,notsent_lowat,payload,rep,"
+         "write_ns,written,write_result,shutdown_ns,shutdown_result,"
+         "eof_ns,eof_result,close_ns,close_result,"
+         "client_bytes,client_result,client_recv_ns,"
+         "client_verified,lost_bytes,reset_offset,client_mb_per_sec");
+}
+
+static void print_row(const Options *options, const Config *cfg,
+                      const Result *res)
+{
+    const char *fmt;
+
+    if (options->format == FMT_CSV)
+        fmt = "%s,%d,%d,%d,%d,%d,%d,%d,%zu,%d,%llu,%ld,%s,%llu,%s,%llu,%s,"
+              "%llu,%s,%ld,%s,%llu,%ld,%ld,%ld,%.3f\n";
+    else
+        fmt = "{\"policy\":\"%s\",\"linger_secs\":%d,\"nonblocking\":%d,"
+              "\"shutdown\":%d,\"eof_wait_secs\":%d,\"sndbuf\":%d,"
+              "\"rcvbuf\":%d,\"notsent_lowat\":%d,\"payload\":%zu,"
+              "\"rep\":%d,"
+              "\"write_ns\":%llu,\"written\":%ld,\"write_result\":\"%s\","
+              "\"shutdown_ns\":%llu,\"shutdown_result\":\"%s\","
+              "\"eof_ns\":%llu,\"eof_result\":\"%s\","
+              "\"close_ns\":%llu,\"close_result\":\"%s\","
+              "\"client_bytes\":%ld,\"client_result\":\"%s\","
+              "\"client_recv_ns\":%llu,\"client_verified\":%ld,"
+              "\"lost_bytes\":%ld,\"reset_offset\":%ld,"
+              "\"client_mb_per_sec\":%.3f}\n";
+
+    printf(fmt, policy_names[cfg->linger_sock],
+           cfg->linger_sock == OPT_NOSOCK ? -1 : cfg->linger_time,
+           cfg->nonblocking, cfg->use_shutdown,
+           cfg->use_shutdown ? cfg->shutdown_time : 0, cfg->sndbuf,
+           cfg->rcvbuf, cfg->lowat, options->payload_size, cfg->rep,
+           (unsigned long long) res->write_ns, res->written,
+           res->write_result,
+           (unsigned long long) res->shutdown_ns, res->shutdown_result,
+           (unsigned long long) res->eof_ns, res->eof_result,
+           (unsigned long long) res->close_ns, res->close_result,
+           res->client_bytes, res->client_result,
+           (unsigned long long) res->client_recv_ns,
+           res->client_verified, res->written - res->client_verified,
+           res->reset_offset, res->client_recv_ns == 0 ? 0.0 :
+           (double) res->client_bytes * NSECS_PER_SEC / 1048576 /
+           res->client_recv_ns);
+    fflush(stdout);
+}
+
+/* Every combination of the server's close options at one buffer setting */
+static void run_policies(const Options *options, Config *cfg,
+                         const char *payload, Result *res)
+{
+    int lt, nt, ns, nst, nlt, nnst;
+
+    for (cfg->linger_sock = 0; cfg->linger_sock < NUM_POLICIES;
+         cfg->linger_sock++) {
+        /* The linger timeout means nothing without a linger policy */
+        nlt = cfg->linger_sock == OPT_NOSOCK ?
+              1 : options->linger_times.count;
+        for (lt = 0; lt < nlt; lt++) {
+            cfg->linger_time = options->linger_times.values[lt];
+            for (nt = 0; nt < 2; nt++) {
+                cfg->nonblocking = nt;
+                for (ns = 0; ns < 2; ns++) {
+                    cfg->use_shutdown = ns;
+                    nnst = ns ? options->shutdown_times.count : 1;
+                    for (nst = 0; nst < nnst; nst++) {
+                        cfg->shutdown_time =
+                            options->shutdown_times.values[nst];
+                        for (cfg->rep = 0; cfg->rep < options->repeats;
+                             cfg->rep++) {
+                            run_one(cfg, options, payload, res);
+                            print_row(options, cfg, res);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Options mopts, *options = &mopts;
+    Config cfg;
+    Result res;
+    char *payload;
+    int sb, rb, lw;
+
+    parse_opts(argc, argv, options);
+    payload = malloc(options->payload_size);
+    if (payload == NULL)
+        fatal("out of memory");
+    get_payload(payload, options->payload_size);
+    print_header(options);
+
+    /* The buffer settings are the outer loops, so that each one's rows
+     * come out together */
+    for (sb = 0; sb < options->sndbufs.count; sb++) {
+        cfg.sndbuf = options->sndbufs.values[sb];
+        for (rb = 0; rb < options->rcvbufs.count; rb++) {
+            cfg.rcvbuf = options->rcvbufs.values[rb];
+            for (lw = 0; lw < options->lowats.count; lw++) {
+                cfg.lowat = options->lowats.values[lw];
+                run_policies(options, &cfg, payload, &res);
+            }
+        }
+    }
+
+    free(payload);
+    exit(EXIT_SUCCESS);
+}
+
@@ -0,0 +1,1106 @@
+/* linger-proxy.c sits between linger-client and linger-server and makes the
+ * loopback path between them look like a WAN link: every byte is held for
+ * a one-way delay plus jitter, and each direction is capped at a bandwidth.
+ * Data moves socket to pipe to socket with splice(), and a timer wheel
+ * releases it when it is due, so the proxy keeps up with multi-Gbit/s
+ * streams. FIN and RST are queued behind the data like on the wire. It is
+ * released under the same license as linger-server.c.
+ */
+/*************************************************************************\
+*                  Copyright (C) Nybek Limited, 2015.                     *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Affero General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the file COPYING.agpl-v3 for details.                               *
+\************************************************************************/
+
+#ifdef __linux__
+#define _GNU_SOURCE         /* accept4(), splice(), pipe2() */
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netdb.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#ifdef TRUE
+#undef TRUE
+#endif
+
+#ifdef FALSE
+#undef FALSE
+#endif
+
+typedef enum { FALSE, TRUE } Boolean;
+
+#define LISTEN_PORT 7778
+#define SERVER_PORT "7777"
+#define BACKLOG 1024
+#define MAX_EVENTS 256
+#define MAX_PIPES 64
+#define PIPE_SIZE (1024 * 1024)
+#define QUEUE_SIZE (16 * 1024 * 1024)
+#define BUCKET_MS 2                 /* Token bucket depth at the cap */
+#define MIN_READ (16 * 1024)
+#define DELAY_MAX 60000             /* ms */
+#define NSECS_PER_SEC 1000000000ULL
+#define NSECS_PER_MSEC 1000000ULL
+
+#define WHEEL_TICK 1000000ULL       /* 1 ms */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 5
+
+#define SEG_DATA 0
+#define SEG_FIN 1
+#define SEG_RST 2
+
+#define printable(ch) (isprint((unsigned char) ch) ? ch : '#')
+
+typedef struct {
+    int listen_port;
+    const char *server_port;
+    double delay;               /* One-way, ms */
+    double jitter;              /* ms, added uniformly at random */
+    double rate;                /* Bytes/sec per direction, 0 = no cap */
+    size_t queue_size;          /* Most bytes held per direction */
+    long max_sessions;          /* Exit after this many, 0 = run for ever */
+} Options;
+
+static void fatal(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static void die(const char *where)
+{
+    perror(where);
+    exit(EXIT_FAILURE);
+}
+
+static void usage_exit(const char *prog_name, const char *msg, int opt)
+{
+    if (msg != NULL && opt != 0)
+        fprintf(stderr, "%s (-%c)\n", msg, printable(opt));
+    else if (msg != NULL)
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "Usage: %s [-l port] [-p port] [-d ms] [-J ms] "
+                    "[-r rate] [-q size] [-n sessions]\n"
+                    "       hostname\n",
+                    prog_name);
+    fprintf(stderr,
+            "     -h             Print usage and exit.\n"
+            "     -l port        Port to listen on (default %d). Point\n"
+            "                    linger-client -p at it.\n"
+            "     -p port        linger-server's port on hostname (default\n"
+            "                    %s).\n"
+            "     -d ms          One-way delay in each direction, so the\n"
+            "                    round trip is twice this (default 0).\n"
+            "     -J ms          Jitter: up to ms more delay, uniformly at\n"
+            "                    random. Data is never reordered; it waits\n"
+            "                    behind anything held longer (default 0).\n"
+            "     -r rate        Bandwidth cap per direction in bits/sec,\n"
+            "                    with a K, M or G suffix for powers of 1000\n"
+            "                    (default none).\n"
+            "     -q size        Most bytes held per direction before the\n"
+            "                    sender is pushed back on (default %dM). It\n"
+            "                    needs to cover rate x delay.\n"
+            "     -n sessions    Exit after sessions connections have ended.\n"
+            "\n"
+            "Totals are printed on exit, including on SIGINT.\n",
+            LISTEN_PORT, SERVER_PORT, QUEUE_SIZE / (1024 * 1024));
+    exit(EXIT_FAILURE);
+}
+
+static size_t parse_size(const char *str)
+{
+    unsigned long long size;
+    char suffix = '\0', extra;
+    int n;
+
+    n = sscanf(str, "%llu%c%c", &size, &suffix, &extra);
+    if (n < 1 || n > 2)
+        return 0;
+    switch (toupper((unsigned char) suffix)) {
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        /* fall through */
+    case '\0':
+        break;
+    default:
+        return 0;
+    }
+    return (size_t) size;
+}
+
+/* Bits/sec, with network rather than memory multipliers, into bytes/sec */
+static double parse_rate(const char *str)
+{
+    double rate;
+    char suffix = '\0', extra;
+    int n;
+
+    n = sscanf(str, "%lf%c%c", &rate, &suffix, &extra);
+    if (n < 1 || n > 2 || rate <= 0)
+        return 0;
+    switch (toupper((unsigned char) suffix)) {
+    case 'G':
+        rate *= 1000;
+        /* fall through */
+    case 'M':
+        rate *= 1000;
+        /* fall through */
+    case 'K':
+        rate *= 1000;
+        /* fall through */
+    case '\0':
+        break;
+    default:
+        return 0;
+    }
+    return rate / 8;
+}
+
+static void parse_opts(int argc, char *argv[], Options *options,
+                       char **hostname)
+{
+    int opt;
+    char *prog_name;
+
+    options->listen_port = LISTEN_PORT;
+    options->server_port = SERVER_PORT;
+    options->delay = 0;
+    options->jitter = 0;
+    options->rate = 0;
+    options->queue_size = QUEUE_SIZE;
+    options->max_sessions = 0;
+    prog_name = argv[0] ? argv[0] : "[prog_name]";
+
+    while ((opt = getopt(argc, argv, ":hl:p:d:J:r:q:n:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage_exit(prog_name, NULL, opt);
+            break;
+        case 'l':
+            if (sscanf(optarg, "%d", &options->listen_port) != 1 ||
+                options->listen_port <= 0 || options->listen_port > 65535)
+                usage_exit(prog_name, "Port must be 1-65535", opt);
+            break;
+        case 'p':
+            options->server_port = optarg;
+            break;
+        case 'd':
+            if (sscanf(optarg, "%lf", &options->delay) != 1 ||
+                options->delay < 0 || options->delay > DELAY_MAX)
+                usage_exit(prog_name, "Delay out of range", opt);
+            break;
+        case 'J':
+            if (sscanf(optarg, "%lf", &options->jitter) != 1 ||
+                options->jitter < 0 || options->jitter > DELAY_MAX)
+                usage_exit(prog_name, "Jitter out of range", opt);
+            break;
+        case 'r':
+            options->rate = parse_rate(optarg);
+            if (options->rate == 0)
+                usage_exit(prog_name, "Bad rate", opt);
+            break;
+        case 'q':
+            options->queue_size = parse_size(optarg);
+            if (options->queue_size == 0)
+                usage_exit(prog_name, "Bad queue size", opt);
+            break;
+        case 'n':
+            if (sscanf(optarg, "%ld", &options->max_sessions) != 1 ||
+                options->max_sessions <= 0)
+                usage_exit(prog_name, "Positive integer expected", opt);
+            break;
+        case ':':
+            usage_exit(prog_name, "Missing argument", optopt);
+            break;
+        case '?':
+            usage_exit(prog_name, "Unrecognised option", optopt);
+            break;
+        default:
+            fatal("Unexpected case in switch()");
+        }
+    }
+
+    if (optind != argc - 1)
+        usage_exit(prog_name, NULL, 0);
+    *hostname = argv[optind];
+}
+
+#ifdef __linux__
+
+static uint64_t timestamp(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        die("clock_gettime() failure");
+    return (uint64_t) ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+/* xorshift64*, which is plenty for jitter */
+static uint64_t random_state;
+
+static double random_unit(void)
+{
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (random_state * 0x2545F4914F6CDD1DULL >> 11) / 9007199254740992.0;
+}
+
+/* Hierarchical timer wheel, as in linger-server.c: WHEEL_LEVELS rings of
+ * WHEEL_SLOTS lists, each level WHEEL_SLOTS times coarser than the one
+ * below, with a tick of WHEEL_TICK ns. Adding and cancelling are O(1), and
+ * timers are embedded in the objects that own them.
+ */
+
+typedef struct Timer Timer;
+typedef void (*TimerFn)(void *owner, void *data);
+
+struct Timer {
+    Timer *next;
+    Timer **pprev;              /* NULL when not armed */
+    uint64_t expires;           /* In ticks */
+    TimerFn fn;
+    void *owner;
+    void *data;
+};
+
+typedef struct {
+    uint64_t now;               /* Every tick before this one has been run */
+    long count;
+    Timer *due;                 /* Expired, waiting for wheel_expire() */
+    Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+static void wheel_init(TimerWheel *wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(TimerWheel));
+    wheel->now = now / WHEEL_TICK;
+}
+
+static void timer_init(Timer *t, TimerFn fn, void *owner, void *data)
+{
+    memset(t, 0, sizeof(Timer));
+    t->fn = fn;
+    t->owner = owner;
+    t->data = data;
+}
+
+static void timer_link(Timer **head, Timer *t)
+{
+    t->next = *head;
+    if (t->next != NULL)
+        t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+static void timer_unlink(Timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+}
+
+static void wheel_place(TimerWheel *wheel, Timer *t)
+{
+    uint64_t delta;
+    int level;
+
+    if (t->expires <= wheel->now) {
+        timer_link(&wheel->due, t);
+        return;
+    }
+    delta = t->expires - wheel->now;
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+        if (delta < 1ULL << (WHEEL_BITS * (level + 1)))
+            break;
+    timer_link(&wheel->slots[level][(t->expires >> (WHEEL_BITS * level)) &
+                                    (WHEEL_SLOTS - 1)], t);
+}
+
+static void wheel_add(TimerWheel *wheel, Timer *t, uint64_t expires)
+{
+    t->expires = (expires + WHEEL_TICK - 1) / WHEEL_TICK;
+    wheel_place(wheel, t);
+    wheel->count++;
+}
+
+static void wheel_cancel(TimerWheel *wheel, Timer *t)
+{
+    if (t->pprev == NULL)
+        return;
+    timer_unlink(t);
+    wheel->count--;
+}
+
+static void wheel_cascade(TimerWheel *wheel, int level)
+{
+    Timer *t, **slot;
+
+    slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) &
+                                (WHEEL_SLOTS - 1)];
+    while ((t = *slot) != NULL) {
+        timer_unlink(t);
+        wheel_place(wheel, t);
+    }
+}
+
+static void wheel_expire(TimerWheel *wheel, uint64_t now)
+{
+    uint64_t target = now / WHEEL_TICK;
+    Timer *t, **slot;
+    int level;
+
+    while (wheel->now < target) {
+        if (wheel->count == 0) {
+            wheel->now = target;
+            break;
+        }
+        wheel->now++;
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel->now & ((1ULL << (WHEEL_BITS * level)) - 1))
+                break;
+            wheel_cascade(wheel, level);
+        }
+        slot = &wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)];
+        while ((t = *slot) != NULL) {
+            timer_unlink(t);
+            timer_link(&wheel->due, t);
+        }
+    }
+
+    while ((t = wheel->due) != NULL) {
+        timer_unlink(t);
+        wheel->count--;
+        t->fn(t->owner, t->data);
+    }
+}
+
+static int wheel_timeout(const TimerWheel *wheel, uint64_t now)
+{
+    uint64_t next, i;
+
+    if (wheel->count == 0)
+        return -1;
+    if (wheel->due != NULL)
+        return 0;
+    next = (wheel->now | (WHEEL_SLOTS - 1)) + 1;
+    for (i = wheel->now + 1; i < next; i++) {
+        if (wheel->slots[0][i & (WHEEL_SLOTS - 1)] != NULL) {
+            next = i;
+            break;
+        }
+    }
+    next *= WHEEL_TICK;
+    if (next <= now)
+        return 0;
+    return (int) ((next - now + 999999) / 1000000);
+}
+
+/* A session is a client connection and the proxy's connection on to the
+ * server, with a Flow for each direction. A Flow splices what it reads
+ * into a ring of pipes and queues a Segment per read, stamped with the
+ * time it is due out; the pipes keep the bytes in order and the Segments
+ * say when each run of them may go.
+ */
+
+typedef struct Segment Segment;
+
+struct Segment {
+    Segment *next;
+    uint64_t due;
+    size_t len;                 /* Bytes left to deliver, SEG_DATA only */
+    int kind;                   /* SEG_* */
+};
+
+typedef struct {
+    int fd[2];                  /* Read end, write end; -1 until needed */
+    size_t used;
+} Pipe;
+
+typedef struct Session Session;
+typedef struct Flow Flow;
+
+struct Flow {
+    Session *session;
+    Flow *peer;                 /* The other direction */
+    int from;
+    int to;
+    Pipe pipes[MAX_PIPES];      /* Ring: bytes leave head, arrive at tail */
+    int head;
+    int tail;
+    size_t queued;
+    Segment *first;
+    Segment *last;
+    uint64_t last_due;          /* Nothing is due before what's ahead of it */
+    double tokens;              /* Bandwidth cap bucket, in bytes */
+    uint64_t refilled;
+    Boolean readable;           /* Edge-triggered readiness of from */
+    Boolean writable;           /* and of to */
+    Boolean ended;              /* EOF or reset read from from */
+    Boolean done;               /* FIN delivered, or to is gone */
+    Timer timer;
+    uint64_t bytes;
+};
+
+struct Session {
+    Flow up;                    /* Client to server */
+    Flow down;                  /* Server to client */
+    int client_fd;
+    int server_fd;
+    Boolean connected;
+    Boolean dead;
+    Session *next_dead;
+};
+
+typedef struct {
+    const Options *options;
+    int epfd;
+    int listenfd;
+    struct sockaddr_storage server_addr;
+    socklen_t server_addrlen;
+    TimerWheel wheel;
+    Session *graveyard;         /* Freed once the current events are done */
+    long active;
+    long sessions;
+    long connect_failed;
+    long fins;
+    long resets;
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+} Proxy;
+
+static Proxy proxy;
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_handler(int sig)
+{
+    (void) sig;
+    stop_requested = 1;
+}
+
+static void resolve_addr(const char *host, const char *port,
+                         struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    int n;
+    struct addrinfo hints = {0};
+    struct addrinfo *result;
+
+    hints.ai_family = AF_INET;              /* IPv4 */
+    hints.ai_socktype = SOCK_STREAM;        /* TCP */
+
+    n = getaddrinfo(host, port, &hints, &result);
+    if (n != 0) {
+        fprintf(stderr, "getaddrinfo() failed: %s\n", gai_strerror(n));
+        exit(EXIT_FAILURE);
+    }
+    memcpy(addr, result->ai_addr, result->ai_addrlen);
+    *addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+}
+
+static int open_listener(const Options *options)
+{
+    struct sockaddr_in addr;
+    int listenfd, val;
+
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenfd == -1)
+        die("socket()");
+    val = 1;
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)) == -1)
+        die("setting SO_REUSEADDR");
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(options->listen_port);
+    if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        die("bind()");
+    if (listen(listenfd, BACKLOG) == -1)
+        die("listen()");
+    return listenfd;
+}
+
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        die("getrlimit()");
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+        die("setrlimit()");
+}
+
+static void flow_timer(void *owner, void *data);
+
+static void flow_init(Flow *f, Session *s, Flow *peer, int from, int to)
+{
+    int i;
+
+    memset(f, 0, sizeof(Flow));
+    f->session = s;
+    f->peer = peer;
+    f->from = from;
+    f->to = to;
+    for (i = 0; i < MAX_PIPES; i++)
+        f->pipes[i].fd[0] = f->pipes[i].fd[1] = -1;
+    f->tokens = MIN_READ;
+    f->refilled = timestamp();
+    timer_init(&f->timer, flow_timer, f, NULL);
+}
+
+static void flow_free(Flow *f)
+{
+    Segment *seg;
+    int i;
+
+    wheel_cancel(&proxy.wheel, &f->timer);
+    while ((seg = f->first) != NULL) {
+        f->first = seg->next;
+        free(seg);
+    }
+    for (i = 0; i < MAX_PIPES; i++) {
+        if (f->pipes[i].fd[0] != -1) {
+            close(f->pipes[i].fd[0]);
+            close(f->pipes[i].fd[1]);
+        }
+    }
+}
+
+/* The pipe at the tail of the ring, created the first time round */
+static Pipe *flow_pipe(Flow *f)
+{
+    Pipe *p = &f->pipes[f->tail];
+
+    if (p->fd[0] == -1) {
+        if (pipe2(p->fd, O_CLOEXEC | O_NONBLOCK) == -1)
+            die("pipe2()");
+        /* Unprivileged, this can be capped by fs.pipe-max-size; a smaller
+         * pipe just means the ring holds less */
+        fcntl(p->fd[1], F_SETPIPE_SZ, PIPE_SIZE);
+    }
+    return p;
+}
+
+static void session_kill(Session *s)
+{
+    if (s->dead)
+        return;
+    s->dead = TRUE;
+    wheel_cancel(&proxy.wheel, &s->up.timer);
+    wheel_cancel(&proxy.wheel, &s->down.timer);
+    s->next_dead = proxy.graveyard;
+    proxy.graveyard = s;
+}
+
+/* Close both sockets, with an RST on the one given, if it isn't -1 */
+static void session_end(Session *s, int reset_fd)
+{
+    struct linger ling = { 1, 0 };
+
+    if (reset_fd != -1 &&
+        setsockopt(reset_fd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling)) == -1)
+        die("setting SO_LINGER");
+    close(s->client_fd);
+    close(s->server_fd);
+    proxy.bytes_up += s->up.bytes;
+    proxy.bytes_down += s->down.bytes;
+    proxy.active--;
+    proxy.sessions++;
+    session_kill(s);
+}
+
+static void bury_sessions(void)
+{
+    Session *s;
+
+    while ((s = proxy.graveyard) != NULL) {
+        proxy.graveyard = s->next_dead;
+        flow_free(&s->up);
+        flow_free(&s->down);
+        free(s);
+    }
+}
+
+/* Queue what was just read, or a FIN or RST, for release after the delay
+ * plus jitter, but never ahead of what is already queued */
+static void flow_enqueue(Flow *f, int kind, size_t len, uint64_t now)
+{
+    const Options *options = proxy.options;
+    Segment *seg;
+    uint64_t due;
+    double delay;
+
+    delay = options->delay;
+    if (options->jitter > 0)
+        delay += options->jitter * random_unit();
+    due = now + (uint64_t) (delay * NSECS_PER_MSEC);
+    if (due < f->last_due)
+        due = f->last_due;
+    f->last_due = due;
+
+    /* Back to back reads due out together are one Segment */
+    if (kind == SEG_DATA && f->last != NULL && f->last->kind == SEG_DATA &&
+        f->last->due == due) {
+        f->last->len += len;
+        return;
+    }
+    seg = malloc(sizeof(Segment));
+    if (seg == NULL)
+        fatal("out of memory");
+    seg->next = NULL;
+    seg->due = due;
+    seg->len = len;
+    seg->kind = kind;
+    if (f->last != NULL)
+        f->last->next = seg;
+    else
+        f->first = seg;
+    f->last = seg;
+}
+
+static void flow_pop(Flow *f)
+{
+    Segment *seg = f->first;
+
+    f->first = seg->next;
+    if (f->first == NULL)
+        f->last = NULL;
+    free(seg);
+}
+
+static void flow_schedule(Flow *f, uint64_t now);
+
+/* The receiver reset its connection. The data for it is dropped, and the
+ * reset goes back to the sender, behind anything already on its way. */
+static void flow_refused(Flow *f, uint64_t now)
+{
+    Session *s = f->session;
+
+    while (f->first != NULL)
+        flow_pop(f);
+    f->done = TRUE;
+    if (f->peer->done) {
+        proxy.resets++;
+        session_end(s, f->from);
+        return;
+    }
+    f->peer->ended = TRUE;
+    flow_enqueue(f->peer, SEG_RST, 0, now);
+    flow_schedule(f->peer, now);
+}
+
+/* Hand on whatever is due. Return TRUE if anything moved. */
+static Boolean flow_deliver(Flow *f, uint64_t now)
+{
+    Session *s = f->session;
+    Segment *seg;
+    Pipe *p;
+    ssize_t n;
+    Boolean moved = FALSE;
+
+    while ((seg = f->first) != NULL && seg->due <= now && !s->dead) {
+        if (seg->kind == SEG_RST) {
+            /* The reset reaches the other end; both connections go */
+            proxy.resets++;
+            session_end(s, f->to);
+            return TRUE;
+        }
+        if (!s->connected)
+            break;
+        if (seg->kind == SEG_FIN) {
+            proxy.fins++;
+            shutdown(f->to, SHUT_WR);
+            flow_pop(f);
+            f->done = TRUE;
+            if (f->peer->done)
+                session_end(s, -1);
+            return TRUE;
+        }
+        if (!f->writable)
+            break;
+
+        while (f->pipes[f->head].used == 0 && f->head != f->tail)
+            f->head = (f->head + 1) % MAX_PIPES;
+        p = &f->pipes[f->head];
+        n = splice(p->fd[0], NULL, f->to, NULL,
+                   seg->len < p->used ? seg->len : p->used,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+                   (seg->next != NULL ? SPLICE_F_MORE : 0));
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                f->writable = FALSE;
+                break;
+            }
+            if (errno == EINTR)
+                continue;
+            flow_refused(f, now);
+            return TRUE;
+        }
+        moved = TRUE;
+        seg->len -= n;
+        p->used -= n;
+        f->queued -= n;
+        f->bytes += n;
+        if (seg->len == 0)
+            flow_pop(f);
+    }
+    return moved;
+}
+
+/* Take in whatever the bandwidth cap and the queue allow. Return TRUE if
+ * anything was read. */
+static Boolean flow_receive(Flow *f, uint64_t now)
+{
+    const Options *options = proxy.options;
+    Pipe *p;
+    size_t len;
+    double depth;
+    ssize_t n;
+    int pending, next;
+
+    if (options->rate > 0) {
+        depth = options->rate * BUCKET_MS / 1000;
+        if (depth < MIN_READ)
+            depth = MIN_READ;
+        f->tokens += options->rate * (now - f->refilled) / NSECS_PER_SEC;
+        if (f->tokens > depth)
+            f->tokens = depth;
+        f->refilled = now;
+    }
+
+    if (f->session->dead || f->done)
+        return FALSE;
+    while (f->readable && !f->ended) {
+        if (options->rate > 0 && f->tokens < 1)
+            return FALSE;
+        if (f->queued >= options->queue_size)
+            return FALSE;
+
+        p = flow_pipe(f);
+        len = options->queue_size - f->queued;
+        if (len > PIPE_SIZE)
+            len = PIPE_SIZE;
+        if (options->rate > 0 && len > f->tokens)
+            len = (size_t) f->tokens;
+
+        n = splice(f->from, NULL, p->fd[1], NULL, len,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            p->used += n;
+            f->queued += n;
+            if (options->rate > 0)
+                f->tokens -= n;
+            flow_enqueue(f, SEG_DATA, n, now);
+            continue;
+        }
+        if (n == 0) {
+            f->ended = TRUE;
+            flow_enqueue(f, SEG_FIN, 0, now);
+            return TRUE;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN) {
+            /* Either the socket is empty or the pipe is full, which can
+             * happen well short of its size when it fills with small
+             * pages. Only the socket knows which. */
+            if (ioctl(f->from, FIONREAD, &pending) == -1 || pending == 0) {
+                f->readable = FALSE;
+                return FALSE;
+            }
+            next = (f->tail + 1) % MAX_PIPES;
+            if (next == f->head)
+                return FALSE;   /* Ring full; wait for deliveries */
+            f->tail = next;
+            continue;
+        }
+        /* ECONNRESET, in effect: pass it on in its place in the stream */
+        f->ended = TRUE;
+        flow_enqueue(f, SEG_RST, 0, now);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Arm the timer for when more can move */
+static void flow_schedule(Flow *f, uint64_t now)
+{
+    const Options *options = proxy.options;
+    Session *s = f->session;
+    Segment *seg = f->first;
+    uint64_t wake;
+    double need;
+
+    wake = 0;
+    if (seg != NULL && (seg->kind == SEG_RST ||
+                        (s->connected && (seg->kind == SEG_FIN ||
+                                          f->writable))))
+        wake = seg->due;
+    if (options->rate > 0 && f->readable && !f->ended &&
+        f->queued < options->queue_size && f->tokens < 1) {
+        need = options->rate * BUCKET_MS / 1000;
+        if (need > MIN_READ)
+            need = MIN_READ;
+        need = now + (need - f->tokens) / options->rate * NSECS_PER_SEC;
+        if (wake == 0 || need < wake)
+            wake = (uint64_t) need;
+    }
+
+    wheel_cancel(&proxy.wheel, &f->timer);
+    if (wake != 0)
+        wheel_add(&proxy.wheel, &f->timer, wake);
+}
+
+/* Move everything that can move, then wait for the next thing that can */
+static void flow_pump(Flow *f)
+{
+    Session *s = f->session;
+    uint64_t now;
+
+    do {
+        now = timestamp();
+        if (s->dead)
+            return;
+    } while (flow_deliver(f, now) | flow_receive(f, now));
+    if (!s->dead)
+        flow_schedule(f, now);
+}
+
+static void flow_timer(void *owner, void *data)
+{
+    (void) data;
+    flow_pump(owner);
+}
+
+static void watch(int fd, Flow *f)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = f;
+    if (epoll_ctl(proxy.epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        die("epoll_ctl() EPOLL_CTL_ADD");
+}
+
+static void accept_sessions(void)
+{
+    Session *s;
+    int fd, sfd;
+
+    for (;;) {
+        fd = accept4(proxy.listenfd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            die("accept4()");
+        }
+
+        sfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sfd == -1)
+            die("socket()");
+        if (connect(sfd, (struct sockaddr *) &proxy.server_addr,
+                    proxy.server_addrlen) == -1 && errno != EINPROGRESS) {
+            perror("connect() to server");
+            close(sfd);
+            close(fd);
+            proxy.connect_failed++;
+            continue;
+        }
+
+        s = calloc(1, sizeof(Session));
+        if (s == NULL)
+            fatal("out of memory");
+        s->client_fd = fd;
+        s->server_fd = sfd;
+        flow_init(&s->up, s, &s->down, fd, sfd);
+        flow_init(&s->down, s, &s->up, sfd, fd);
+        proxy.active++;
+        watch(fd, &s->up);
+        watch(sfd, &s->down);
+    }
+}
+
+/* The server socket's first writability is the end of its connect() */
+static void session_connected(Session *s)
+{
+    socklen_t len;
+    int err;
+
+    len = sizeof(err);
+    if (getsockopt(s->server_fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        die("getsockopt() SO_ERROR");
+    if (err != 0) {
+        /* Refuse the client the way the server refused us */
+        proxy.connect_failed++;
+        session_end(s, s->client_fd);
+        return;
+    }
+    s->connected = TRUE;
+}
+
+static void flow_event(Flow *f, uint32_t events)
+{
+    Session *s = f->session;
+
+    if (s->dead)
+        return;
+    if (f == &s->down && !s->connected) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        session_connected(s);
+        if (s->dead)
+            return;
+    }
+    /* f reads from this socket; the peer writes to it */
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        f->readable = TRUE;
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+        f->peer->writable = TRUE;
+    flow_pump(f);
+    flow_pump(f->peer);
+}
+
+static void print_totals(void)
+{
+    printf("Sessions: %ld\n", proxy.sessions);
+    if (proxy.active > 0)
+        printf("Sessions still open: %ld\n", proxy.active);
+    if (proxy.connect_failed > 0)
+        printf("Server connects failed: %ld\n", proxy.connect_failed);
+    printf("Bytes client to server: %llu\n",
+           (unsigned long long) proxy.bytes_up);
+    printf("Bytes server to client: %llu\n",
+           (unsigned long long) proxy.bytes_down);
+    printf("FINs forwarded: %ld\n", proxy.fins);
+    printf("Resets forwarded: %ld\n", proxy.resets);
+}
+
+int main(int argc, char *argv[])
+{
+    Options popts, *options = &popts;
+    struct epoll_event events[MAX_EVENTS], ev;
+    struct sigaction sa;
+    sigset_t block_mask, wait_mask;
+    char *hostname;
+    int i, n;
+
+    parse_opts(argc, argv, options, &hostname);
+
+    memset(&proxy, 0, sizeof(proxy));
+    proxy.options = options;
+    resolve_addr(hostname, options->server_port, &proxy.server_addr,
+                 &proxy.server_addrlen);
+    raise_fd_limit();
+    random_state = timestamp() | 1;
+    wheel_init(&proxy.wheel, timestamp());
+
+    proxy.listenfd = open_listener(options);
+    proxy.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (proxy.epfd == -1)
+        die("epoll_create1()");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(proxy.epfd, EPOLL_CTL_ADD, proxy.listenfd, &ev) == -1)
+        die("epoll_ctl() EPOLL_CTL_ADD");
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1 ||
+        sigaction(SIGTERM, &sa, NULL) == -1)
+        die("sigaction()");
+    signal(SIGPIPE, SIG_IGN);
+
+    /* As in linger-server, the stop signals are only let in during
+     * epoll_pwait() */
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &block_mask, &wait_mask) == -1)
+        die("sigprocmask()");
+
+    printf("-- proxying port %d to %s:%s\n", options->listen_port, hostname,
+           options->server_port);
+    printf("Delay (ms): %.3f one-way, jitter %.3f\n", options->delay,
+           options->jitter);
+    if (options->rate > 0)
+        printf("Rate cap (Mbit/s): %.3f\n", options->rate * 8 / 1e6);
+    fflush(stdout);
+
+    while (!stop_requested) {
+        if (options->max_sessions > 0 &&
+            proxy.sessions >= options->max_sessions)
+            break;
+        n = epoll_pwait(proxy.epfd, events, MAX_EVENTS,
+                        wheel_timeout(&proxy.wheel, timestamp()), &wait_mask);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            die("epoll_pwait()");
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_sessions();
+            else
+                flow_event(events[i].data.ptr, events[i].events);
+        }
+        wheel_expire(&proxy.wheel, timestamp());
+        bury_sessions();
+    }
+
+    print_totals();
+    exit(EXIT_SUCCESS);
+}
+
+#else
+
+int main(int argc, char *argv[])
+{
+    Options popts;
+    char *hostname;
+
+    parse_opts(argc, argv, &popts, &hostname);
+    fatal("linger-proxy requires Linux");
+}
+
+#endif /* __linux__ */
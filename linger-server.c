@@ -22,18 +22,46 @@
 * See the file COPYING.agpl-v3 for details.                               *
 \*************************************************************************/
 
+#ifdef __linux__
+#define _GNU_SOURCE         /* accept4(), splice(), memfd_create() */
+#endif
+
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
-#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <linux/errqueue.h>
+#include <linux/inet_diag.h>
+#include <linux/io_uring.h>
+#include <linux/netlink.h>
+#include <linux/perf_event.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 
 #ifdef TRUE
 #undef TRUE
@@ -50,11 +78,45 @@ typedef enum { FALSE, TRUE } Boolean;
 #define PAYLOAD_SIZE (20 * 1024)
 #define BACKLOG 128
 #define TIME_MAX 86400
+#define MAX_EVENTS 256
+#define NSECS_PER_SEC 1000000000ULL
+#define READY_BYTE 'R'
+#define PATTERN_STEP 0x9E3779B97F4A7C15ULL
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+#define RING_ENTRIES 1024
+#define SAMPLE_RING_SIZE (1 << 18)
+#define SAMPLE_TAIL_SECS 2
+#define SAMPLE_HZ_MAX 1000000
+#define CLOSER_DRAIN_CHECK (5 * 1000000ULL)
+#define WHEEL_TICK 1000000ULL       /* 1 ms */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 5
+#define WHEEL_BENCH_SPAN 60000      /* ms */
 
 #define OPT_NOSOCK 0
 #define OPT_LSOCK 1
 #define OPT_CSOCK 2
 #define OPT_CSOCK_LATE 3
+#define OPT_DEFERRED 4
+
+#define BACKEND_WRITE 0
+#define BACKEND_SENDFILE 1
+#define BACKEND_SPLICE 2
+#define BACKEND_ZEROCOPY 3
+#define BACKEND_WRITEV 4
+
+#define FRAMING_NONE 0
+#define FRAMING_MORE 1
+#define FRAMING_CORK 2
+
+#define FRAME_SIZE (16 * 1024)
+#define FRAME_HEADER 16
+#define FRAME_BATCH 32                  /* Frames per sendmsg() */
+
+#define SEND_DONE 0
+#define SEND_BLOCKED 1
+#define SEND_ERROR 2
 
 #define printable(ch) (isprint((unsigned char) ch) ? ch : '#')
 
@@ -65,8 +127,51 @@ typedef struct {
     Boolean use_shutdown;
     Boolean nonblocking;
     int shutdown_time;
+    Boolean event_loop;
+    Boolean uring;
+    int sample_hz;
+    long max_conns;
+    Boolean fast;
+    int backend;
+    size_t payload_size;
+    Boolean wheel_bench;
+    int threads;
+    const char *trace_path;
+    const char *timeline_name;
+    Boolean counters;
+    int adaptive_budget;
+    int mem_interval;
+    size_t shrink_sndbuf;
+    int framing;
+    int stream_msecs;
+    Boolean fastopen;
 } Options;
 
+typedef struct {
+    char *buf;
+    size_t size;
+    int fd;                     /* memfd backing buf (Linux only) */
+} Payload;
+
+/* Progress of sending the payload on one connection */
+typedef struct {
+    int backend;
+    size_t sent;                /* Bytes accepted by the socket */
+    long calls;
+    long blocked;               /* Calls that found the socket full */
+    short wait_events;          /* What to poll for after SEND_BLOCKED */
+    int pipefd[2];              /* splice: memfd -> pipe -> socket */
+    size_t piped;               /* splice: bytes in the pipe */
+    uint32_t zc_sent;           /* MSG_ZEROCOPY: send() calls */
+    uint32_t zc_done;           /* ...completions reaped */
+    uint32_t zc_copied;         /* ...completions the kernel copied */
+    int framing;                /* writev: FRAMING_* */
+    uint64_t duration;          /* -D: cut the stream after this long */
+    uint64_t started;           /* First push */
+    uint64_t stopped;           /* Payload sent, or the stream cut */
+    Boolean cut;
+} Sender;
+
 static void fatal(const char *msg)
 {
     fprintf(stderr, "%s\n", msg);
@@ -83,8 +188,13 @@ static void usage_exit(const char *prog_name, const char *msg, int opt)
 {
     if (msg != NULL && opt != 0)
         fprintf(stderr, "%s (-%c)\n", msg, printable(opt));
-    fprintf(stderr, "Usage: %s [-s lsock|csock|csock_late] [-t linger_secs] "
-                    "[-w] [-N] [-S] [-T eof_wait_secs]\n", prog_name);
+    fprintf(stderr, "Usage: %s [-s lsock|csock|csock_late|deferred] [-t linger_secs] "
+                    "[-w] [-N] [-S] [-T eof_wait_secs] [-E] [-n conns] [-F]\n"
+                    "       [-B write|sendfile|splice|zerocopy|writev] [-G more|cork]\n"
+                    "       [-P size] [-D msecs] [-U]\n"
+                    "       [-I hz] [-W] [-R threads] [-X file] [-M name] [-C]\n"
+                    "       [-A budget_msecs] [-m msecs] [-k size] [-O]\n",
+                    prog_name);
     fprintf(stderr,
             "     -h             Print usage and exit.\n"
             "     -s sock_type   The SO_LINGER option is applied to sock_type:\n"
@@ -92,23 +202,139 @@ static void usage_exit(const char *prog_name, const char *msg, int opt)
             "                        csock - The connected socket\n"
             "                        csock_late - The connected socket. This requires -S to\n"
             "                                be effective as it is applied after shutdown().\n"
+            "                        deferred - No SO_LINGER (Linux only). Hand\n"
+            "                                the connection to a background engine\n"
+            "                                that calls shutdown(), closes once the\n"
+            "                                send queue drains or EOF arrives, and\n"
+            "                                resets it if that takes over -t secs.\n"
             "     -t secs        The SO_LINGER timeout in seconds. This only\n"
             "                    has an effect when -s is set.\n"
             "     -w             Wait for user confirmation before exiting.\n"
             "     -N             Put connected socket in Non-Blocking mode.\n"
             "     -S             Use shutdown() and wait for EOF.\n"
             "     -T secs        Timeout waiting for EOF after shutdown().\n"
-            "                    Must be > 0.\n");
+            "                    Must be > 0.\n"
+            "     -E             Event loop mode (Linux only). Serve many clients\n"
+            "                    concurrently with epoll, applying the linger\n"
+            "                    policy to each, and report aggregate results.\n"
+            "     -n conns       Number of connections to serve before reporting.\n"
+            "                    Without -E they are served one after another\n"
+            "                    (default 1). With -E, 0 (default) runs until\n"
+            "                    SIGINT.\n"
+            "     -F             Fast mode. Write as soon as the client sends its\n"
+            "                    ready byte instead of sleeping for 1 sec. Use\n"
+            "                    with linger-client -F.\n"
+            "     -B backend     How the payload is sent (Linux only, except\n"
+            "                    write, the default):\n"
+            "                        write - send() from a mapped buffer\n"
+            "                        sendfile - sendfile() from a memfd\n"
+            "                        splice - splice() memfd -> pipe -> socket\n"
+            "                        zerocopy - send(MSG_ZEROCOPY), reaping\n"
+            "                                completions from the error queue\n"
+            "                        writev - sendmsg() of 16K frames, each a\n"
+            "                                header and a body iovec, 32 at\n"
+            "                                a time\n"
+            "     -G framing     With -B writev, coalesce frames (Linux only):\n"
+            "                        more - MSG_MORE on all but the last batch\n"
+            "                        cork - TCP_CORK around each batch\n"
+            "     -P size        Payload size in bytes, with an optional K, M or\n"
+            "                    G suffix (default 20K).\n"
+            "     -D msecs       Streaming. Stop sending msecs after the first\n"
+            "                    write, wherever the payload has got to, and\n"
+            "                    apply the close policy mid-stream; report the\n"
+            "                    throughput and the bytes in flight at close\n"
+            "                    (Linux only). Give -P enough to last, and\n"
+            "                    linger-client the same -P to count losses.\n"
+            "                    Not with -U.\n"
+            "     -U             io_uring mode (Linux only). Like -E, but each\n"
+            "                    connection's send, shutdown(), EOF read and\n"
+            "                    close() are submitted as one linked chain, and\n"
+            "                    the latency of each step is reported. Only the\n"
+            "                    write backend is supported.\n"
+            "     -I hz          Sample TCP_INFO and SIOCOUTQ/SIOCOUTQNSD of the\n"
+            "                    connected socket hz times a second (Linux only,\n"
+            "                    not with -E or -U), following it through close()\n"
+            "                    with sock_diag, and dump the series at exit.\n"
+            "     -W             Benchmark the timer wheel that drives the -E\n"
+            "                    and deferred close deadlines (Linux only):\n"
+            "                    report the cost per timer of adding,\n"
+            "                    cancelling and expiring 1K to 1M timers, then\n"
+            "                    exit.\n"
+            "     -R threads     With -E, run threads event loops (Linux only),\n"
+            "                    each pinned to its own CPU and accepting on\n"
+            "                    its own SO_REUSEPORT listening socket, and\n"
+            "                    report each one's results before the totals.\n"
+            "                    -n then counts connections across all of\n"
+            "                    them.\n"
+            "     -X file        Record every accept, SO_LINGER, write,\n"
+            "                    EWOULDBLOCK, shutdown(), EOF and close() to\n"
+            "                    file as a binary trace (Linux only). Convert\n"
+            "                    it with linger-trace.\n"
+            "     -M name        Stamp each connection's accept, writes,\n"
+            "                    shutdown() and close() into the shared\n"
+            "                    memory timeline name, cleared first, for\n"
+            "                    linger-client -M name on the same host to\n"
+            "                    line its reads up against (not with -U, or\n"
+            "                    through linger-proxy).\n"
+            "     -C             Read perf counters (task-clock, context\n"
+            "                    switches, CPU migrations, and cycles and\n"
+            "                    instructions where available) around each\n"
+            "                    write, shutdown(), EOF wait and close(), and\n"
+            "                    report them with the timings (Linux only,\n"
+            "                    not with -U).\n"
+            "     -A msecs       Adaptive linger (Linux only, needs -s and\n"
+            "                    -t, not with -N or -U). Just before close(),\n"
+            "                    replace the timeout with twice the time the\n"
+            "                    send queue should take to drain at the\n"
+            "                    measured delivery rate, up to msecs (whole\n"
+            "                    secs for SO_LINGER). Report the blocking\n"
+            "                    time and bytes that saves against -t.\n"
+            "     -m msecs       Sample TCP socket counts and memory from\n"
+            "                    /proc/net/sockstat every msecs and print the\n"
+            "                    series, and the memory per socket, at exit;\n"
+            "                    read each connection's SO_MEMINFO as it is\n"
+            "                    closed (Linux only).\n"
+            "     -k size        Cut SO_SNDBUF to size just before close and\n"
+            "                    report the socket memory that gives back\n"
+            "                    (Linux only, not with -U).\n"
+            "     -O             Accept TCP Fast Open on the listening socket,\n"
+            "                    for linger-client -O (Linux only; needs bit\n"
+            "                    2 of net.ipv4.tcp_fastopen).\n");
     exit(EXIT_FAILURE);
 }
 
-static void get_payload(char *buf, int size)
+/* A pattern word laid out as it goes in the stream, least significant
+ * byte first, whatever the host's byte order. This compiles to a plain
+ * move, or a byte swap on big-endian hosts. */
+static uint64_t pattern_word(uint64_t word)
 {
-    int i;
+    unsigned char bytes[8];
+    uint64_t laid;
+    int j;
+
+    for (j = 0; j < 8; j++)
+        bytes[j] = (unsigned char) (word >> (8 * j));
+    memcpy(&laid, bytes, 8);
+    return laid;
+}
+
+/* Byte i of the payload is byte i % 8, least significant first, of the
+ * 64-bit word (i / 8 + 1) * PATTERN_STEP. Every aligned 8 bytes thus name
+ * their own offset, and linger-client can tell exactly which bytes of the
+ * stream it got. The pattern is stored a word at a time, as linger-client
+ * checks it. */
+static void get_payload(char *buf, size_t size)
+{
+    unsigned char *p = (unsigned char *) buf;
+    uint64_t word = PATTERN_STEP, laid;
+    size_t i, j;
 
-    for (i = 0; i < size; i++) {
-        buf[i] = '.';
+    for (i = 0; i + 8 <= size; i += 8, word += PATTERN_STEP) {
+        laid = pattern_word(word);
+        memcpy(p + i, &laid, 8);
     }
+    for (j = 0; i < size; i++, j++)
+        p[i] = (unsigned char) (word >> (8 * j));
 }
 
 static void set_socket_options(int fd)
@@ -126,20 +352,6 @@ static void set_socket_options(int fd)
         die("setting SO_SNDBUF");
 }
 
-static void set_linger(int fd, int linger_time)
-{
-    int r;
-    struct linger ling;
-
-    ling.l_onoff = 1;
-    ling.l_linger = linger_time;
-    r = setsockopt(fd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
-    if (r == -1)
-        die("setting SO_LINGER");
-
-    printf("Linger timeout (secs): %d\n", linger_time);
-}
-
 static void set_nonblocking(int fd)
 {
     int flags;
@@ -151,6 +363,35 @@ static void set_nonblocking(int fd)
         die("fcntl F_SETFL");
 }
 
+/* Parse a byte count with an optional K, M or G suffix. Returns 0 if the
+ * string is not a valid, non-zero size. */
+static size_t parse_size(const char *str)
+{
+    unsigned long long size;
+    char suffix = '\0', extra;
+    int n;
+
+    n = sscanf(str, "%llu%c%c", &size, &suffix, &extra);
+    if (n < 1 || n > 2)
+        return 0;
+    switch (toupper((unsigned char) suffix)) {
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        /* fall through */
+    case '\0':
+        break;
+    default:
+        return 0;
+    }
+    return (size_t) size;
+}
+
 static void parse_opts(int argc, char *argv[], Options *options)
 {
     int opt;
@@ -162,9 +403,27 @@ static void parse_opts(int argc, char *argv[], Options *options)
     options->use_shutdown = FALSE;
     options->nonblocking = FALSE;
     options->shutdown_time = 0;
+    options->event_loop = FALSE;
+    options->uring = FALSE;
+    options->sample_hz = 0;
+    options->max_conns = 0;
+    options->fast = FALSE;
+    options->backend = BACKEND_WRITE;
+    options->payload_size = PAYLOAD_SIZE;
+    options->wheel_bench = FALSE;
+    options->threads = 0;
+    options->trace_path = NULL;
+    options->timeline_name = NULL;
+    options->counters = FALSE;
+    options->adaptive_budget = 0;
+    options->mem_interval = 0;
+    options->shrink_sndbuf = 0;
+    options->framing = FRAMING_NONE;
+    options->stream_msecs = 0;
+    options->fastopen = FALSE;
     prog_name = argv[0] ? argv[0] : "[prog_name]";
 
-    while ((opt = getopt(argc, argv, ":hs:t:wNST:")) != -1) {
+    while ((opt = getopt(argc, argv, ":hs:t:wNST:En:FB:G:P:D:UI:WR:X:M:CA:m:k:O")) != -1) {
         switch (opt) {
         case 'h':
             usage_exit(prog_name, NULL, opt);
@@ -175,6 +434,10 @@ static void parse_opts(int argc, char *argv[], Options *options)
                 options->linger_sock = OPT_CSOCK;
             else if (strcmp("csock_late", optarg) == 0)
                 options->linger_sock = OPT_CSOCK_LATE;
+#ifdef __linux__
+            else if (strcmp("deferred", optarg) == 0)
+                options->linger_sock = OPT_DEFERRED;
+#endif
             else
                 usage_exit(prog_name, "Bad socket option", opt);
             break;
@@ -203,6 +466,161 @@ static void parse_opts(int argc, char *argv[], Options *options)
                             "Shutdown timeout must be > 0 and <= 86400",
                             opt);
             break;
+        case 'E':
+#ifdef __linux__
+            options->event_loop = TRUE;
+#else
+            usage_exit(prog_name, "Event loop mode requires Linux", opt);
+#endif
+            break;
+        case 'n':
+            if (sscanf(optarg, "%ld", &options->max_conns) != 1)
+                usage_exit(prog_name, "Integer argument expected", opt);
+            if (options->max_conns < 0)
+                usage_exit(prog_name, "Connection count must be >= 0", opt);
+            break;
+        case 'F':
+            options->fast = TRUE;
+            break;
+        case 'B':
+            if (strcmp("write", optarg) == 0)
+                options->backend = BACKEND_WRITE;
+#ifdef __linux__
+            else if (strcmp("sendfile", optarg) == 0)
+                options->backend = BACKEND_SENDFILE;
+            else if (strcmp("splice", optarg) == 0)
+                options->backend = BACKEND_SPLICE;
+            else if (strcmp("zerocopy", optarg) == 0)
+                options->backend = BACKEND_ZEROCOPY;
+#endif
+            else if (strcmp("writev", optarg) == 0)
+                options->backend = BACKEND_WRITEV;
+            else
+                usage_exit(prog_name, "Bad send backend", opt);
+            break;
+        case 'G':
+#ifdef __linux__
+            if (strcmp("more", optarg) == 0)
+                options->framing = FRAMING_MORE;
+            else if (strcmp("cork", optarg) == 0)
+                options->framing = FRAMING_CORK;
+            else
+                usage_exit(prog_name, "Bad framing", opt);
+#else
+            usage_exit(prog_name, "Framing requires Linux", opt);
+#endif
+            break;
+        case 'D':
+#ifdef __linux__
+            if (sscanf(optarg, "%d", &options->stream_msecs) != 1)
+                usage_exit(prog_name, "Integer argument expected", opt);
+            if (options->stream_msecs <= 0 ||
+                options->stream_msecs > TIME_MAX * 1000)
+                usage_exit(prog_name,
+                           "Duration must be > 0 and <= 86400000", opt);
+#else
+            usage_exit(prog_name, "Streaming requires Linux", opt);
+#endif
+            break;
+        case 'P':
+            options->payload_size = parse_size(optarg);
+            if (options->payload_size == 0)
+                usage_exit(prog_name, "Bad payload size", opt);
+            break;
+        case 'U':
+#ifdef __linux__
+            options->uring = TRUE;
+#else
+            usage_exit(prog_name, "io_uring mode requires Linux", opt);
+#endif
+            break;
+        case 'I':
+#ifdef __linux__
+            if (sscanf(optarg, "%d", &options->sample_hz) != 1)
+                usage_exit(prog_name, "Integer argument expected", opt);
+            if (options->sample_hz <= 0 || options->sample_hz > SAMPLE_HZ_MAX)
+                usage_exit(prog_name,
+                           "Sample rate must be > 0 and <= 1000000", opt);
+#else
+            usage_exit(prog_name, "Sampling requires Linux", opt);
+#endif
+            break;
+        case 'W':
+#ifdef __linux__
+            options->wheel_bench = TRUE;
+#else
+            usage_exit(prog_name, "Timer wheel benchmark requires Linux", opt);
+#endif
+            break;
+        case 'R':
+#ifdef __linux__
+            if (sscanf(optarg, "%d", &options->threads) != 1)
+                usage_exit(prog_name, "Integer argument expected", opt);
+            if (options->threads <= 0 || options->threads > CPU_SETSIZE)
+                usage_exit(prog_name, "Thread count must be > 0 and <= 1024",
+                           opt);
+#else
+            usage_exit(prog_name, "Worker threads require Linux", opt);
+#endif
+            break;
+        case 'X':
+#ifdef __linux__
+            options->trace_path = optarg;
+#else
+            usage_exit(prog_name, "Tracing requires Linux", opt);
+#endif
+            break;
+        case 'M':
+            options->timeline_name = optarg;
+            break;
+        case 'C':
+#ifdef __linux__
+            options->counters = TRUE;
+#else
+            usage_exit(prog_name, "Perf counters require Linux", opt);
+#endif
+            break;
+        case 'A':
+#ifdef __linux__
+            if (sscanf(optarg, "%d", &options->adaptive_budget) != 1)
+                usage_exit(prog_name, "Integer argument expected", opt);
+            if (options->adaptive_budget <= 0 ||
+                options->adaptive_budget > TIME_MAX * 1000)
+                usage_exit(prog_name,
+                           "Budget must be > 0 and <= 86400000", opt);
+#else
+            usage_exit(prog_name, "Adaptive linger requires Linux", opt);
+#endif
+            break;
+        case 'm':
+#ifdef __linux__
+            if (sscanf(optarg, "%d", &options->mem_interval) != 1)
+                usage_exit(prog_name, "Integer argument expected", opt);
+            if (options->mem_interval <= 0 ||
+                options->mem_interval > TIME_MAX * 1000)
+                usage_exit(prog_name,
+                           "Interval must be > 0 and <= 86400000", opt);
+#else
+            usage_exit(prog_name, "Memory accounting requires Linux", opt);
+#endif
+            break;
+        case 'O':
+#ifdef __linux__
+            options->fastopen = TRUE;
+#else
+            usage_exit(prog_name, "TCP Fast Open requires Linux", opt);
+#endif
+            break;
+        case 'k':
+#ifdef __linux__
+            options->shrink_sndbuf = parse_size(optarg);
+            if (options->shrink_sndbuf == 0 ||
+                options->shrink_sndbuf > INT_MAX / 2)
+                usage_exit(prog_name, "Bad buffer size", opt);
+#else
+            usage_exit(prog_name, "Memory accounting requires Linux", opt);
+#endif
+            break;
         case ':':
             usage_exit(prog_name, "Missing argument", optopt);
         case '?':
@@ -211,170 +629,4066 @@ static void parse_opts(int argc, char *argv[], Options *options)
             fatal("Unexpected case in switch()");
         }
     }
+
+    if (options->uring && options->event_loop)
+        usage_exit(prog_name, "Can't be combined with -E", 'U');
+    if (options->uring && options->backend != BACKEND_WRITE)
+        usage_exit(prog_name, "Only the write backend is supported", 'U');
+    if (options->uring && options->payload_size > INT_MAX)
+        usage_exit(prog_name, "Payload must be under 2G", 'U');
+    if (options->threads > 0 && !options->event_loop)
+        usage_exit(prog_name, "Needs -E", 'R');
+    if (options->timeline_name != NULL && options->uring)
+        usage_exit(prog_name, "Can't be combined with -U", 'M');
+    if (options->counters && options->uring)
+        usage_exit(prog_name, "Can't be combined with -U", 'C');
+    if (options->adaptive_budget > 0) {
+        if (options->linger_sock == OPT_NOSOCK || options->linger_time < 0)
+            usage_exit(prog_name, "Needs -s and -t to compare with", 'A');
+        if (options->nonblocking || options->uring)
+            usage_exit(prog_name, "Can't be combined with -N or -U", 'A');
+    }
+    if (options->framing != FRAMING_NONE &&
+        options->backend != BACKEND_WRITEV)
+        usage_exit(prog_name, "Needs -B writev", 'G');
+    if (options->stream_msecs > 0 && options->uring)
+        usage_exit(prog_name, "Can't be combined with -U", 'D');
+    if (options->shrink_sndbuf > 0 && options->uring)
+        usage_exit(prog_name, "Can't be combined with -U", 'k');
+    if (options->sample_hz > 0 && (options->event_loop || options->uring))
+        usage_exit(prog_name, "Can't be combined with -E or -U", 'I');
+    if (options->linger_sock == OPT_DEFERRED) {
+        if (options->linger_time < 0)
+            usage_exit(prog_name, "Deferred close needs -t secs >= 0", 's');
+        if (options->use_shutdown || options->uring)
+            usage_exit(prog_name, "Deferred close can't be combined with "
+                       "-S or -U", 's');
+    }
 }
 
-static void timestamp(struct timeval *tp)
+static uint64_t timestamp(void)
 {
-    if (gettimeofday(tp, NULL) == -1)
-        die("gettimeofday() failure");
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        die("clock_gettime() failure");
+    return (uint64_t) ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
 }
 
-static double time_diff(const struct timeval *before,
-                        const struct timeval *after)
+static double time_diff(uint64_t before, uint64_t after)
 {
-    double x, y;
+    return (double) (int64_t) (after - before) / NSECS_PER_SEC;
+}
+
+/* Log-bucketed latency histogram in the style of HdrHistogram. Values below
+ * HIST_SUB_BUCKETS nanoseconds are counted exactly; above that every power of
+ * two is split into HIST_SUB_BUCKETS / 2 linear sub-buckets, which keeps the
+ * relative error under 2% across the whole 64-bit range.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_HALF_BUCKETS (HIST_SUB_BUCKETS / 2)
+#define HIST_BUCKETS (HIST_SUB_BUCKETS + (64 - HIST_SUB_BITS) * HIST_HALF_BUCKETS)
 
-    x = (double) before->tv_sec + (double) before->tv_usec / 1000000;
-    y = (double) after->tv_sec + (double) after->tv_usec / 1000000;
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+static int hist_index(uint64_t value)
+{
+    int shift;
 
-    return y - x;
+    if (value < HIST_SUB_BUCKETS)
+        return (int) value;
+    shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return HIST_SUB_BUCKETS + (shift - 1) * HIST_HALF_BUCKETS +
+           (int) (value >> shift) - HIST_HALF_BUCKETS;
 }
 
-static void shutdown_wait_eof(int connfd, const Options *options)
+/* The highest value that is counted in bucket i */
+static uint64_t hist_value(int i)
 {
-    struct timeval tv1, *tp_before = &tv1;
-    struct timeval tv2, *tp_after = &tv2;
-    int r;
-    ssize_t n;
-    char c;
+    int shift;
+    uint64_t top;
 
-    puts("-- calling shutdown() on connected socket");
-    timestamp(tp_before);
+    if (i < HIST_SUB_BUCKETS)
+        return i;
+    i -= HIST_SUB_BUCKETS;
+    shift = i / HIST_HALF_BUCKETS + 1;
+    top = i % HIST_HALF_BUCKETS + HIST_HALF_BUCKETS;
+    return ((top + 1) << shift) - 1;
+}
 
-    r = shutdown(connfd, SHUT_WR);
-    if (r == -1) {
-        if (errno == EWOULDBLOCK)
-            puts("EWOULDBLOCK on shutdown()");
-        else
-            die("shutdown connfd");
+static void hist_record(Histogram *h, uint64_t value)
+{
+    h->counts[hist_index(value)]++;
+    h->total++;
+    if (value > h->max)
+        h->max = value;
+}
+
+static uint64_t hist_percentile(const Histogram *h, double pct)
+{
+    uint64_t rank, seen;
+    int i;
+
+    if (h->total == 0)
+        return 0;
+    rank = (uint64_t) (pct / 100 * h->total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    seen = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            break;
     }
-    timestamp(tp_after);
-    printf("Time to shutdown(): %.3f secs\n", time_diff(tp_before, tp_after));
+    return hist_value(i) < h->max ? hist_value(i) : h->max;
+}
 
-    if (options->linger_sock == OPT_CSOCK_LATE) {
-        puts("Late Linger: on (connected socket)");
-        set_linger(connfd, options->linger_time);
+static void hist_print(const char *label, const Histogram *h)
+{
+    if (h->total == 0)
+        return;
+    printf("%s (usecs): n %llu  p50 %.3f  p90 %.3f  p99 %.3f  "
+           "p99.9 %.3f  max %.3f\n", label, (unsigned long long) h->total,
+           hist_percentile(h, 50) / 1000.0, hist_percentile(h, 90) / 1000.0,
+           hist_percentile(h, 99) / 1000.0, hist_percentile(h, 99.9) / 1000.0,
+           h->max / 1000.0);
+}
+
+static void hist_print_units(const char *label, const char *unit,
+                             const Histogram *h)
+{
+    if (h->total == 0)
+        return;
+    printf("%s (%s): n %llu  p50 %llu  p90 %llu  p99 %llu  max %llu\n",
+           label, unit, (unsigned long long) h->total,
+           (unsigned long long) hist_percentile(h, 50),
+           (unsigned long long) hist_percentile(h, 90),
+           (unsigned long long) hist_percentile(h, 99),
+           (unsigned long long) h->max);
+}
+
+static void hist_merge(Histogram *into, const Histogram *from)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+/* Perf counters: with -C each thread that serves connections opens a group
+ * of perf counters on itself - task-clock, context-switches and
+ * cpu-migrations, plus cycles and instructions if the CPU (or hypervisor)
+ * has them - and reads the group on either side of each write, shutdown(),
+ * EOF wait and close(). A lingering close() that sleeps shows up as
+ * context switches with little task-clock, one that spins as the reverse.
+ * The reads are made outside the timestamps, so the timings don't include
+ * them, but each delta does include the one read() that ends it. Kernel
+ * time is counted, which needs perf_event_paranoid <= 1 or CAP_PERFMON.
+ */
+
+#define COUNTER_TASK_CLOCK 0
+#define COUNTER_CONTEXT_SWITCHES 1
+#define COUNTER_CPU_MIGRATIONS 2
+#define COUNTER_CYCLES 3
+#define COUNTER_INSTRUCTIONS 4
+#define NUM_COUNTERS 5
+
+static const char *counter_names[NUM_COUNTERS] = {
+    "task-clock", "context-switches", "cpu-migrations", "cycles",
+    "instructions"
+};
+
+/* Counter deltas over every call of one phase */
+typedef struct {
+    uint64_t calls;
+    uint64_t sum[NUM_COUNTERS];
+    uint64_t max[NUM_COUNTERS];
+    Boolean missing[NUM_COUNTERS];      /* Not available on this host */
+} Counts;
+
+/* One reading of the group, by counter */
+typedef struct {
+    uint64_t values[NUM_COUNTERS];
+} CounterSnap;
+
+#ifdef __linux__
+
+typedef struct {
+    int leader;
+    int fds[NUM_COUNTERS];
+    int slot[NUM_COUNTERS];             /* Index in a group read, or -1 */
+    int nr;
+} Counters;
+
+static Boolean counters_enabled = FALSE;
+static __thread Counters *counters = NULL;
+
+static int perf_open(int counter, int group_fd)
+{
+    static const uint32_t types[NUM_COUNTERS] = {
+        PERF_TYPE_SOFTWARE, PERF_TYPE_SOFTWARE, PERF_TYPE_SOFTWARE,
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+    };
+    static const uint64_t configs[NUM_COUNTERS] = {
+        PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_CONTEXT_SWITCHES,
+        PERF_COUNT_SW_CPU_MIGRATIONS, PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS
+    };
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = types[counter];
+    attr.config = configs[counter];
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    /* This thread only, on whichever CPU it runs */
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd,
+                   PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Open the calling thread's group. Missing hardware counters are left out,
+ * but task-clock must be there to lead the group. */
+static void counters_attach(void)
+{
+    Counters *c;
+    int i;
+
+    if (!counters_enabled || counters != NULL)
+        return;
+    c = calloc(1, sizeof(Counters));
+    if (c == NULL)
+        fatal("out of memory");
+    for (i = 0; i < NUM_COUNTERS; i++) {
+        c->fds[i] = perf_open(i, i == 0 ? -1 : c->fds[0]);
+        if (c->fds[i] == -1) {
+            if (i == COUNTER_TASK_CLOCK)
+                die("perf_event_open() task-clock");
+            c->slot[i] = -1;
+            continue;
+        }
+        c->slot[i] = c->nr++;
     }
+    counters = c;
+}
 
-    puts("-- waiting for EOF");
-    timestamp(tp_before);
+static void counters_read(CounterSnap *snap)
+{
+    uint64_t buf[1 + NUM_COUNTERS];
+    ssize_t n;
+    int i;
 
-    if (options->shutdown_time > 0) {
-        struct pollfd pfds[1];
+    n = read(counters->fds[0], buf, sizeof(buf));
+    if (n < (ssize_t) ((1 + counters->nr) * sizeof(uint64_t)))
+        die("read() perf counters");
+    for (i = 0; i < NUM_COUNTERS; i++)
+        snap->values[i] = counters->slot[i] >= 0 ?
+                          buf[1 + counters->slot[i]] : 0;
+}
 
-        pfds[0].fd = connfd;
-        pfds[0].events = POLLIN;
-        r = poll(pfds, 1, (1000 * options->shutdown_time));
-        if (r == -1)
-            die("poll()");
-        if (r == 0) {
-            timestamp(tp_after);
-            puts("Timeout reached waiting for EOF after shutdown()");
-            printf("Timeout expected: %d secs (actual: %.3f secs)\n",
-                   options->shutdown_time, time_diff(tp_before, tp_after));
-            return;
+static void counters_start(CounterSnap *snap)
+{
+    if (counters != NULL)
+        counters_read(snap);
+}
+
+/* Add what the counters moved by since counters_start() to into, and
+ * leave the deltas in snap */
+static void counters_stop(CounterSnap *snap, Counts *into)
+{
+    CounterSnap now;
+    uint64_t delta;
+    int i;
+
+    if (counters == NULL)
+        return;
+    counters_read(&now);
+    into->calls++;
+    for (i = 0; i < NUM_COUNTERS; i++) {
+        if (counters->slot[i] < 0) {
+            into->missing[i] = TRUE;
+            continue;
         }
+        delta = now.values[i] - snap->values[i];
+        snap->values[i] = delta;
+        into->sum[i] += delta;
+        if (delta > into->max[i])
+            into->max[i] = delta;
     }
+}
 
-    n = read(connfd, &c, 1);
-    if (n == -1) {
-        if (errno == EWOULDBLOCK)
-            puts("EWOULDBLOCK on read() after shutdown()");
+/* The deltas that counters_stop() left in snap */
+static void print_snap(const CounterSnap *snap)
+{
+    int i;
+
+    if (counters == NULL)
+        return;
+    printf("Counters:");
+    for (i = 0; i < NUM_COUNTERS; i++) {
+        if (counters->slot[i] < 0)
+            continue;
+        if (i == COUNTER_TASK_CLOCK)
+            printf(" %s %.3f usecs", counter_names[i],
+                   snap->values[i] / 1000.0);
         else
-            die("read() after shutdown()");
-    } else if (n == 1) {
-        fprintf(stderr, "read() after shutdown(): "
-                "Illegal data from peer; EOF expected\n");
-        exit(EXIT_FAILURE);
+            printf(", %s %llu", counter_names[i],
+                   (unsigned long long) snap->values[i]);
     }
-    timestamp(tp_after);
-    printf("Time till EOF: %.3f secs\n", time_diff(tp_before, tp_after));
+    putchar('\n');
 }
 
-int main(int argc, char *argv[])
+#else
+
+static void counters_start(CounterSnap *snap)
 {
-    int listenfd, connfd, r;
-    Options sopts, *options = &sopts;
-    ssize_t n;
-    struct sockaddr_in servaddr;
-    char buf[PAYLOAD_SIZE];
-    struct timeval tv1, *tp_before = &tv1;
-    struct timeval tv2, *tp_after = &tv2;
+    (void) snap;
+}
 
-    parse_opts(argc, argv, options);
+static void counters_stop(CounterSnap *snap, Counts *into)
+{
+    (void) snap;
+    (void) into;
+}
 
-    memset(buf, 0, sizeof(buf));
-    get_payload(buf, sizeof(buf));
+static void print_snap(const CounterSnap *snap)
+{
+    (void) snap;
+}
 
-    listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listenfd == -1)
-        die("socket");
+#endif /* __linux__ */
 
-    set_socket_options(listenfd);
-    if (options->linger_sock == OPT_LSOCK) {
-        set_linger(listenfd, options->linger_time);
-        puts("Linger: on (listening socket)");
-    } else if (options->linger_sock == OPT_NOSOCK) {
-        puts("Linger: off");
+static void counts_merge(Counts *into, const Counts *from)
+{
+    int i;
+
+    into->calls += from->calls;
+    for (i = 0; i < NUM_COUNTERS; i++) {
+        into->sum[i] += from->sum[i];
+        if (from->max[i] > into->max[i])
+            into->max[i] = from->max[i];
+        into->missing[i] |= from->missing[i];
     }
+}
 
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(PORT_NUM);
+static void counts_print(const char *label, const Counts *counts)
+{
+    int i;
 
-    r = bind(listenfd, (struct sockaddr *) &servaddr, sizeof(servaddr));
-    if (r == -1)
-        die("bind()");
+    if (counts->calls == 0)
+        return;
+    printf("%s: n %llu", label, (unsigned long long) counts->calls);
+    for (i = 0; i < NUM_COUNTERS; i++) {
+        if (counts->missing[i])
+            continue;
+        if (i == COUNTER_TASK_CLOCK)
+            printf("  %s (usecs) mean %.3f max %.3f", counter_names[i],
+                   (double) counts->sum[i] / counts->calls / 1000.0,
+                   counts->max[i] / 1000.0);
+        else
+            printf("  %s mean %.1f max %llu", counter_names[i],
+                   (double) counts->sum[i] / counts->calls,
+                   (unsigned long long) counts->max[i]);
+    }
+    putchar('\n');
+}
 
-    r = listen(listenfd, BACKLOG);
-    if (r == -1)
-        die("listen()");
+/* Adaptive linger: with -A budget_ms the timeout is not the fixed -t but
+ * is chosen per connection at close time, from the bytes still unacked
+ * (SIOCOUTQ) and the delivery rate TCP_INFO has measured: twice the time
+ * the queue should take to drain plus an RTT for the FIN, capped at the
+ * budget. It is applied as the SO_LINGER timeout, rounded up to whole
+ * seconds, or as the deferred close deadline, to the tick.
+ *
+ * What the fixed -t would have done instead is worked out from the same
+ * connection: it drains in the time close() actually took if that ended
+ * before the timeout, or else in the time estimated (at least as long as
+ * we waited), at a steady rate. The fixed timeout blocks for as much of
+ * that as it covers, and gives up on whatever share of the queue it
+ * doesn't. Giving up means a reset with a timeout of 0 or the deferred
+ * engine; with a lingering close() on Linux the rest still goes out after
+ * close() returns, but nobody learns whether it arrived.
+ */
 
-    puts("-- waiting for client connection");
-    connfd = accept(listenfd, (struct sockaddr *) NULL, NULL);
-    if (connfd == -1)
-        die("accept()");
-    puts("-- client connected");
+#define ADAPTIVE_HEADROOM 2
+#define ADAPTIVE_SLACK 1000000ULL       /* 1 ms early still counts expired */
 
-    if (options->nonblocking) {
-        set_nonblocking(connfd);
-        puts("Non-Blocking Socket");
-    }
+typedef struct {
+    uint64_t outq;                      /* Bytes unacked when planned */
+    uint64_t rate;                      /* Bytes/sec, 0 if not known */
+    uint64_t estimate;                  /* Time to drain (ns) */
+    uint64_t timeout;                   /* Time given (ns) */
+} DrainPlan;
 
-    /* Close the listening socket - we don't need it anymore */
-    puts("-- closing listening socket");
-    r = close(listenfd);
-    if (r == -1)
-        die("closing listenfd");
+typedef struct {
+    long closes;
+    long expired;                       /* Gave up before the queue drained */
+    long unknown_rate;                  /* Given the whole budget */
+    uint64_t fixed;                     /* The -t compared against (ns) */
+    unsigned long long queued;
+    long long blocking_saved;           /* ns, negative if adaptive was longer */
+    unsigned long long fixed_left;      /* Bytes given up on, estimated */
+    unsigned long long adaptive_left;
+    Histogram timeout;
+} Adaptive;
 
-    if (options->linger_sock == OPT_CSOCK) {
-        set_linger(connfd, options->linger_time);
-        puts("Linger: on (connected socket)");
-    }
-    sleep(1);
+/* Bytes of outq still queued after waiting, if it takes drain to empty */
+static uint64_t bytes_left(uint64_t outq, uint64_t drain, uint64_t waited)
+{
+    if (waited >= drain)
+        return 0;
+    return (uint64_t) ((double) outq * (drain - waited) / drain);
+}
 
-    puts("-- writing payload");
-    n = write(connfd, buf, sizeof(buf));
-    if (n == -1)
-        die("write");
-    else if (n != sizeof(buf))
-        fatal("full buffer not written");
+/* Account one close that waited for the plan's timeout, compared with a
+ * fixed timeout of fixed ns */
+static void adaptive_account(Adaptive *ad, const DrainPlan *plan,
+                             uint64_t fixed, uint64_t waited)
+{
+    uint64_t drain;
+    Boolean expired;
 
-    if (options->use_shutdown)
-        shutdown_wait_eof(connfd, options);
+    expired = waited + ADAPTIVE_SLACK >= plan->timeout;
+    drain = waited;
+    if (expired && plan->estimate > waited)
+        drain = plan->estimate;
 
-    puts("-- closing connected socket");
-    timestamp(tp_before);
-    r = close(connfd);
-    if (r == -1) {
-        if (errno == EWOULDBLOCK)
-            puts("EWOULDBLOCK on close()");
-        else
-            die("closing connfd");
+    ad->closes++;
+    ad->fixed = fixed;
+    ad->queued += plan->outq;
+    if (plan->rate == 0)
+        ad->unknown_rate++;
+    hist_record(&ad->timeout, plan->timeout);
+    ad->blocking_saved += (long long) (fixed < drain ? fixed : drain) -
+                          (long long) waited;
+    ad->fixed_left += bytes_left(plan->outq, drain, fixed);
+    if (expired) {
+        ad->expired++;
+        ad->adaptive_left += bytes_left(plan->outq, drain, waited);
     }
-    timestamp(tp_after);
-    printf("Time to close(): %.3f secs\n", time_diff(tp_before, tp_after));
+}
+
+static void adaptive_merge(Adaptive *into, const Adaptive *from)
+{
+    into->closes += from->closes;
+    into->expired += from->expired;
+    into->unknown_rate += from->unknown_rate;
+    into->fixed = from->fixed;
+    into->queued += from->queued;
+    into->blocking_saved += from->blocking_saved;
+    into->fixed_left += from->fixed_left;
+    into->adaptive_left += from->adaptive_left;
+    hist_merge(&into->timeout, &from->timeout);
+}
+
+static void adaptive_print(const Adaptive *ad)
+{
+    if (ad->closes == 0)
+        return;
+    printf("Adaptive closes: %ld (timed out: %ld, no delivery rate: %ld)\n",
+           ad->closes, ad->expired, ad->unknown_rate);
+    printf("Bytes unacked at close: %llu (mean %.0f)\n", ad->queued,
+           (double) ad->queued / ad->closes);
+    hist_print("Adaptive timeout", &ad->timeout);
+    printf("Versus a fixed %.3f secs (estimated): blocking avoided %.6f "
+           "secs (mean %.3f usecs)\n", (double) ad->fixed / NSECS_PER_SEC,
+           (double) ad->blocking_saved / NSECS_PER_SEC,
+           (double) ad->blocking_saved / ad->closes / 1000);
+    printf("Bytes given up on (estimated): fixed %llu, adaptive %llu, "
+           "saved %lld\n", ad->fixed_left, ad->adaptive_left,
+           (long long) ad->fixed_left - (long long) ad->adaptive_left);
+}
+
+typedef struct {
+    Histogram write;
+    Histogram shutdown;
+    Histogram eof;
+    Histogram close;
+    Counts write_counts;                /* -C only */
+    Counts shutdown_counts;
+    Counts eof_counts;
+    Counts close_counts;
+    Adaptive adaptive;                  /* -A only */
+    Histogram sock_mem;                 /* -m or -k only (bytes) */
+    Histogram sock_reclaimed;           /* -k only (bytes) */
+    Histogram stream_rate;              /* -D only (bytes/sec) */
+    Histogram unacked;                  /* ...bytes in flight at close */
+    Histogram unsent;
+} Timings;
+
+static void print_timings(const Timings *timings)
+{
+    hist_print("Time to write()", &timings->write);
+    hist_print("Time to shutdown()", &timings->shutdown);
+    hist_print("Time till EOF", &timings->eof);
+    hist_print("Time to close()", &timings->close);
+    counts_print("Counters in write()", &timings->write_counts);
+    counts_print("Counters in shutdown()", &timings->shutdown_counts);
+    counts_print("Counters till EOF", &timings->eof_counts);
+    counts_print("Counters in close()", &timings->close_counts);
+    adaptive_print(&timings->adaptive);
+    hist_print_units("Socket memory at close", "bytes", &timings->sock_mem);
+    hist_print_units("Reclaimed by shrinking SO_SNDBUF", "bytes",
+                     &timings->sock_reclaimed);
+    hist_print_units("Stream throughput", "bytes/sec",
+                     &timings->stream_rate);
+    hist_print_units("Unacked at close", "bytes", &timings->unacked);
+    hist_print_units("Unsent at close", "bytes", &timings->unsent);
+}
+
+/* Event trace: with -X file every step of a connection's life - accept,
+ * SO_LINGER, each write, EWOULDBLOCK, shutdown(), EOF and close() - is
+ * recorded as a 32-byte binary record carrying its start time and
+ * duration. Each thread appends to a ring of its own, which costs a few
+ * stores and no locks or syscalls, so unlike printing it leaves the
+ * timings alone. A background thread drains the rings into the file every
+ * TRACE_FLUSH_INTERVAL. If a ring fills up before then, further events are
+ * dropped and counted rather than holding up the thread that traces them.
+ * linger-trace converts the file to Chrome trace JSON for Perfetto.
+ *
+ * The file layout is shared with linger-trace.c.
+ */
+
+#define TRACE_MAGIC "LNGTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE (1 << 16)       /* Records per thread */
+#define TRACE_FLUSH_INTERVAL (10 * 1000000ULL)  /* 10 ms */
+
+#define TEV_ACCEPT 1
+#define TEV_LINGER 2                    /* arg: linger secs */
+#define TEV_WRITE 3                     /* arg: bytes written */
+#define TEV_WOULDBLOCK 4                /* arg: the event it cut short */
+#define TEV_SHUTDOWN 5
+#define TEV_EOF 6                       /* arg: bytes read */
+#define TEV_CLOSE 7                     /* arg: CLOSE_NOW or CLOSE_DEFERRED */
+#define TEV_DROPPED 8                   /* arg: events lost */
+
+#define CLOSE_NOW 0
+#define CLOSE_DEFERRED 1                /* Handed to the close engine */
+
+typedef struct {
+    uint64_t time;                      /* timestamp() at the start */
+    uint64_t dur;                       /* 0 for an instant */
+    int64_t arg;
+    int32_t fd;
+    uint16_t thread;
+    uint8_t event;
+    uint8_t error;                      /* errno, or 0 */
+} TraceRecord;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t pid;
+    uint64_t start;                     /* timestamp() when tracing began */
+} TraceHeader;
+
+#ifdef __linux__
+
+#define TRACE_THREADS_MAX (CPU_SETSIZE + 1)
+
+/* One producer, the thread that owns the ring, and one consumer, the
+ * writer. head and tail sit on cache lines of their own so that the two
+ * don't pass a line back and forth on every event. */
+typedef struct {
+    TraceRecord recs[TRACE_RING_SIZE];
+    uint64_t head;                      /* Only the owner writes this */
+    char pad1[56];
+    uint64_t tail;                      /* ...and only the writer this */
+    char pad2[56];
+    uint64_t dropped;
+    uint16_t thread;
+} TraceRing;
+
+typedef struct {
+    int fd;
+    pthread_t tid;
+    int stop;
+    int nrings;                         /* Slots handed out so far */
+    TraceRing *rings[TRACE_THREADS_MAX];
+    uint64_t written;
+} Tracer;
+
+static Tracer *tracer = NULL;
+static __thread TraceRing *trace_ring = NULL;
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            die("write() trace file");
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/* Give the calling thread its ring. Threads attach before their timed work
+ * starts, so that allocating the ring isn't charged to their first event. */
+static void trace_attach(void)
+{
+    TraceRing *r;
+    int slot;
+
+    if (tracer == NULL || trace_ring != NULL)
+        return;
+    slot = __atomic_fetch_add(&tracer->nrings, 1, __ATOMIC_RELAXED);
+    if (slot >= TRACE_THREADS_MAX)
+        fatal("Too many threads to trace");
+    r = calloc(1, sizeof(TraceRing));
+    if (r == NULL)
+        fatal("out of memory");
+    /* Touch the ring now, not from the first laps round it */
+    memset(r->recs, 0, sizeof(r->recs));
+    r->thread = slot;
+    trace_ring = r;
+    __atomic_store_n(&tracer->rings[slot], r, __ATOMIC_RELEASE);
+}
+
+/* Record an event that ran from start to end. An EWOULDBLOCK is marked with
+ * an instant of its own too, so that it stands out in the trace. */
+static void trace_event(int event, int fd, uint64_t start, uint64_t end,
+                        int64_t arg, int error)
+{
+    TraceRecord *rec;
+    TraceRing *r;
+    uint64_t head;
+
+    if (tracer == NULL)
+        return;
+    if (trace_ring == NULL)
+        trace_attach();
+    r = trace_ring;
+    head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ==
+        TRACE_RING_SIZE) {
+        r->dropped++;
+        return;
+    }
+    rec = &r->recs[head % TRACE_RING_SIZE];
+    rec->time = start;
+    rec->dur = end - start;
+    rec->arg = arg;
+    rec->fd = fd;
+    rec->thread = r->thread;
+    rec->event = event;
+    rec->error = error;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    if (error == EWOULDBLOCK && event != TEV_WOULDBLOCK)
+        trace_event(TEV_WOULDBLOCK, fd, end, end, event, 0);
+}
+
+/* Write out what the ring holds, straight from the ring - in two pieces if
+ * it wraps round the end - and only then hand the slots back */
+static void trace_flush(Tracer *t, TraceRing *r)
+{
+    uint64_t head, tail, n;
+    size_t first;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    tail = r->tail;
+    if (head == tail)
+        return;
+    n = head - tail;
+    first = tail % TRACE_RING_SIZE;
+    if (first + n > TRACE_RING_SIZE) {
+        write_all(t->fd, &r->recs[first],
+                  (TRACE_RING_SIZE - first) * sizeof(TraceRecord));
+        write_all(t->fd, r->recs,
+                  (first + n - TRACE_RING_SIZE) * sizeof(TraceRecord));
+    } else {
+        write_all(t->fd, &r->recs[first], n * sizeof(TraceRecord));
+    }
+    t->written += n;
+    __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+}
+
+static void trace_flush_all(Tracer *t)
+{
+    TraceRing *r;
+    int i, n;
+
+    n = __atomic_load_n(&t->nrings, __ATOMIC_RELAXED);
+    if (n > TRACE_THREADS_MAX)
+        n = TRACE_THREADS_MAX;
+    for (i = 0; i < n; i++) {
+        /* A slot stays NULL for the moment its thread is setting it up */
+        r = __atomic_load_n(&t->rings[i], __ATOMIC_ACQUIRE);
+        if (r != NULL)
+            trace_flush(t, r);
+    }
+}
+
+static void *trace_writer(void *arg)
+{
+    Tracer *t = arg;
+    struct timespec ts;
+    uint64_t next;
+
+    next = timestamp();
+    while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+        next += TRACE_FLUSH_INTERVAL;
+        ts.tv_sec = next / NSECS_PER_SEC;
+        ts.tv_nsec = next % NSECS_PER_SEC;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                               NULL) == EINTR)
+            ;
+        trace_flush_all(t);
+    }
+    return NULL;
+}
+
+static void trace_start(const char *path)
+{
+    TraceHeader hdr;
+    int r;
+
+    tracer = calloc(1, sizeof(Tracer));
+    if (tracer == NULL)
+        fatal("out of memory");
+    tracer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tracer->fd == -1)
+        die("open() trace file");
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.pid = getpid();
+    hdr.start = timestamp();
+    write_all(tracer->fd, &hdr, sizeof(hdr));
+
+    trace_attach();                     /* The main thread */
+    r = pthread_create(&tracer->tid, NULL, trace_writer, tracer);
+    if (r != 0) {
+        errno = r;
+        die("pthread_create()");
+    }
+}
+
+/* Stop the writer and flush the rest. The threads that traced must be done
+ * by now; any events they dropped are noted in the file. */
+static void trace_finish(void)
+{
+    TraceRecord rec;
+    uint64_t dropped = 0;
+    int i, r;
+
+    if (tracer == NULL)
+        return;
+    __atomic_store_n(&tracer->stop, 1, __ATOMIC_RELEASE);
+    r = pthread_join(tracer->tid, NULL);
+    if (r != 0) {
+        errno = r;
+        die("pthread_join()");
+    }
+    trace_flush_all(tracer);
+
+    for (i = 0; i < tracer->nrings; i++) {
+        if (tracer->rings[i]->dropped > 0) {
+            memset(&rec, 0, sizeof(rec));
+            rec.time = timestamp();
+            rec.arg = tracer->rings[i]->dropped;
+            rec.fd = -1;
+            rec.thread = i;
+            rec.event = TEV_DROPPED;
+            write_all(tracer->fd, &rec, sizeof(rec));
+            dropped += rec.arg;
+        }
+        free(tracer->rings[i]);
+    }
+    if (close(tracer->fd) == -1)
+        die("close() trace file");
+    printf("Trace events: %llu (dropped: %llu)\n",
+           (unsigned long long) tracer->written,
+           (unsigned long long) dropped);
+    free(tracer);
+    tracer = NULL;
+    trace_ring = NULL;
+}
+
+#else
+
+static void trace_event(int event, int fd, uint64_t start, uint64_t end,
+                        int64_t arg, int error)
+{
+    (void) event;
+    (void) fd;
+    (void) start;
+    (void) end;
+    (void) arg;
+    (void) error;
+}
+
+static void trace_finish(void)
+{
+}
+
+#endif /* __linux__ */
+
+/* Shared timeline: with -M name the server and linger-client -M name,
+ * running on the same host, stamp each connection's events into a POSIX
+ * shared memory segment against the same CLOCK_MONOTONIC. A connection's
+ * slot is indexed by the client's port, so the two sides find it without
+ * talking to each other, and the client can tell how long after our
+ * shutdown() or close() it saw the FIN or RST. linger-trace -t name prints
+ * the merged timeline. The server clears the segment when it starts.
+ *
+ * Calls are stamped before they are made, as the FIN can reach the client
+ * before they return. The layout is shared with linger-client.c and
+ * linger-trace.c.
+ */
+
+#define TIMELINE_MAGIC "LNGTIME2"
+#define TIMELINE_SLOTS 65536            /* One per client port */
+
+/* CLOCK_MONOTONIC ns, 0 until it has happened */
+typedef struct {
+    uint64_t connect;                   /* Client: connect() called */
+    uint64_t first_byte;                /* ...first payload read */
+    uint64_t end;                       /* ...the read that ended it */
+    uint64_t end_event;                 /* ...its EVENT_* + 1 */
+    uint64_t hangup;                    /* ...FIN or RST seen to arrive */
+    uint64_t accept;                    /* Server: accept() returned */
+    uint64_t write;                     /* ...first write called */
+    uint64_t write_done;                /* ...last byte taken by the socket */
+    uint64_t shutdown;                  /* ...shutdown() called */
+    uint64_t close;                     /* ...close() called */
+    uint64_t closed;                    /* ...close() returned */
+} TimelineSlot;
+
+typedef struct {
+    char magic[8];
+    uint64_t start;                     /* When the server cleared it */
+    TimelineSlot slots[TIMELINE_SLOTS];
+} Timeline;
+
+#define timeline_mark(slot, field, time) \
+    do { \
+        if ((slot) != NULL) \
+            __atomic_store_n(&(slot)->field, (time), __ATOMIC_RELEASE); \
+    } while (0)
+
+static Timeline *timeline = NULL;
+
+static void timeline_create(const char *name)
+{
+    char path[NAME_MAX];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    fd = shm_open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1)
+        die("shm_open() timeline");
+    /* Truncating it first zeroes whatever an earlier run left */
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, sizeof(Timeline)) == -1)
+        die("ftruncate() timeline");
+    timeline = mmap(NULL, sizeof(Timeline), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    if (timeline == MAP_FAILED)
+        die("mmap() timeline");
+    close(fd);
+    timeline->start = timestamp();
+    memcpy(timeline->magic, TIMELINE_MAGIC, sizeof(timeline->magic));
+}
+
+/* Claim the slot of a newly accepted connection, clearing anything an
+ * earlier connection from the same client port left in it */
+static TimelineSlot *timeline_accept(int fd, uint64_t accepted)
+{
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    TimelineSlot *slot;
+
+    if (timeline == NULL)
+        return NULL;
+    if (getpeername(fd, (struct sockaddr *) &peer, &len) == -1)
+        die("getpeername()");
+    slot = &timeline->slots[ntohs(peer.sin_port)];
+    timeline_mark(slot, write, 0);
+    timeline_mark(slot, write_done, 0);
+    timeline_mark(slot, shutdown, 0);
+    timeline_mark(slot, close, 0);
+    timeline_mark(slot, closed, 0);
+    timeline_mark(slot, accept, accepted);
+    return slot;
+}
+
+static void apply_linger(int fd, int linger_time)
+{
+    int r;
+    struct linger ling;
+    uint64_t before;
+
+    ling.l_onoff = 1;
+    ling.l_linger = linger_time;
+    before = timestamp();
+    r = setsockopt(fd, SOL_SOCKET, SO_LINGER, &ling, sizeof(ling));
+    if (r == -1)
+        die("setting SO_LINGER");
+    trace_event(TEV_LINGER, fd, before, timestamp(), linger_time, 0);
+}
+
+static void set_linger(int fd, int linger_time)
+{
+    apply_linger(fd, linger_time);
+    printf("Linger timeout (secs): %d\n", linger_time);
+}
+
+#ifdef __linux__
+
+/* Plan how long fd may take to close, in multiples of granularity ns and
+ * at most budget ns (rounded up). The delivery rate (Linux 4.9) is
+ * sampled over a flight, so a receiver that reads slowly but opens its
+ * window in bursts looks fast; the bytes acked over the time data was
+ * outstanding (Linux 4.10) catch that, and the slower of the two is
+ * used. Failing both, cwnd per RTT is used, and without an RTT the
+ * whole budget is given. */
+static void drain_plan(int fd, uint64_t budget, uint64_t granularity,
+                       DrainPlan *plan)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    uint64_t rtt, goodput, timeout;
+    int outq;
+
+    memset(plan, 0, sizeof(DrainPlan));
+    memset(&info, 0, sizeof(info));
+    if (ioctl(fd, SIOCOUTQ, &outq) == 0 && outq > 0)
+        plan->outq = outq;
+    rtt = 0;
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+        rtt = info.tcpi_rtt * 1000ULL;
+        plan->rate = info.tcpi_delivery_rate;
+        if (info.tcpi_busy_time > 0) {
+            goodput = info.tcpi_bytes_acked * 1000000 / info.tcpi_busy_time;
+            if (plan->rate == 0 || goodput < plan->rate)
+                plan->rate = goodput;
+        }
+        if (plan->rate == 0 && info.tcpi_rtt > 0)
+            plan->rate = (uint64_t) info.tcpi_snd_cwnd * info.tcpi_snd_mss *
+                         1000000 / info.tcpi_rtt;
+    }
+    if (plan->rate > 0)
+        plan->estimate = plan->outq * NSECS_PER_SEC / plan->rate + rtt;
+    else
+        plan->estimate = budget;
+
+    timeout = plan->estimate * ADAPTIVE_HEADROOM;
+    if (timeout > budget)
+        timeout = budget;
+    timeout = (timeout + granularity - 1) / granularity * granularity;
+    plan->timeout = timeout > 0 ? timeout : granularity;
+}
+
+/* Replace whatever SO_LINGER timeout fd has with one from drain_plan().
+ * It can't be under a second: 0 would reset the connection. */
+static void adaptive_linger(int fd, int budget_ms, DrainPlan *plan)
+{
+    drain_plan(fd, budget_ms * 1000000ULL, NSECS_PER_SEC, plan);
+    apply_linger(fd, (int) (plan->timeout / NSECS_PER_SEC));
+}
+
+/* Kernel memory: with -m msecs a thread reads /proc/net/sockstat every
+ * msecs - the TCP sockets in use, orphaned and in time-wait, and the pages
+ * of buffer memory charged to them - and the series is printed at exit,
+ * with the memory per socket added since the first sample. The counts are
+ * system wide, so other TCP traffic on the host shows up in them too.
+ *
+ * With -m or -k each connection's own SO_MEMINFO is read just before it
+ * is closed or handed to the deferred engine: its receive and send queues
+ * and the forward allocation it holds. With -k size SO_SNDBUF is then cut
+ * to size and the socket read again. Queued data stays charged until it
+ * is acked either way, so what that gives back, if anything, is forward
+ * allocation and the room to queue more.
+ */
+
+typedef struct {
+    uint64_t time;
+    long inuse;
+    long orphan;
+    long tw;
+    long mem;                           /* Pages */
+} SockStat;
+
+typedef struct {
+    uint64_t interval;
+    int stop;
+    pthread_t tid;
+    SockStat *samples;
+    long count;
+    long size;
+} MemWatch;
+
+static MemWatch *memwatch = NULL;
+
+static const char *policy_names[] = {
+    "none", "lsock", "csock", "csock_late", "deferred"
+};
+
+static void memwatch_sample(MemWatch *mw)
+{
+    char line[256];
+    SockStat *st;
+    FILE *fp;
+
+    if (mw->count == mw->size) {
+        mw->size = mw->size ? mw->size * 2 : 1024;
+        mw->samples = realloc(mw->samples, mw->size * sizeof(SockStat));
+        if (mw->samples == NULL)
+            fatal("out of memory");
+    }
+    st = &mw->samples[mw->count];
+    memset(st, 0, sizeof(SockStat));
+    st->time = timestamp();
+
+    fp = fopen("/proc/net/sockstat", "r");
+    if (fp == NULL)
+        die("fopen() /proc/net/sockstat");
+    while (fgets(line, sizeof(line), fp) != NULL)
+        if (sscanf(line, "TCP: inuse %ld orphan %ld tw %ld alloc %*d mem %ld",
+                   &st->inuse, &st->orphan, &st->tw, &st->mem) == 4)
+            break;
+    fclose(fp);
+    mw->count++;
+}
+
+static void *memwatch_thread(void *arg)
+{
+    MemWatch *mw = arg;
+    struct timespec ts;
+    uint64_t next;
+
+    next = timestamp();
+    while (!__atomic_load_n(&mw->stop, __ATOMIC_ACQUIRE)) {
+        next += mw->interval;
+        ts.tv_sec = next / NSECS_PER_SEC;
+        ts.tv_nsec = next % NSECS_PER_SEC;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                               NULL) == EINTR)
+            ;
+        memwatch_sample(mw);
+    }
+    return NULL;
+}
+
+static void memwatch_start(int msecs)
+{
+    int r;
+
+    memwatch = calloc(1, sizeof(MemWatch));
+    if (memwatch == NULL)
+        fatal("out of memory");
+    memwatch->interval = msecs * 1000000ULL;
+    memwatch_sample(memwatch);          /* The baseline */
+    r = pthread_create(&memwatch->tid, NULL, memwatch_thread, memwatch);
+    if (r != 0) {
+        errno = r;
+        die("pthread_create()");
+    }
+}
+
+static void memwatch_finish(const Options *options)
+{
+    const SockStat *st, *base, *peak;
+    long page, i, r;
+
+    if (memwatch == NULL)
+        return;
+    __atomic_store_n(&memwatch->stop, 1, __ATOMIC_RELEASE);
+    r = pthread_join(memwatch->tid, NULL);
+    if (r != 0) {
+        errno = r;
+        die("pthread_join()");
+    }
+    memwatch_sample(memwatch);
+
+    page = sysconf(_SC_PAGESIZE);
+    base = &memwatch->samples[0];
+    peak = base;
+    puts("-- kernel TCP memory (/proc/net/sockstat)");
+    puts("secs,inuse,orphan,tw,mem_kb,bytes_per_socket");
+    for (i = 0; i < memwatch->count; i++) {
+        st = &memwatch->samples[i];
+        if (st->mem > peak->mem)
+            peak = st;
+        printf("%.3f,%ld,%ld,%ld,%ld,%.0f\n", time_diff(base->time, st->time),
+               st->inuse, st->orphan, st->tw, st->mem * page / 1024,
+               st->inuse > base->inuse ? (double) (st->mem - base->mem) *
+               page / (st->inuse - base->inuse) : 0.0);
+    }
+    printf("Peak TCP memory: %ld KB at %.3f secs, %ld sockets in use "
+           "(%ld orphaned, %ld in time-wait)\n", peak->mem * page / 1024,
+           time_diff(base->time, peak->time), peak->inuse, peak->orphan,
+           peak->tw);
+    printf("Memory per socket at peak (-s %s, -t %d): %.0f bytes\n",
+           policy_names[options->linger_sock], options->linger_time,
+           peak->inuse > base->inuse ? (double) (peak->mem - base->mem) *
+           page / (peak->inuse - base->inuse) : 0.0);
+    free(memwatch->samples);
+    free(memwatch);
+    memwatch = NULL;
+}
+
+/* Kernel memory charged to fd: its receive and send queues, the forward
+ * allocation it holds, and option memory */
+static Boolean sock_memory(int fd, uint64_t *bytes)
+{
+    uint32_t mem[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(mem);
+
+    memset(mem, 0, sizeof(mem));
+    if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, mem, &len) == -1)
+        return FALSE;
+    *bytes = (uint64_t) mem[SK_MEMINFO_RMEM_ALLOC] +
+             mem[SK_MEMINFO_WMEM_QUEUED] + mem[SK_MEMINFO_FWD_ALLOC] +
+             mem[SK_MEMINFO_OPTMEM];
+    return TRUE;
+}
+
+/* Record what fd holds as it is closed, shrinking SO_SNDBUF first for -k.
+ * Returns FALSE if there was nothing to do or SO_MEMINFO failed; *before
+ * and *after are the memory either side of the shrink. */
+static Boolean close_memory(int fd, const Options *options,
+                            Timings *timings, uint64_t *before,
+                            uint64_t *after)
+{
+    int size;
+
+    if (options->mem_interval == 0 && options->shrink_sndbuf == 0)
+        return FALSE;
+    if (!sock_memory(fd, before))
+        return FALSE;
+    hist_record(&timings->sock_mem, *before);
+    *after = *before;
+    if (options->shrink_sndbuf == 0)
+        return TRUE;
+
+    size = (int) options->shrink_sndbuf;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1)
+        die("setsockopt() SO_SNDBUF");
+    if (!sock_memory(fd, after))
+        return FALSE;
+    hist_record(&timings->sock_reclaimed,
+                *after < *before ? *before - *after : 0);
+    return TRUE;
+}
+
+/* -D: the rate the stream ran at until it was cut or the payload ran out */
+static void stream_done(const Sender *snd, Timings *timings)
+{
+    if (snd->duration > 0 && snd->stopped > snd->started)
+        hist_record(&timings->stream_rate, (uint64_t) ((double) snd->sent *
+                    NSECS_PER_SEC / (snd->stopped - snd->started)));
+}
+
+/* -D: what the close policy is left with - bytes sent but not yet acked,
+ * and bytes still waiting to be sent */
+static void stream_inflight(int fd, Timings *timings, int *unacked,
+                            int *unsent)
+{
+    int outq;
+
+    if (ioctl(fd, SIOCOUTQ, &outq) == -1 ||
+        ioctl(fd, SIOCOUTQNSD, unsent) == -1) {
+        *unacked = *unsent = 0;
+        return;
+    }
+    *unacked = outq - *unsent;
+    hist_record(&timings->unacked, *unacked);
+    hist_record(&timings->unsent, *unsent);
+}
+
+#endif /* __linux__ */
+
+/* The payload lives in a memfd on Linux, so that sendfile() and splice() can
+ * read it from the page cache, and is mapped for write() and MSG_ZEROCOPY.
+ * Elsewhere it is plain heap memory and only the write backend is offered.
+ */
+static void payload_create(Payload *payload, size_t size)
+{
+    payload->size = size;
+    payload->fd = -1;
+
+#ifdef __linux__
+    payload->fd = memfd_create("linger-payload", MFD_CLOEXEC);
+    if (payload->fd == -1)
+        die("memfd_create()");
+    if (ftruncate(payload->fd, size) == -1)
+        die("ftruncate() payload");
+    payload->buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        payload->fd, 0);
+    if (payload->buf == MAP_FAILED)
+        die("mmap() payload");
+#else
+    payload->buf = malloc(size);
+    if (payload->buf == NULL)
+        fatal("out of memory");
+#endif
+
+    get_payload(payload->buf, size);
+}
+
+static void sender_init(Sender *snd, const Options *options)
+{
+    memset(snd, 0, sizeof(Sender));
+    snd->backend = options->backend;
+    snd->framing = options->framing;
+    snd->duration = options->stream_msecs * 1000000ULL;
+    snd->pipefd[0] = snd->pipefd[1] = -1;
+
+#ifdef __linux__
+    if (snd->backend == BACKEND_SPLICE) {
+        if (pipe2(snd->pipefd, O_CLOEXEC | O_NONBLOCK) == -1)
+            die("pipe2()");
+        /* A bigger pipe means fewer splice() calls per payload */
+        fcntl(snd->pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    }
+#endif
+}
+
+static void sender_free(Sender *snd)
+{
+    if (snd->pipefd[0] != -1) {
+        close(snd->pipefd[0]);
+        close(snd->pipefd[1]);
+    }
+}
+
+#ifdef __linux__
+
+static void enable_zerocopy(int fd)
+{
+    int val = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) == -1)
+        die("setting SO_ZEROCOPY");
+}
+
+/* Reap MSG_ZEROCOPY completions from the socket error queue. Each one
+ * covers a range of send() calls; the kernel flags ranges that it ended up
+ * copying anyway (as it always does over loopback). */
+static void drain_zerocopy(Sender *snd, int fd)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *serr;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    uint32_t count;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+            die("recvmsg() MSG_ERRQUEUE");
+        }
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+             cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR)
+                continue;
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            count = serr->ee_data - serr->ee_info + 1;
+            snd->zc_done += count;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                snd->zc_copied += count;
+        }
+    }
+}
+
+static ssize_t splice_chunk(Sender *snd, int fd, const Payload *payload)
+{
+    loff_t off;
+    ssize_t n;
+
+    if (snd->piped == 0) {
+        off = snd->sent;
+        n = splice(payload->fd, &off, snd->pipefd[1], NULL,
+                   payload->size - snd->sent, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+            errno = EIO;        /* The memfd is never short */
+        if (n <= 0)
+            return -1;
+        snd->piped = n;
+    }
+    n = splice(snd->pipefd[0], NULL, fd, NULL, snd->piped,
+               SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (n > 0)
+        snd->piped -= n;
+    return n;
+}
+
+#endif /* __linux__ */
+
+/* The writev backend sends the payload as FRAME_SIZE frames, each split
+ * into a FRAME_HEADER byte header and a body iovec, FRAME_BATCH frames to
+ * a sendmsg() - the shape of a server that frames its messages. The bytes
+ * are still the payload's, so linger-client can verify them. A partial
+ * write leaves the next batch starting mid-frame. With -G the batches are
+ * coalesced by MSG_MORE, which holds back a partial segment until a send
+ * without it, or by corking the socket for each batch. */
+static ssize_t writev_batch(Sender *snd, int fd, const Payload *payload)
+{
+    struct iovec iov[FRAME_BATCH * 2];
+    struct msghdr msg;
+    size_t off, end, header_end;
+    int n, flags;
+
+    n = 0;
+    off = snd->sent;
+    while (n <= FRAME_BATCH * 2 - 2 && off < payload->size) {
+        end = (off / FRAME_SIZE + 1) * FRAME_SIZE;
+        if (end > payload->size)
+            end = payload->size;
+        header_end = off / FRAME_SIZE * FRAME_SIZE + FRAME_HEADER;
+        if (off < header_end && header_end < end) {
+            iov[n].iov_base = payload->buf + off;
+            iov[n++].iov_len = header_end - off;
+            off = header_end;
+        }
+        iov[n].iov_base = payload->buf + off;
+        iov[n++].iov_len = end - off;
+        off = end;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+    flags = MSG_NOSIGNAL;
+#ifdef __linux__
+    if (snd->framing == FRAMING_MORE && off < payload->size)
+        flags |= MSG_MORE;
+    if (snd->framing == FRAMING_CORK) {
+        int cork = 1, err;
+        ssize_t r;
+
+        if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) == -1)
+            die("setting TCP_CORK");
+        r = sendmsg(fd, &msg, flags);
+        err = errno;
+        cork = 0;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) == -1)
+            die("clearing TCP_CORK");
+        errno = err;
+        return r;
+    }
+#endif
+    return sendmsg(fd, &msg, flags);
+}
+
+/* Push as much of the payload as the socket will take using the chosen
+ * backend. Every call is timed into hist if it is not NULL. With -D the
+ * stream is cut short, and SEND_DONE returned, once its time is up; the
+ * caller must call again by then if it is blocked. */
+static int sender_push(Sender *snd, int fd, const Payload *payload,
+                       Histogram *hist)
+{
+    uint64_t before, after;
+    ssize_t n;
+    int err;
+
+#ifdef __linux__
+    if (snd->backend == BACKEND_ZEROCOPY)
+        drain_zerocopy(snd, fd);
+#endif
+
+    if (snd->started == 0)
+        snd->started = timestamp();
+    while (snd->sent < payload->size) {
+        before = timestamp();
+        if (snd->duration > 0 && before >= snd->started + snd->duration) {
+            snd->cut = TRUE;
+            break;
+        }
+        switch (snd->backend) {
+#ifdef __linux__
+        case BACKEND_SENDFILE: {
+            off_t off = snd->sent;
+
+            n = sendfile(fd, payload->fd, &off, payload->size - snd->sent);
+            break;
+        }
+        case BACKEND_SPLICE:
+            n = splice_chunk(snd, fd, payload);
+            break;
+        case BACKEND_ZEROCOPY:
+            n = send(fd, payload->buf + snd->sent, payload->size - snd->sent,
+                     MSG_ZEROCOPY | MSG_NOSIGNAL);
+            if (n > 0)
+                snd->zc_sent++;
+            break;
+#endif
+        case BACKEND_WRITEV:
+            n = writev_batch(snd, fd, payload);
+            break;
+        default:
+            n = send(fd, payload->buf + snd->sent, payload->size - snd->sent,
+                     MSG_NOSIGNAL);
+            break;
+        }
+        err = n == -1 ? errno : 0;
+        after = timestamp();
+        if (hist != NULL)
+            hist_record(hist, after - before);
+        trace_event(TEV_WRITE, fd, before, after, n > 0 ? n : 0, err);
+        snd->calls++;
+
+        if (n == -1) {
+            errno = err;
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                snd->blocked++;
+                snd->wait_events = POLLOUT;
+                return SEND_BLOCKED;
+            }
+#ifdef __linux__
+            /* Out of optmem for pinned pages: there's nothing to do until
+             * completions arrive, and they are signalled as POLLERR */
+            if (errno == ENOBUFS && snd->backend == BACKEND_ZEROCOPY) {
+                snd->blocked++;
+                snd->wait_events = 0;
+                return SEND_BLOCKED;
+            }
+#endif
+            return SEND_ERROR;
+        }
+        snd->sent += n;
+    }
+    snd->stopped = timestamp();
+    return SEND_DONE;
+}
+
+/* Milliseconds until a blocked stream must be cut, or -1 */
+static int sender_timeout(const Sender *snd)
+{
+    uint64_t now, end;
+
+    if (snd->duration == 0)
+        return -1;
+    now = timestamp();
+    end = snd->started + snd->duration;
+    return now >= end ? 0 : (int) ((end - now) / 1000000) + 1;
+}
+
+/* TCP sampler: with -I a background thread samples the connection being
+ * served hz times a second - TCP_INFO plus SIOCOUTQ/SIOCOUTQNSD - into a
+ * ring that is allocated up front, and the series is dumped once the run is
+ * over. Each sample carries the phase the server was in, so the drain of
+ * the send queue can be lined up against the linger timeout.
+ *
+ * close() releases the descriptor before it starts to linger, so from then
+ * on the socket is looked up by its 4-tuple over sock_diag instead, until
+ * it is gone or reaches TIME_WAIT.
+ */
+
+#define PHASE_WAIT 0
+#define PHASE_WRITE 1
+#define PHASE_SHUTDOWN 2
+#define PHASE_EOF_WAIT 3
+#define PHASE_CLOSE 4
+#define PHASE_CLOSED 5
+
+#ifdef __linux__
+
+static const char *phase_names[] = {
+    "wait", "write", "shutdown", "eof_wait", "close", "closed"
+};
+
+static const char *tcp_state_names[] = {
+    "", "ESTABLISHED", "SYN_SENT", "SYN_RECV", "FIN_WAIT1", "FIN_WAIT2",
+    "TIME_WAIT", "CLOSE", "CLOSE_WAIT", "LAST_ACK", "LISTEN", "CLOSING",
+    "NEW_SYN_RECV"
+};
+
+/* From the kernel's tcp_states.h */
+#define TCP_STATE_TIME_WAIT 6
+#define TCP_STATE_CLOSE 7
+
+#define SOURCE_FD 0
+#define SOURCE_DIAG 1
+
+typedef struct {
+    uint64_t time;              /* Since the sampler started */
+    uint32_t conn;
+    uint8_t phase;
+    uint8_t source;
+    uint8_t state;
+    uint32_t unacked;
+    uint32_t retrans;
+    uint32_t rtt;               /* usecs */
+    uint32_t cwnd;
+    uint32_t outq;              /* Unacked + unsent bytes */
+    uint32_t notsent;
+} Sample;
+
+typedef struct {
+    pthread_t tid;
+    pthread_mutex_t lock;       /* Guards everything down to stop */
+    int fd;                     /* -1 once close() has been called */
+    long conn;                  /* -1 when there is nothing to sample */
+    int phase;
+    struct sockaddr_in local;
+    struct sockaddr_in peer;
+    Boolean stop;
+    uint64_t interval;
+    uint64_t start;
+    int nlfd;
+    Sample *ring;
+    uint64_t written;           /* Ring slot is written % SAMPLE_RING_SIZE */
+} Sampler;
+
+static Sampler *sampler = NULL;
+
+static Boolean sample_fd(int fd, Sample *s)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    int outq, notsent;
+
+    memset(&info, 0, sizeof(info));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1)
+        return FALSE;
+    if (ioctl(fd, SIOCOUTQ, &outq) == -1 ||
+        ioctl(fd, SIOCOUTQNSD, &notsent) == -1)
+        return FALSE;
+
+    s->source = SOURCE_FD;
+    s->state = info.tcpi_state;
+    s->unacked = info.tcpi_unacked;
+    s->retrans = info.tcpi_total_retrans;
+    s->rtt = info.tcpi_rtt;
+    s->cwnd = info.tcpi_snd_cwnd;
+    s->outq = outq;
+    s->notsent = notsent;
+    return TRUE;
+}
+
+/* Look the socket up by its 4-tuple. Returns FALSE once the kernel no
+ * longer knows it. Time-wait sockets come back without TCP_INFO. */
+static Boolean sample_diag(int nlfd, const struct sockaddr_in *local,
+                           const struct sockaddr_in *peer, Sample *s)
+{
+    struct {
+        struct nlmsghdr nlh;
+        struct inet_diag_req_v2 req;
+    } request;
+    char buf[4096];
+    struct nlmsghdr *nlh;
+    struct inet_diag_msg *msg;
+    struct rtattr *attr;
+    struct tcp_info info;
+    ssize_t n;
+    int len;
+
+    memset(&request, 0, sizeof(request));
+    request.nlh.nlmsg_len = sizeof(request);
+    request.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST;
+    request.req.sdiag_family = AF_INET;
+    request.req.sdiag_protocol = IPPROTO_TCP;
+    request.req.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+    request.req.idiag_states = ~0U;
+    request.req.id.idiag_sport = local->sin_port;
+    request.req.id.idiag_dport = peer->sin_port;
+    request.req.id.idiag_src[0] = local->sin_addr.s_addr;
+    request.req.id.idiag_dst[0] = peer->sin_addr.s_addr;
+    request.req.id.idiag_cookie[0] = INET_DIAG_NOCOOKIE;
+    request.req.id.idiag_cookie[1] = INET_DIAG_NOCOOKIE;
+
+    if (send(nlfd, &request, sizeof(request), 0) == -1)
+        die("send() sock_diag request");
+    n = recv(nlfd, buf, sizeof(buf), 0);
+    if (n == -1)
+        die("recv() sock_diag reply");
+
+    nlh = (struct nlmsghdr *) buf;
+    if (!NLMSG_OK(nlh, n) || nlh->nlmsg_type != SOCK_DIAG_BY_FAMILY)
+        return FALSE;               /* NLMSG_ERROR: ENOENT */
+    msg = NLMSG_DATA(nlh);
+
+    memset(&info, 0, sizeof(info));
+    len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+    for (attr = (struct rtattr *) (msg + 1); RTA_OK(attr, len);
+         attr = RTA_NEXT(attr, len)) {
+        if (attr->rta_type == INET_DIAG_INFO)
+            memcpy(&info, RTA_DATA(attr),
+                   RTA_PAYLOAD(attr) < sizeof(info) ?
+                   RTA_PAYLOAD(attr) : sizeof(info));
+    }
+
+    s->source = SOURCE_DIAG;
+    s->state = msg->idiag_state;
+    s->unacked = info.tcpi_unacked;
+    s->retrans = info.tcpi_total_retrans;
+    s->rtt = info.tcpi_rtt;
+    s->cwnd = info.tcpi_snd_cwnd;
+    s->outq = msg->idiag_wqueue;
+    s->notsent = info.tcpi_notsent_bytes;
+    return TRUE;
+}
+
+static void *sampler_thread(void *arg)
+{
+    Sampler *sp = arg;
+    struct sockaddr_in local, peer;
+    struct timespec ts;
+    uint64_t next;
+    Sample s;
+    Boolean ok;
+    long conn;
+
+    next = sp->start;
+    for (;;) {
+        next += sp->interval;
+        ts.tv_sec = next / NSECS_PER_SEC;
+        ts.tv_nsec = next % NSECS_PER_SEC;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                               NULL) == EINTR)
+            ;
+
+        memset(&s, 0, sizeof(s));
+        pthread_mutex_lock(&sp->lock);
+        if (sp->stop) {
+            pthread_mutex_unlock(&sp->lock);
+            break;
+        }
+        conn = sp->conn;
+        s.phase = sp->phase;
+        local = sp->local;
+        peer = sp->peer;
+        /* Sampling under the lock keeps the fd from being closed
+         * under our feet */
+        ok = conn >= 0 && sp->fd >= 0 && sample_fd(sp->fd, &s);
+        pthread_mutex_unlock(&sp->lock);
+        if (conn < 0)
+            continue;
+
+        if (!ok)
+            ok = sample_diag(sp->nlfd, &local, &peer, &s);
+        if (!ok || s.state == TCP_STATE_TIME_WAIT ||
+            s.state == TCP_STATE_CLOSE) {
+            pthread_mutex_lock(&sp->lock);
+            if (sp->conn == conn && sp->fd == -1)
+                sp->conn = -1;      /* Gone - nothing more to see */
+            pthread_mutex_unlock(&sp->lock);
+            if (!ok)
+                continue;
+        }
+
+        s.time = timestamp() - sp->start;
+        s.conn = conn;
+        sp->ring[sp->written++ % SAMPLE_RING_SIZE] = s;
+
+        /* Skip ticks that we are already too late for */
+        if (timestamp() > next + sp->interval)
+            next = timestamp();
+    }
+    return NULL;
+}
+
+static void sampler_start(int hz)
+{
+    int r;
+
+    sampler = calloc(1, sizeof(Sampler));
+    if (sampler == NULL)
+        fatal("out of memory");
+    sampler->ring = calloc(SAMPLE_RING_SIZE, sizeof(Sample));
+    if (sampler->ring == NULL)
+        fatal("out of memory");
+    /* Touch the ring now, not from the sampler's first laps */
+    memset(sampler->ring, 0, SAMPLE_RING_SIZE * sizeof(Sample));
+    pthread_mutex_init(&sampler->lock, NULL);
+    sampler->fd = -1;
+    sampler->conn = -1;
+    sampler->interval = NSECS_PER_SEC / hz;
+
+    sampler->nlfd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                           NETLINK_SOCK_DIAG);
+    if (sampler->nlfd == -1)
+        die("socket() NETLINK_SOCK_DIAG");
+
+    sampler->start = timestamp();
+    r = pthread_create(&sampler->tid, NULL, sampler_thread, sampler);
+    if (r != 0) {
+        errno = r;
+        die("pthread_create()");
+    }
+}
+
+static void sampler_watch(int fd, long conn)
+{
+    struct sockaddr_in local, peer;
+    socklen_t len;
+
+    if (sampler == NULL)
+        return;
+    len = sizeof(local);
+    if (getsockname(fd, (struct sockaddr *) &local, &len) == -1)
+        die("getsockname()");
+    len = sizeof(peer);
+    if (getpeername(fd, (struct sockaddr *) &peer, &len) == -1)
+        die("getpeername()");
+
+    pthread_mutex_lock(&sampler->lock);
+    sampler->fd = fd;
+    sampler->conn = conn;
+    sampler->phase = PHASE_WAIT;
+    sampler->local = local;
+    sampler->peer = peer;
+    pthread_mutex_unlock(&sampler->lock);
+}
+
+/* Mark the start of a phase. PHASE_CLOSE must be marked before close() is
+ * called, as it stops the sampler from using the fd. */
+static void sampler_phase(int phase)
+{
+    if (sampler == NULL)
+        return;
+    pthread_mutex_lock(&sampler->lock);
+    sampler->phase = phase;
+    if (phase >= PHASE_CLOSE)
+        sampler->fd = -1;
+    pthread_mutex_unlock(&sampler->lock);
+}
+
+static void sampler_dump(const Sampler *sp)
+{
+    uint64_t i, first;
+    const Sample *s;
+
+    first = sp->written > SAMPLE_RING_SIZE ? sp->written - SAMPLE_RING_SIZE : 0;
+    printf("-- TCP samples: %llu (overwritten: %llu)\n",
+           (unsigned long long) sp->written, (unsigned long long) first);
+    puts("time_us,conn,phase,source,state,unacked,retrans,rtt_us,cwnd,"
+         "outq,notsent");
+    for (i = first; i < sp->written; i++) {
+        s = &sp->ring[i % SAMPLE_RING_SIZE];
+        printf("%.3f,%u,%s,%s,%s,%u,%u,%u,%u,%u,%u\n", s->time / 1000.0,
+               s->conn, phase_names[s->phase],
+               s->source == SOURCE_FD ? "fd" : "diag",
+               s->state < sizeof(tcp_state_names) / sizeof(char *) ?
+               tcp_state_names[s->state] : "?", s->unacked, s->retrans,
+               s->rtt, s->cwnd, s->outq, s->notsent);
+    }
+}
+
+/* Give the last socket up to SAMPLE_TAIL_SECS to finish closing, then stop
+ * the sampler and dump what it saw */
+static void sampler_finish(void)
+{
+    uint64_t deadline;
+    int r;
+
+    if (sampler == NULL)
+        return;
+    deadline = timestamp() + SAMPLE_TAIL_SECS * NSECS_PER_SEC;
+    do {
+        pthread_mutex_lock(&sampler->lock);
+        sampler->stop = sampler->conn == -1 || timestamp() >= deadline;
+        pthread_mutex_unlock(&sampler->lock);
+        if (!sampler->stop)
+            usleep(1000);
+    } while (!sampler->stop);
+
+    r = pthread_join(sampler->tid, NULL);
+    if (r != 0) {
+        errno = r;
+        die("pthread_join()");
+    }
+    close(sampler->nlfd);
+    sampler_dump(sampler);
+    free(sampler->ring);
+    free(sampler);
+    sampler = NULL;
+}
+
+#else
+
+static void sampler_watch(int fd, long conn)
+{
+    (void) fd;
+    (void) conn;
+}
+
+static void sampler_phase(int phase)
+{
+    (void) phase;
+}
+
+static void sampler_finish(void)
+{
+}
+
+#endif /* __linux__ */
+
+static void shutdown_wait_eof(int connfd, const Options *options,
+                              Timings *timings, TimelineSlot *tl)
+{
+    uint64_t before, after;
+    CounterSnap snap;
+    int r, err;
+    ssize_t n;
+    char c;
+
+    puts("-- calling shutdown() on connected socket");
+    sampler_phase(PHASE_SHUTDOWN);
+    counters_start(&snap);
+    before = timestamp();
+    timeline_mark(tl, shutdown, before);
+
+    r = shutdown(connfd, SHUT_WR);
+    after = timestamp();
+    err = r == -1 ? errno : 0;
+    counters_stop(&snap, &timings->shutdown_counts);
+    trace_event(TEV_SHUTDOWN, connfd, before, after, 0, err);
+    if (r == -1) {
+        if (err == EWOULDBLOCK)
+            puts("EWOULDBLOCK on shutdown()");
+        else
+            die("shutdown connfd");
+    }
+    hist_record(&timings->shutdown, after - before);
+    printf("Time to shutdown(): %.9f secs\n", time_diff(before, after));
+    print_snap(&snap);
+
+    if (options->linger_sock == OPT_CSOCK_LATE) {
+        puts("Late Linger: on (connected socket)");
+        set_linger(connfd, options->linger_time);
+    }
+
+    puts("-- waiting for EOF");
+    sampler_phase(PHASE_EOF_WAIT);
+    counters_start(&snap);
+    before = timestamp();
+
+    if (options->shutdown_time > 0) {
+        struct pollfd pfds[1];
+
+        pfds[0].fd = connfd;
+        pfds[0].events = POLLIN;
+        r = poll(pfds, 1, (1000 * options->shutdown_time));
+        if (r == -1)
+            die("poll()");
+        if (r == 0) {
+            after = timestamp();
+            trace_event(TEV_EOF, connfd, before, after, 0, ETIMEDOUT);
+            puts("Timeout reached waiting for EOF after shutdown()");
+            printf("Timeout expected: %d secs (actual: %.9f secs)\n",
+                   options->shutdown_time, time_diff(before, after));
+            return;
+        }
+    }
+
+    n = read(connfd, &c, 1);
+    after = timestamp();
+    err = n == -1 ? errno : 0;
+    counters_stop(&snap, &timings->eof_counts);
+    trace_event(TEV_EOF, connfd, before, after, n > 0 ? n : 0, err);
+    if (n == -1) {
+        if (err == EWOULDBLOCK)
+            puts("EWOULDBLOCK on read() after shutdown()");
+        else
+            die("read() after shutdown()");
+    } else if (n == 1) {
+        fprintf(stderr, "read() after shutdown(): "
+                "Illegal data from peer; EOF expected\n");
+        exit(EXIT_FAILURE);
+    }
+    hist_record(&timings->eof, after - before);
+    printf("Time till EOF: %.9f secs\n", time_diff(before, after));
+    print_snap(&snap);
+}
+
+/* With -R every worker has a listening socket of its own, all of them
+ * bound to PORT_NUM with SO_REUSEPORT, and the kernel spreads incoming
+ * connections across them */
+static int bind_listener(const Options *options)
+{
+    int listenfd, r, val;
+    struct sockaddr_in servaddr;
+
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd == -1)
+        die("socket");
+
+    set_socket_options(listenfd);
+    if (options->linger_sock == OPT_LSOCK)
+        apply_linger(listenfd, options->linger_time);
+#ifdef __linux__
+    if (options->threads > 0) {
+        val = 1;
+        r = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+        if (r == -1)
+            die("setting SO_REUSEPORT");
+    }
+    if (options->fastopen) {
+        val = BACKLOG;
+        r = setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &val, sizeof(val));
+        if (r == -1)
+            die("setting TCP_FASTOPEN");
+    }
+#else
+    (void) val;
+#endif
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port = htons(PORT_NUM);
+
+    r = bind(listenfd, (struct sockaddr *) &servaddr, sizeof(servaddr));
+    if (r == -1)
+        die("bind()");
+
+    r = listen(listenfd, BACKLOG);
+    if (r == -1)
+        die("listen()");
+
+    return listenfd;
+}
+
+static int open_listener(const Options *options)
+{
+    int listenfd;
+
+    listenfd = bind_listener(options);
+    if (options->linger_sock == OPT_LSOCK) {
+        printf("Linger timeout (secs): %d\n", options->linger_time);
+        puts("Linger: on (listening socket)");
+    } else if (options->linger_sock == OPT_NOSOCK) {
+        puts("Linger: off");
+    }
+#ifdef __linux__
+    if (options->fastopen) {
+        FILE *fp;
+        int mode = 0;
+
+        fp = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+        if (fp != NULL) {
+            if (fscanf(fp, "%i", &mode) != 1)
+                mode = 0;
+            fclose(fp);
+        }
+        printf("TCP Fast Open: on (queue %d)\n", BACKLOG);
+        if (!(mode & 2))
+            printf("net.ipv4.tcp_fastopen is %d: without bit 2 every SYN's "
+                   "data will be refused\n", mode);
+    }
+#endif
+    return listenfd;
+}
+
+#ifdef __linux__
+
+/* Hierarchical timer wheel: WHEEL_LEVELS rings of WHEEL_SLOTS lists, each
+ * level WHEEL_SLOTS times coarser than the one below, with a tick of
+ * WHEEL_TICK ns. A timer goes into the finest level whose span covers its
+ * expiry, and is moved down a level whenever the level below wraps, so
+ * adding and cancelling are O(1) and each timer is touched at most
+ * WHEEL_LEVELS times before it fires. Timers are embedded in the objects
+ * that own them; firing one calls its function, which may free it.
+ */
+
+typedef struct Timer Timer;
+typedef void (*TimerFn)(void *owner, void *data);
+
+struct Timer {
+    Timer *next;
+    Timer **pprev;              /* NULL when not armed */
+    uint64_t expires;           /* In ticks */
+    TimerFn fn;
+    void *owner;
+    void *data;
+};
+
+typedef struct {
+    uint64_t now;               /* Every tick before this one has been run */
+    long count;
+    Timer *due;                 /* Expired, waiting for wheel_expire() */
+    Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+static void wheel_init(TimerWheel *wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(TimerWheel));
+    wheel->now = now / WHEEL_TICK;
+}
+
+static void timer_init(Timer *t, TimerFn fn, void *owner, void *data)
+{
+    memset(t, 0, sizeof(Timer));
+    t->fn = fn;
+    t->owner = owner;
+    t->data = data;
+}
+
+static void timer_link(Timer **head, Timer *t)
+{
+    t->next = *head;
+    if (t->next != NULL)
+        t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+static void timer_unlink(Timer *t)
+{
+    *t->pprev = t->next;
+    if (t->next != NULL)
+        t->next->pprev = t->pprev;
+    t->pprev = NULL;
+}
+
+static void wheel_place(TimerWheel *wheel, Timer *t)
+{
+    uint64_t delta;
+    int level;
+
+    if (t->expires <= wheel->now) {
+        timer_link(&wheel->due, t);
+        return;
+    }
+    delta = t->expires - wheel->now;
+    /* The span of the top level (about 12 days) is well past TIME_MAX, so
+     * every timer fits */
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+        if (delta < 1ULL << (WHEEL_BITS * (level + 1)))
+            break;
+    timer_link(&wheel->slots[level][(t->expires >> (WHEEL_BITS * level)) &
+                                    (WHEEL_SLOTS - 1)], t);
+}
+
+static void wheel_add(TimerWheel *wheel, Timer *t, uint64_t expires)
+{
+    t->expires = (expires + WHEEL_TICK - 1) / WHEEL_TICK;
+    wheel_place(wheel, t);
+    wheel->count++;
+}
+
+static void wheel_cancel(TimerWheel *wheel, Timer *t)
+{
+    if (t->pprev == NULL)
+        return;
+    timer_unlink(t);
+    wheel->count--;
+}
+
+/* Move every timer in a slot of a coarser level down to where it now
+ * belongs */
+static void wheel_cascade(TimerWheel *wheel, int level)
+{
+    Timer *t, **slot;
+
+    slot = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) &
+                                (WHEEL_SLOTS - 1)];
+    while ((t = *slot) != NULL) {
+        timer_unlink(t);
+        wheel_place(wheel, t);
+    }
+}
+
+/* Run the wheel up to now, then fire everything that has expired */
+static void wheel_expire(TimerWheel *wheel, uint64_t now)
+{
+    uint64_t target = now / WHEEL_TICK;
+    Timer *t, **slot;
+    int level;
+
+    while (wheel->now < target) {
+        if (wheel->count == 0) {
+            wheel->now = target;
+            break;
+        }
+        wheel->now++;
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel->now & ((1ULL << (WHEEL_BITS * level)) - 1))
+                break;
+            wheel_cascade(wheel, level);
+        }
+        slot = &wheel->slots[0][wheel->now & (WHEEL_SLOTS - 1)];
+        while ((t = *slot) != NULL) {
+            timer_unlink(t);
+            timer_link(&wheel->due, t);
+        }
+    }
+
+    while ((t = wheel->due) != NULL) {
+        timer_unlink(t);
+        wheel->count--;
+        t->fn(t->owner, t->data);
+    }
+}
+
+/* Milliseconds until wheel_expire() next has work, or -1 if it has none.
+ * Only the finest level is searched; anything further out is woken for
+ * at the next cascade, at most WHEEL_SLOTS ticks away. */
+static int wheel_timeout(const TimerWheel *wheel, uint64_t now)
+{
+    uint64_t next, i;
+
+    if (wheel->count == 0)
+        return -1;
+    if (wheel->due != NULL)
+        return 0;
+    next = (wheel->now | (WHEEL_SLOTS - 1)) + 1;
+    for (i = wheel->now + 1; i < next; i++) {
+        if (wheel->slots[0][i & (WHEEL_SLOTS - 1)] != NULL) {
+            next = i;
+            break;
+        }
+    }
+    next *= WHEEL_TICK;
+    if (next <= now)
+        return 0;
+    return (int) ((next - now + 999999) / 1000000);
+}
+
+/* -W: time adding, cancelling and expiring timers at increasing counts,
+ * with expiries spread evenly over WHEEL_BENCH_SPAN ms of simulated time.
+ * The wheel is stepped a millisecond at a time, as a busy event loop would
+ * step it, and the cost of stepping an otherwise empty wheel is reported
+ * on its own and taken out of the cost of expiry. */
+static long bench_fired;
+
+static void bench_fire(void *owner, void *data)
+{
+    (void) owner;
+    (void) data;
+    bench_fired++;
+}
+
+static uint64_t bench_sweep(TimerWheel *wheel)
+{
+    uint64_t before, now = 0;
+
+    before = timestamp();
+    while (wheel->count > 0) {
+        now += WHEEL_TICK;
+        wheel_expire(wheel, now);
+    }
+    return timestamp() - before;
+}
+
+static void wheel_bench(void)
+{
+    static const long counts[] = { 1000, 10000, 100000, 1000000 };
+    TimerWheel *wheel;
+    Timer *timers;
+    uint64_t before, add_ns, cancel_ns, expire_ns;
+    double tick_ns;
+    unsigned int seed = 1;
+    long n, i;
+    size_t k;
+
+    wheel = malloc(sizeof(TimerWheel));
+    timers = malloc(counts[3] * sizeof(Timer));
+    if (wheel == NULL || timers == NULL)
+        fatal("out of memory");
+
+    /* A lone timer at the end of the span keeps the wheel from skipping */
+    wheel_init(wheel, 0);
+    timer_init(&timers[0], bench_fire, NULL, NULL);
+    wheel_add(wheel, &timers[0], WHEEL_BENCH_SPAN * WHEEL_TICK);
+    tick_ns = (double) bench_sweep(wheel) / WHEEL_BENCH_SPAN;
+    printf("Wheel step with no timers due (ns): %.1f\n", tick_ns);
+
+    puts("timers,add_ns,cancel_ns,expire_ns");
+    for (k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+        n = counts[k];
+        wheel_init(wheel, 0);
+        bench_fired = 0;
+        for (i = 0; i < n; i++)
+            timer_init(&timers[i], bench_fire, NULL, NULL);
+
+        before = timestamp();
+        for (i = 0; i < n; i++)
+            wheel_add(wheel, &timers[i], WHEEL_TICK *
+                      (1 + rand_r(&seed) % WHEEL_BENCH_SPAN));
+        add_ns = timestamp() - before;
+
+        /* Half of them are cancelled, as when EOF beats the deadline */
+        before = timestamp();
+        for (i = 0; i < n; i += 2)
+            wheel_cancel(wheel, &timers[i]);
+        cancel_ns = timestamp() - before;
+
+        expire_ns = bench_sweep(wheel);
+        if (bench_fired != n / 2)
+            fatal("timer wheel lost timers");
+
+        printf("%ld,%.1f,%.1f,%.1f\n", n, (double) add_ns / n,
+               (double) cancel_ns / (n - n / 2),
+               ((double) expire_ns - tick_ns * WHEEL_BENCH_SPAN) / (n / 2));
+    }
+    free(timers);
+    free(wheel);
+}
+
+/* Deferred close engine: a connection handed to closer_add() is shut down
+ * for writing and then watched, without ever blocking the caller, until
+ * either the peer's EOF arrives or the send queue (and our FIN) has been
+ * acked - at which point it is closed gracefully - or its deadline passes,
+ * at which point it is aborted with SO_LINGER 0. The engine has its own
+ * epoll instance, so it can be nested in another event loop by watching
+ * closer->epfd for input and calling closer_run() when it is readable or
+ * when closer_timeout() expires. Deadlines are timers on the caller's
+ * wheel, which the caller must expire.
+ */
+
+typedef struct Closing Closing;
+
+struct Closing {
+    int fd;
+    TimelineSlot *tl;
+    uint64_t start;
+    DrainPlan plan;             /* -A only */
+    Timer deadline;
+    Closing *prev;              /* Links in the list polled for drain */
+    Closing *next;
+};
+
+typedef struct {
+    int epfd;
+    uint64_t budget;
+    uint64_t adaptive_budget;   /* -A: deadlines planned per connection */
+    uint64_t next_drain_check;
+    TimerWheel *wheel;
+    Closing *head;
+    Closing *tail;
+    long active;
+    long on_eof;                /* Closed gracefully after the peer's EOF */
+    long on_drain;              /* ...after the send queue drained */
+    long aborted;               /* Reset when the deadline passed */
+    long errors;                /* Reset by the peer, or shutdown() failed */
+    Histogram graceful;         /* Hand-off to graceful close() */
+    Adaptive adaptive;
+} Closer;
+
+/* Deadlines are budget_secs after the hand-off, or with adaptive_ms > 0
+ * planned from each connection's send queue, compared with budget_secs */
+static void closer_init(Closer *closer, int budget_secs, int adaptive_ms,
+                        TimerWheel *wheel)
+{
+    memset(closer, 0, sizeof(Closer));
+    closer->budget = budget_secs * NSECS_PER_SEC;
+    closer->adaptive_budget = adaptive_ms * 1000000ULL;
+    closer->wheel = wheel;
+    closer->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (closer->epfd == -1)
+        die("epoll_create1()");
+}
+
+static void closer_finish_conn(Closer *closer, Closing *cl, Boolean abort)
+{
+    uint64_t before, after;
+
+    wheel_cancel(closer->wheel, &cl->deadline);
+    if (cl->prev != NULL)
+        cl->prev->next = cl->next;
+    else
+        closer->head = cl->next;
+    if (cl->next != NULL)
+        cl->next->prev = cl->prev;
+    else
+        closer->tail = cl->prev;
+
+    if (abort) {
+        apply_linger(cl->fd, 0);
+    } else {
+        before = timestamp();
+        hist_record(&closer->graceful, before - cl->start);
+        if (closer->adaptive_budget > 0)
+            adaptive_account(&closer->adaptive, &cl->plan, closer->budget,
+                             before - cl->start);
+    }
+    /* Closing the fd removes it from the epoll set */
+    before = timestamp();
+    timeline_mark(cl->tl, close, before);
+    if (close(cl->fd) == -1)
+        die("closing connfd");
+    after = timestamp();
+    timeline_mark(cl->tl, closed, after);
+    trace_event(TEV_CLOSE, cl->fd, before, after, CLOSE_NOW, 0);
+    closer->active--;
+    free(cl);
+}
+
+static void closer_deadline(void *owner, void *data)
+{
+    Closer *closer = owner;
+    Closing *cl = data;
+
+    closer->aborted++;
+    if (closer->adaptive_budget > 0)
+        adaptive_account(&closer->adaptive, &cl->plan, closer->budget,
+                         timestamp() - cl->start);
+    closer_finish_conn(closer, cl, TRUE);
+}
+
+/* Take over fd, which must be non-blocking, and close it in the background.
+ * tl is its slot in the shared timeline, if there is one. */
+static void closer_add(Closer *closer, int fd, TimelineSlot *tl)
+{
+    struct epoll_event ev;
+    Closing *cl;
+    int r;
+
+    cl = calloc(1, sizeof(Closing));
+    if (cl == NULL)
+        fatal("out of memory");
+    cl->fd = fd;
+    cl->tl = tl;
+    cl->start = timestamp();
+    timer_init(&cl->deadline, closer_deadline, closer, cl);
+    if (closer->adaptive_budget > 0) {
+        drain_plan(fd, closer->adaptive_budget, WHEEL_TICK, &cl->plan);
+        wheel_add(closer->wheel, &cl->deadline, cl->start + cl->plan.timeout);
+    } else {
+        wheel_add(closer->wheel, &cl->deadline, cl->start + closer->budget);
+    }
+    cl->prev = closer->tail;
+    if (closer->tail != NULL)
+        closer->tail->next = cl;
+    else
+        closer->head = cl;
+    closer->tail = cl;
+    closer->active++;
+
+    timeline_mark(tl, shutdown, cl->start);
+    r = shutdown(fd, SHUT_WR);
+    trace_event(TEV_SHUTDOWN, fd, cl->start, timestamp(), 0,
+                r == -1 ? errno : 0);
+    if (r == -1) {
+        closer->errors++;
+        closer_finish_conn(closer, cl, TRUE);
+        return;
+    }
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = cl;
+    if (epoll_ctl(closer->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        die("epoll_ctl() EPOLL_CTL_ADD");
+}
+
+/* Discard whatever the peer sends until its EOF. Returns TRUE if that
+ * finished the connection, and cl has been freed. */
+static Boolean closer_read(Closer *closer, Closing *cl)
+{
+    char buf[4096];
+    ssize_t n;
+
+    for (;;) {
+        n = recv(cl->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0)
+            continue;
+        if (n == 0) {
+            trace_event(TEV_EOF, cl->fd, cl->start, timestamp(), 0, 0);
+            closer->on_eof++;
+            closer_finish_conn(closer, cl, FALSE);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                   errno != EINTR) {
+            closer->errors++;
+            closer_finish_conn(closer, cl, TRUE);
+        } else {
+            return FALSE;
+        }
+        return TRUE;
+    }
+}
+
+/* There is no event for the send queue emptying, so it is polled. Once
+ * SIOCOUTQ reaches 0 our FIN has been acked too. Anything the peer sent
+ * that is still unread would turn the close() into a RST, so the receive
+ * queue is read out first, and if that finds the EOF the connection ends
+ * on the EOF path instead. */
+static void closer_check_drain(Closer *closer, uint64_t now)
+{
+    Closing *cl, *next;
+    int outq;
+
+    if (now < closer->next_drain_check)
+        return;
+    closer->next_drain_check = now + CLOSER_DRAIN_CHECK;
+    for (cl = closer->head; cl != NULL; cl = next) {
+        next = cl->next;
+        if (ioctl(cl->fd, SIOCOUTQ, &outq) == 0 && outq == 0 &&
+            !closer_read(closer, cl)) {
+            closer->on_drain++;
+            closer_finish_conn(closer, cl, FALSE);
+        }
+    }
+}
+
+/* Do whatever work is due without blocking */
+static void closer_run(Closer *closer)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
+
+    do {
+        n = epoll_wait(closer->epfd, events, MAX_EVENTS, 0);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            die("epoll_wait()");
+        }
+        for (i = 0; i < n; i++)
+            closer_read(closer, events[i].data.ptr);
+    } while (n == MAX_EVENTS);
+
+    closer_check_drain(closer, timestamp());
+}
+
+/* Milliseconds until closer_run() next has work to do without any input,
+ * or -1 if it has none. Deadlines are the wheel's business. */
+static int closer_timeout(const Closer *closer)
+{
+    uint64_t now;
+
+    if (closer->head == NULL)
+        return -1;
+    now = timestamp();
+    if (closer->next_drain_check <= now)
+        return 0;
+    return (int) ((closer->next_drain_check - now) / 1000000) + 1;
+}
+
+/* The sooner of two epoll/poll timeouts, where -1 is never */
+static int min_timeout(int a, int b)
+{
+    if (a < 0)
+        return b;
+    if (b < 0)
+        return a;
+    return a < b ? a : b;
+}
+
+/* Keep the closer going until fd, unless it is -1, is ready for events
+ * or msecs, unless it is -1, have passed - or with neither, until every
+ * connection handed over has been closed. Returns fd's revents, or 0.
+ * The one-shot server waits for its next client, the ready byte, the
+ * sleep(1) and a full send buffer through here, so that the connections
+ * it has already handed over keep closing in the meantime. */
+static short closer_wait(Closer *closer, int fd, short events, int msecs)
+{
+    struct pollfd pfds[2];
+    uint64_t until = 0, now;
+    int timeout;
+
+    if (msecs >= 0)
+        until = timestamp() + msecs * 1000000ULL;
+    pfds[0].fd = closer->epfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = fd;
+    pfds[1].events = events;
+    for (;;) {
+        if (fd == -1 && msecs < 0 && closer->active == 0)
+            return 0;
+        now = timestamp();
+        timeout = -1;
+        if (msecs >= 0) {
+            if (now >= until)
+                return 0;
+            timeout = (int) ((until - now + 999999) / 1000000);
+        }
+        timeout = min_timeout(timeout, closer_timeout(closer));
+        timeout = min_timeout(timeout, wheel_timeout(closer->wheel, now));
+        pfds[1].revents = 0;
+        if (poll(pfds, 2, timeout) == -1 && errno != EINTR)
+            die("poll()");
+        closer_run(closer);
+        wheel_expire(closer->wheel, timestamp());
+        if (fd != -1 && pfds[1].revents != 0)
+            return pfds[1].revents;
+    }
+}
+
+static void closer_print(const Closer *closer)
+{
+    printf("Deferred closes after EOF: %ld\n", closer->on_eof);
+    printf("Deferred closes after drain: %ld\n", closer->on_drain);
+    printf("Deferred closes aborted at deadline: %ld\n", closer->aborted);
+    printf("Deferred closes reset or failed: %ld\n", closer->errors);
+    hist_print("Time to graceful close", &closer->graceful);
+    adaptive_print(&closer->adaptive);
+}
+
+static void closer_free(Closer *closer)
+{
+    close(closer->epfd);
+}
+
+/* The engine behind -s deferred for the one-shot server, and its wheel */
+static Closer *deferred_closer = NULL;
+static TimerWheel *deferred_wheel = NULL;
+
+#endif /* __linux__ */
+
+#ifdef __linux__
+
+/* Event loop mode: many concurrent connections are driven by a single epoll
+ * loop. Each connection runs through the same lifecycle as the one-shot
+ * server (write payload, optional shutdown() and wait for EOF, close()) but
+ * without blocking the other connections, except where close() itself
+ * blocks because of the linger policy - which is what we want to measure.
+ */
+
+#define CONN_READY_WAIT 0
+#define CONN_SEND 1
+#define CONN_EOF_WAIT 2
+
+typedef struct Conn Conn;
+
+struct Conn {
+    int fd;
+    int state;
+    TimelineSlot *tl;           /* -M only */
+    Sender snd;
+    uint64_t eof_wait_start;
+    Timer deadline;             /* EOF wait expiry (CONN_EOF_WAIT only) */
+    Timer stream_end;           /* -D: cut the stream (CONN_SEND only) */
+};
+
+typedef struct {
+    long accepted;
+    long closed;
+    long ready_errors;
+    long write_errors;
+    long shutdown_wouldblock;
+    long shutdown_errors;
+    long eof_timeouts;
+    long eof_errors;
+    long close_wouldblock;
+    unsigned long long bytes_sent;
+    long write_calls;
+    long write_blocked;
+    unsigned long long zc_sent;
+    unsigned long long zc_done;
+    unsigned long long zc_copied;
+    long streams_cut;
+    Timings timings;
+} Stats;
+
+typedef struct {
+    const Options *options;
+    int epfd;
+    int listenfd;
+    Boolean accepting;
+    const Payload *payload;
+    long active;
+    TimerWheel wheel;           /* EOF wait and deferred close deadlines */
+    Stats stats;
+    Closer *closer;             /* -s deferred only */
+    uint64_t first_accept;
+    uint64_t last_close;
+    const sigset_t *wait_mask;  /* Signal mask while waiting for events */
+    pthread_t tid;              /* -R only */
+    int cpu;                    /* ...and the CPU the thread is pinned to */
+} Worker;
+
+static volatile sig_atomic_t stop_requested = 0;
+static int stop_fd = -1;        /* eventfd that wakes every worker to stop */
+static long accepted_total = 0; /* By all workers, for -n */
+
+static void request_stop(void)
+{
+    uint64_t one = 1;
+    ssize_t r;
+
+    stop_requested = 1;
+    if (stop_fd != -1) {
+        r = write(stop_fd, &one, sizeof(one));
+        (void) r;
+    }
+}
+
+static void stop_handler(int sig)
+{
+    (void) sig;
+    request_stop();
+}
+
+static void set_events(Worker *w, Conn *c, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+        die("epoll_ctl() EPOLL_CTL_MOD");
+}
+
+static void clear_nonblocking(int fd)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1)
+        die("fcntl F_GETFL");
+    if (fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+        die("fcntl F_SETFL");
+}
+
+static void conn_close(Worker *w, Conn *c)
+{
+    uint64_t before, after;
+    CounterSnap snap;
+    DrainPlan plan;
+    uint64_t mem_before, mem_after;
+    int r, err, unacked, unsent;
+
+    wheel_cancel(&w->wheel, &c->deadline);
+    wheel_cancel(&w->wheel, &c->stream_end);
+
+    if (c->snd.backend == BACKEND_ZEROCOPY)
+        drain_zerocopy(&c->snd, c->fd);
+    w->stats.bytes_sent += c->snd.sent;
+    w->stats.write_calls += c->snd.calls;
+    w->stats.write_blocked += c->snd.blocked;
+    w->stats.zc_sent += c->snd.zc_sent;
+    w->stats.zc_done += c->snd.zc_done;
+    w->stats.zc_copied += c->snd.zc_copied;
+    sender_free(&c->snd);
+    if (w->options->stream_msecs > 0)
+        stream_inflight(c->fd, &w->stats.timings, &unacked, &unsent);
+    close_memory(c->fd, w->options, &w->stats.timings, &mem_before,
+                 &mem_after);
+
+    if (w->closer != NULL) {
+        /* The fd stays open, so it must leave our epoll set by hand */
+        counters_start(&snap);
+        before = timestamp();
+        if (epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL) == -1)
+            die("epoll_ctl() EPOLL_CTL_DEL");
+        closer_add(w->closer, c->fd, c->tl);
+        after = timestamp();
+        counters_stop(&snap, &w->stats.timings.close_counts);
+        hist_record(&w->stats.timings.close, after - before);
+        trace_event(TEV_CLOSE, c->fd, before, after, CLOSE_DEFERRED, 0);
+        goto done;
+    }
+
+    /* The loop needs O_NONBLOCK for its I/O, but close() must see the
+     * blocking mode that was asked for with (or without) -N */
+    if (!w->options->nonblocking)
+        clear_nonblocking(c->fd);
+    if (w->options->adaptive_budget > 0)
+        adaptive_linger(c->fd, w->options->adaptive_budget, &plan);
+
+    counters_start(&snap);
+    before = timestamp();
+    timeline_mark(c->tl, close, before);
+    r = close(c->fd);
+    after = timestamp();
+    err = r == -1 ? errno : 0;
+    counters_stop(&snap, &w->stats.timings.close_counts);
+    timeline_mark(c->tl, closed, after);
+    trace_event(TEV_CLOSE, c->fd, before, after, CLOSE_NOW, err);
+    if (r == -1) {
+        if (err == EWOULDBLOCK)
+            w->stats.close_wouldblock++;
+        else
+            die("closing connfd");
+    }
+    hist_record(&w->stats.timings.close, after - before);
+    if (w->options->adaptive_budget > 0)
+        adaptive_account(&w->stats.timings.adaptive, &plan,
+                         w->options->linger_time * NSECS_PER_SEC,
+                         after - before);
+
+done:
+    w->stats.closed++;
+    w->last_close = after;
+    w->active--;
+    free(c);
+}
+
+static void conn_eof_timeout(void *owner, void *data)
+{
+    Worker *w = owner;
+    Conn *c = data;
+
+    trace_event(TEV_EOF, c->fd, c->eof_wait_start, timestamp(), 0,
+                ETIMEDOUT);
+    w->stats.eof_timeouts++;
+    conn_close(w, c);
+}
+
+static void conn_finish_send(Worker *w, Conn *c)
+{
+    const Options *options = w->options;
+    CounterSnap snap;
+    uint64_t before;
+    int err;
+
+    if (!options->use_shutdown) {
+        conn_close(w, c);
+        return;
+    }
+
+    counters_start(&snap);
+    before = timestamp();
+    timeline_mark(c->tl, shutdown, before);
+    err = shutdown(c->fd, SHUT_WR) == -1 ? errno : 0;
+    c->eof_wait_start = timestamp();
+    counters_stop(&snap, &w->stats.timings.shutdown_counts);
+    trace_event(TEV_SHUTDOWN, c->fd, before, c->eof_wait_start, 0, err);
+    if (err != 0) {
+        if (err == EWOULDBLOCK) {
+            w->stats.shutdown_wouldblock++;
+        } else if (err == ENOTCONN) {
+            w->stats.shutdown_errors++;     /* Reset by peer */
+            conn_close(w, c);
+            return;
+        } else {
+            die("shutdown connfd");
+        }
+    }
+    hist_record(&w->stats.timings.shutdown, c->eof_wait_start - before);
+    if (options->linger_sock == OPT_CSOCK_LATE)
+        apply_linger(c->fd, options->linger_time);
+
+    c->state = CONN_EOF_WAIT;
+    set_events(w, c, EPOLLIN | EPOLLRDHUP);
+    if (options->shutdown_time > 0)
+        wheel_add(&w->wheel, &c->deadline,
+                  c->eof_wait_start + options->shutdown_time * NSECS_PER_SEC);
+}
+
+/* The payload is all sent, or with -D the stream has been cut */
+static void conn_sent(Worker *w, Conn *c)
+{
+    wheel_cancel(&w->wheel, &c->stream_end);
+    timeline_mark(c->tl, write_done, c->snd.stopped);
+    stream_done(&c->snd, &w->stats.timings);
+    if (c->snd.cut)
+        w->stats.streams_cut++;
+    conn_finish_send(w, c);
+}
+
+static void conn_stream_end(void *owner, void *data)
+{
+    Conn *c = data;
+
+    c->snd.cut = TRUE;
+    c->snd.stopped = timestamp();
+    conn_sent(owner, c);
+}
+
+static void conn_send(Worker *w, Conn *c)
+{
+    CounterSnap snap;
+    Boolean first;
+    int r;
+
+    first = c->snd.started == 0;
+    if (first)
+        timeline_mark(c->tl, write, timestamp());
+    counters_start(&snap);
+    r = sender_push(&c->snd, c->fd, w->payload, &w->stats.timings.write);
+    counters_stop(&snap, &w->stats.timings.write_counts);
+    switch (r) {
+    case SEND_BLOCKED:
+        set_events(w, c, c->snd.wait_events == POLLOUT ? EPOLLOUT : 0);
+        if (first && c->snd.duration > 0)
+            wheel_add(&w->wheel, &c->stream_end,
+                      c->snd.started + c->snd.duration);
+        break;
+    case SEND_ERROR:
+        w->stats.write_errors++;
+        conn_close(w, c);
+        break;
+    default:
+        conn_sent(w, c);
+        break;
+    }
+}
+
+static void conn_read_eof(Worker *w, Conn *c)
+{
+    uint64_t now;
+    ssize_t n;
+    char ch;
+
+    n = recv(c->fd, &ch, 1, MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINTR))
+        return;
+    now = timestamp();
+    trace_event(TEV_EOF, c->fd, c->eof_wait_start, now, n > 0 ? n : 0,
+                n == -1 ? errno : 0);
+    if (n == 0)
+        hist_record(&w->stats.timings.eof, now - c->eof_wait_start);
+    else
+        w->stats.eof_errors++;      /* Error, or illegal data from peer */
+    conn_close(w, c);
+}
+
+static void conn_read_ready(Worker *w, Conn *c)
+{
+    ssize_t n;
+    char ch;
+
+    n = recv(c->fd, &ch, 1, MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINTR))
+        return;
+    if (n != 1 || ch != READY_BYTE) {
+        w->stats.ready_errors++;
+        conn_close(w, c);
+        return;
+    }
+    c->state = CONN_SEND;
+    conn_send(w, c);
+}
+
+static void stop_accepting(Worker *w)
+{
+    if (!w->accepting)
+        return;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->listenfd, NULL) == -1)
+        die("epoll_ctl() EPOLL_CTL_DEL");
+    w->accepting = FALSE;
+}
+
+static void accept_conns(Worker *w)
+{
+    const Options *options = w->options;
+    struct epoll_event ev;
+    uint64_t before, after;
+    long total;
+    Conn *c;
+    int fd;
+
+    while (w->accepting && !stop_requested) {
+        before = timestamp();
+        fd = accept4(w->listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            die("accept4()");
+        }
+        after = timestamp();
+
+        /* With -R, several workers can be inside accept4() when the
+           -n'th connection arrives: any beyond it are closed uncounted */
+        if (options->max_conns > 0) {
+            total = __atomic_add_fetch(&accepted_total, 1, __ATOMIC_RELAXED);
+            if (total >= options->max_conns) {
+                stop_accepting(w);
+                request_stop();
+            }
+            if (total > options->max_conns) {
+                close(fd);
+                return;
+            }
+        }
+
+        trace_event(TEV_ACCEPT, fd, before, after, 0, 0);
+        if (w->stats.accepted++ == 0)
+            w->first_accept = timestamp();
+
+        if (options->linger_sock == OPT_CSOCK)
+            apply_linger(fd, options->linger_time);
+
+        c = calloc(1, sizeof(Conn));
+        if (c == NULL)
+            fatal("out of memory");
+        c->fd = fd;
+        c->tl = timeline_accept(fd, after);
+        c->state = options->fast ? CONN_READY_WAIT : CONN_SEND;
+        timer_init(&c->deadline, conn_eof_timeout, w, c);
+        timer_init(&c->stream_end, conn_stream_end, w, c);
+        sender_init(&c->snd, options);
+        if (options->backend == BACKEND_ZEROCOPY)
+            enable_zerocopy(fd);
+        w->active++;
+
+        ev.events = options->fast ? EPOLLIN : 0;
+        ev.data.ptr = c;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            die("epoll_ctl() EPOLL_CTL_ADD");
+        if (c->state == CONN_SEND)
+            conn_send(w, c);
+    }
+}
+
+static int next_timeout(const Worker *w)
+{
+    int timeout;
+
+    timeout = wheel_timeout(&w->wheel, timestamp());
+    if (w->closer != NULL)
+        timeout = min_timeout(timeout, closer_timeout(w->closer));
+    return timeout;
+}
+
+static void print_stats(const Worker *w)
+{
+    const Stats *stats = &w->stats;
+    double elapsed;
+
+    elapsed = stats->closed ? time_diff(w->first_accept, w->last_close) : 0;
+    printf("Connections: %ld\n", stats->closed);
+    printf("Elapsed (secs): %.3f\n", elapsed);
+    printf("Connections/sec: %.1f\n",
+           elapsed > 0 ? stats->closed / elapsed : 0.0);
+    if (w->options->fast)
+        printf("Bad ready signals: %ld\n", stats->ready_errors);
+    printf("Bytes sent: %llu\n", stats->bytes_sent);
+    printf("Write calls: %ld (EWOULDBLOCK: %ld)\n", stats->write_calls,
+           stats->write_blocked);
+    if (w->options->backend == BACKEND_ZEROCOPY)
+        printf("Zerocopy sends: %llu (completed: %llu, copied: %llu)\n",
+               stats->zc_sent, stats->zc_done, stats->zc_copied);
+    printf("Write errors: %ld\n", stats->write_errors);
+    if (w->options->stream_msecs > 0)
+        printf("Streams cut by -D: %ld\n", stats->streams_cut);
+    if (w->options->use_shutdown) {
+        printf("EWOULDBLOCK on shutdown(): %ld\n", stats->shutdown_wouldblock);
+        printf("Errors on shutdown(): %ld\n", stats->shutdown_errors);
+        printf("Timeouts waiting for EOF: %ld\n", stats->eof_timeouts);
+        printf("Errors waiting for EOF: %ld\n", stats->eof_errors);
+    }
+    printf("EWOULDBLOCK on close(): %ld\n", stats->close_wouldblock);
+    print_timings(&stats->timings);
+    if (w->closer != NULL)
+        closer_print(w->closer);
+}
+
+static void worker_init(Worker *w, int listenfd, const Payload *payload,
+                        const Options *options)
+{
+    struct epoll_event ev;
+
+    w->options = options;
+    w->listenfd = listenfd;
+    w->payload = payload;
+    wheel_init(&w->wheel, timestamp());
+
+    set_nonblocking(listenfd);
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd == -1)
+        die("epoll_create1()");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1)
+        die("epoll_ctl() EPOLL_CTL_ADD");
+    w->accepting = TRUE;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &stop_fd;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, stop_fd, &ev) == -1)
+        die("epoll_ctl() EPOLL_CTL_ADD");
+
+    /* The close engine's own epoll instance is nested in ours */
+    if (options->linger_sock == OPT_DEFERRED) {
+        w->closer = calloc(1, sizeof(Closer));
+        if (w->closer == NULL)
+            fatal("out of memory");
+        closer_init(w->closer, options->linger_time,
+                    options->adaptive_budget, &w->wheel);
+        ev.events = EPOLLIN;
+        ev.data.ptr = w->closer;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->closer->epfd, &ev) == -1)
+            die("epoll_ctl() EPOLL_CTL_ADD");
+    }
+}
+
+static void worker_free(Worker *w)
+{
+    close(w->epfd);
+    if (w->closer != NULL) {
+        closer_free(w->closer);
+        free(w->closer);
+    }
+}
+
+static void worker_loop(Worker *w)
+{
+    struct epoll_event events[MAX_EVENTS];
+    Conn *c;
+    int i, n;
+
+    for (;;) {
+        if (stop_requested)
+            stop_accepting(w);
+        if (!w->accepting && w->active == 0 &&
+            (w->closer == NULL || w->closer->active == 0))
+            break;
+
+        n = epoll_pwait(w->epfd, events, MAX_EVENTS, next_timeout(w),
+                        w->wait_mask);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            die("epoll_pwait()");
+        }
+
+        for (i = 0; i < n; i++) {
+            c = events[i].data.ptr;
+            if (c == NULL) {
+                accept_conns(w);
+                continue;
+            }
+            if ((void *) c == w->closer) {
+                closer_run(w->closer);
+                continue;
+            }
+            if ((void *) c == &stop_fd) {
+                /* It stays readable, so it has done its job once seen */
+                if (epoll_ctl(w->epfd, EPOLL_CTL_DEL, stop_fd, NULL) == -1)
+                    die("epoll_ctl() EPOLL_CTL_DEL");
+                continue;
+            }
+            if (c->snd.backend == BACKEND_ZEROCOPY)
+                drain_zerocopy(&c->snd, c->fd);
+            if (c->state == CONN_READY_WAIT) {
+                conn_read_ready(w, c);
+            } else if (c->state == CONN_SEND) {
+                conn_send(w, c);
+            } else {
+                conn_read_eof(w, c);
+            }
+        }
+        wheel_expire(&w->wheel, timestamp());
+        if (w->closer != NULL && closer_timeout(w->closer) == 0)
+            closer_run(w->closer);
+    }
+    /* Connections are only done with once the engine has closed them */
+    if (w->closer != NULL && w->stats.closed > 0)
+        w->last_close = timestamp();
+}
+
+/* -R: the CPU for worker n, counting round the CPUs we may run on */
+static int worker_cpu(int n)
+{
+    cpu_set_t set;
+    int cpu;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == -1)
+        die("sched_getaffinity()");
+    n %= CPU_COUNT(&set);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set) && n-- == 0)
+            break;
+    return cpu;
+}
+
+static void *worker_thread(void *arg)
+{
+    Worker *w = arg;
+    cpu_set_t set;
+    int r;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (r != 0) {
+        errno = r;
+        die("pthread_setaffinity_np()");
+    }
+    trace_attach();
+    counters_attach();
+    worker_loop(w);
+    return NULL;
+}
+
+static void stats_merge(Stats *into, const Stats *from)
+{
+    into->accepted += from->accepted;
+    into->closed += from->closed;
+    into->ready_errors += from->ready_errors;
+    into->write_errors += from->write_errors;
+    into->shutdown_wouldblock += from->shutdown_wouldblock;
+    into->shutdown_errors += from->shutdown_errors;
+    into->eof_timeouts += from->eof_timeouts;
+    into->eof_errors += from->eof_errors;
+    into->close_wouldblock += from->close_wouldblock;
+    into->bytes_sent += from->bytes_sent;
+    into->write_calls += from->write_calls;
+    into->write_blocked += from->write_blocked;
+    into->zc_sent += from->zc_sent;
+    into->zc_done += from->zc_done;
+    into->zc_copied += from->zc_copied;
+    hist_merge(&into->timings.write, &from->timings.write);
+    hist_merge(&into->timings.shutdown, &from->timings.shutdown);
+    hist_merge(&into->timings.eof, &from->timings.eof);
+    hist_merge(&into->timings.close, &from->timings.close);
+    counts_merge(&into->timings.write_counts, &from->timings.write_counts);
+    counts_merge(&into->timings.shutdown_counts,
+                 &from->timings.shutdown_counts);
+    counts_merge(&into->timings.close_counts, &from->timings.close_counts);
+    adaptive_merge(&into->timings.adaptive, &from->timings.adaptive);
+    hist_merge(&into->timings.sock_mem, &from->timings.sock_mem);
+    hist_merge(&into->timings.sock_reclaimed, &from->timings.sock_reclaimed);
+    hist_merge(&into->timings.stream_rate, &from->timings.stream_rate);
+    hist_merge(&into->timings.unacked, &from->timings.unacked);
+    hist_merge(&into->timings.unsent, &from->timings.unsent);
+    into->streams_cut += from->streams_cut;
+}
+
+static void closer_merge(Closer *into, const Closer *from)
+{
+    into->on_eof += from->on_eof;
+    into->on_drain += from->on_drain;
+    into->aborted += from->aborted;
+    into->errors += from->errors;
+    hist_merge(&into->graceful, &from->graceful);
+    adaptive_merge(&into->adaptive, &from->adaptive);
+}
+
+/* One line per worker, to show whether any of them fell behind - if one
+ * CPU is stuck in lingering close() calls, the others should keep up */
+static void print_worker(int n, const Worker *w)
+{
+    const Stats *stats = &w->stats;
+    double elapsed;
+
+    elapsed = stats->closed ? time_diff(w->first_accept, w->last_close) : 0;
+    printf("Worker %d (CPU %d): %ld connections, %.1f/sec, close() p99 "
+           "%.3f usecs, max %.3f usecs\n", n, w->cpu, stats->closed,
+           elapsed > 0 ? stats->closed / elapsed : 0.0,
+           hist_percentile(&stats->timings.close, 99) / 1000.0,
+           stats->timings.close.max / 1000.0);
+}
+
+/* Run the -R workers and merge their results into total */
+static void run_workers(Worker *workers, int nworkers, Worker *total)
+{
+    int i, r;
+
+    for (i = 0; i < nworkers; i++) {
+        r = pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+        if (r != 0) {
+            errno = r;
+            die("pthread_create()");
+        }
+    }
+    for (i = 0; i < nworkers; i++) {
+        r = pthread_join(workers[i].tid, NULL);
+        if (r != 0) {
+            errno = r;
+            die("pthread_join()");
+        }
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        print_worker(i, &workers[i]);
+        stats_merge(&total->stats, &workers[i].stats);
+        if (workers[i].closer != NULL)
+            closer_merge(total->closer, workers[i].closer);
+        if (workers[i].stats.closed == 0)
+            continue;
+        if (total->first_accept == 0 ||
+            workers[i].first_accept < total->first_accept)
+            total->first_accept = workers[i].first_accept;
+        if (workers[i].last_close > total->last_close)
+            total->last_close = workers[i].last_close;
+    }
+}
+
+static void run_event_loop(int listenfd, const Payload *payload,
+                           const Options *options)
+{
+    Worker *workers, *total;
+    struct sigaction sa;
+    sigset_t block_mask, wait_mask;
+    int i, nworkers;
+
+    nworkers = options->threads > 0 ? options->threads : 1;
+    workers = calloc(nworkers, sizeof(Worker));
+    total = calloc(1, sizeof(Worker));
+    if (workers == NULL || total == NULL)
+        fatal("out of memory");
+
+    if (options->linger_sock == OPT_CSOCK) {
+        printf("Linger timeout (secs): %d\n", options->linger_time);
+        puts("Linger: on (connected socket)");
+    }
+    if (options->linger_sock == OPT_DEFERRED)
+        printf("Deferred close deadline (secs): %d\n", options->linger_time);
+    if (options->nonblocking)
+        puts("Non-Blocking Socket");
+
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd == -1)
+        die("eventfd()");
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1 ||
+        sigaction(SIGTERM, &sa, NULL) == -1)
+        die("sigaction()");
+
+    /* The stop signals are only delivered inside epoll_pwait(), so a stop
+     * request can't slip in between checking the flag and sleeping. With
+     * -R the workers inherit the mask, and whichever of them takes the
+     * signal wakes the rest through stop_fd. */
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &block_mask, &wait_mask) == -1)
+        die("sigprocmask()");
+
+    for (i = 0; i < nworkers; i++) {
+        worker_init(&workers[i], i == 0 ? listenfd : bind_listener(options),
+                    payload, options);
+        workers[i].wait_mask = &wait_mask;
+    }
+    total->options = options;
+    if (workers[0].closer != NULL) {
+        total->closer = calloc(1, sizeof(Closer));
+        if (total->closer == NULL)
+            fatal("out of memory");
+    }
+
+    puts("-- waiting for client connections");
+    if (options->threads > 0) {
+        for (i = 0; i < nworkers; i++) {
+            workers[i].cpu = worker_cpu(i);
+            printf("Worker %d: CPU %d\n", i, workers[i].cpu);
+        }
+        run_workers(workers, nworkers, total);
+    } else {
+        worker_loop(&workers[0]);
+        memcpy(total, &workers[0], sizeof(Worker));
+    }
+
+    puts("-- closing listening socket");
+    for (i = 0; i < nworkers; i++)
+        if (close(workers[i].listenfd) == -1)
+            die("closing listenfd");
+
+    print_stats(total);
+    for (i = 0; i < nworkers; i++)
+        worker_free(&workers[i]);
+    if (options->threads > 0)
+        free(total->closer);
+    free(total);
+    free(workers);
+    close(stop_fd);
+    stop_fd = -1;
+}
+
+/* io_uring mode: the same lifecycle as the event loop, but each connection
+ * is handed to the kernel as one chain of linked requests - send, shutdown,
+ * EOF read (bounded by a linked timeout with -T) and close - so that no
+ * step runs on this thread. The links are hard links: a failed step does
+ * not cancel the rest of the chain, which guarantees that the close always
+ * runs. The time spent inside io_uring_enter() is reported too, as that is
+ * where any lingering close() that the kernel defers to this thread ends
+ * up - along with the time spent idle waiting for completions. Each
+ * completion is timed from the completion of the step before it (or from
+ * submission for the first step), so the step latencies include however
+ * long the loop took to reap them.
+ *
+ * liburing is not needed: the ring is set up and driven with the raw
+ * syscalls.
+ */
+
+#define STEP_READY 0
+#define STEP_SEND 1
+#define STEP_SHUTDOWN 2
+#define STEP_EOF 3
+#define STEP_TIMEOUT 4
+#define STEP_CLOSE 5
+#define STEP_ACCEPT 6
+#define STEP_CANCEL 7
+#define STEP_MASK 7
+
+typedef struct {
+    int fd;
+    int pending;                /* Requests still to complete */
+    uint64_t submitted;         /* When the chain was queued */
+    uint64_t step_start;        /* When the previous step completed */
+    char ch;                    /* Ready byte, or data instead of EOF */
+} RingConn;
+
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    Boolean accept_armed;
+    Boolean cancel_pending;
+    struct __kernel_timespec eof_timeout;
+    Histogram enter;            /* Time spent inside io_uring_enter() */
+    Histogram chain;            /* Submission to close() completion */
+} Ring;
+
+static void ring_setup(Ring *r)
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq_ptr, *cq_ptr;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = (int) syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (r->fd == -1)
+        die("io_uring_setup()");
+    if (!(p.features & IORING_FEAT_NODROP))
+        fatal("io_uring: kernel may drop completions (IORING_FEAT_NODROP)");
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size)
+        sq_size = cq_size;
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        die("mmap() SQ ring");
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            die("mmap() CQ ring");
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        die("mmap() SQEs");
+
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned *) (sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *) (sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+}
+
+/* Submit what has been queued and, if wait_mask is not NULL, sleep until
+ * at least one completion is ready. The stop signals are only let in while
+ * sleeping, as with epoll_pwait() in the event loop. */
+static void ring_enter(Ring *r, const sigset_t *wait_mask)
+{
+    unsigned flags = wait_mask != NULL ? IORING_ENTER_GETEVENTS : 0;
+    uint64_t before;
+    int n;
+
+    before = timestamp();
+    n = (int) syscall(__NR_io_uring_enter, r->fd, r->to_submit,
+                      wait_mask != NULL ? 1 : 0, flags, wait_mask, _NSIG / 8);
+    hist_record(&r->enter, timestamp() - before);
+    if (n == -1) {
+        /* EBUSY: completions have overflowed, and must be reaped first */
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            return;
+        die("io_uring_enter()");
+    }
+    r->to_submit -= n;
+}
+
+/* Make sure that a whole chain of count requests fits in the SQ ring, since
+ * a chain split over two submissions would lose its links */
+static void ring_reserve(Ring *r, unsigned count)
+{
+    while (*r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) +
+           count > r->sq_entries)
+        ring_enter(r, NULL);
+}
+
+static struct io_uring_sqe *ring_sqe(Ring *r, int op, int fd, void *conn,
+                                     int step, unsigned flags)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *r->sq_tail, index = tail & *r->sq_mask;
+
+    sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->flags = flags;
+    sqe->user_data = (uint64_t) (uintptr_t) conn | step;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+    return sqe;
+}
+
+static void ring_arm_accept(Worker *w, Ring *r)
+{
+    struct io_uring_sqe *sqe;
+
+    ring_reserve(r, 1);
+    sqe = ring_sqe(r, IORING_OP_ACCEPT, w->listenfd, NULL, STEP_ACCEPT, 0);
+    sqe->accept_flags = w->options->nonblocking ? SOCK_NONBLOCK : 0;
+    r->accept_armed = TRUE;
+}
+
+static void ring_stop_accepting(Worker *w, Ring *r)
+{
+    struct io_uring_sqe *sqe;
+
+    w->accepting = FALSE;
+    if (!r->accept_armed)
+        return;
+    ring_reserve(r, 1);
+    sqe = ring_sqe(r, IORING_OP_ASYNC_CANCEL, -1, NULL, STEP_CANCEL, 0);
+    sqe->addr = STEP_ACCEPT;
+    r->cancel_pending = TRUE;
+}
+
+/* Number of requests queued by ring_queue_eof_close() */
+static unsigned eof_close_count(const Options *options)
+{
+    if (!options->use_shutdown)
+        return 1;
+    return options->shutdown_time > 0 ? 3 : 2;
+}
+
+/* Queue the EOF read and the close, which end every chain. The caller
+ * reserves room for them. */
+static void ring_queue_eof_close(Worker *w, Ring *r, RingConn *c)
+{
+    const Options *options = w->options;
+    struct io_uring_sqe *sqe;
+
+    if (options->use_shutdown) {
+        sqe = ring_sqe(r, IORING_OP_RECV, c->fd, c, STEP_EOF,
+                       IOSQE_IO_HARDLINK);
+        sqe->addr = (uint64_t) (uintptr_t) &c->ch;
+        sqe->len = 1;
+        c->pending++;
+        if (options->shutdown_time > 0) {
+            sqe = ring_sqe(r, IORING_OP_LINK_TIMEOUT, -1, c, STEP_TIMEOUT,
+                           IOSQE_IO_HARDLINK);
+            sqe->addr = (uint64_t) (uintptr_t) &r->eof_timeout;
+            sqe->len = 1;
+            c->pending++;
+        }
+    }
+    ring_sqe(r, IORING_OP_CLOSE, c->fd, c, STEP_CLOSE, 0);
+    c->pending++;
+}
+
+/* csock_late needs a setsockopt() between shutdown and the EOF read, and
+ * a linked timeout is only armed when the request it guards heads a chain
+ * (the kernel never fired one placed after a shutdown), so either breaks
+ * the chain in two at the EOF read */
+static Boolean split_chain(const Options *options)
+{
+    return options->use_shutdown &&
+           (options->linger_sock == OPT_CSOCK_LATE ||
+            options->shutdown_time > 0);
+}
+
+static void ring_queue_chain(Worker *w, Ring *r, RingConn *c)
+{
+    const Options *options = w->options;
+    struct io_uring_sqe *sqe;
+    Boolean split = split_chain(options);
+
+    ring_reserve(r, 1 + options->use_shutdown +
+                    (split ? 0 : eof_close_count(options)));
+    c->submitted = c->step_start = timestamp();
+
+    sqe = ring_sqe(r, IORING_OP_SEND, c->fd, c, STEP_SEND, IOSQE_IO_HARDLINK);
+    sqe->addr = (uint64_t) (uintptr_t) w->payload->buf;
+    sqe->len = (uint32_t) w->payload->size;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    c->pending++;
+    if (options->use_shutdown) {
+        sqe = ring_sqe(r, IORING_OP_SHUTDOWN, c->fd, c, STEP_SHUTDOWN,
+                       split ? 0 : IOSQE_IO_HARDLINK);
+        sqe->len = SHUT_WR;
+        c->pending++;
+    }
+    if (!split)
+        ring_queue_eof_close(w, r, c);
+}
+
+static void ring_queue_close(Ring *r, RingConn *c)
+{
+    ring_reserve(r, 1);
+    ring_sqe(r, IORING_OP_CLOSE, c->fd, c, STEP_CLOSE, 0);
+    c->pending++;
+}
+
+static void ring_accepted(Worker *w, Ring *r, int res)
+{
+    const Options *options = w->options;
+    struct io_uring_sqe *sqe;
+    RingConn *c;
+    uint64_t now;
+
+    r->accept_armed = FALSE;
+    if (res < 0) {
+        if (res != -ECANCELED && res != -EINTR && res != -ECONNABORTED) {
+            errno = -res;
+            die("io_uring accept");
+        }
+    } else {
+        now = timestamp();
+        trace_event(TEV_ACCEPT, res, now, now, 0, 0);
+        if (w->stats.accepted++ == 0)
+            w->first_accept = now;
+        if (options->max_conns > 0 &&
+            w->stats.accepted == options->max_conns)
+            w->accepting = FALSE;
+        if (options->linger_sock == OPT_CSOCK)
+            apply_linger(res, options->linger_time);
+
+        c = calloc(1, sizeof(RingConn));
+        if (c == NULL)
+            fatal("out of memory");
+        c->fd = res;
+        w->active++;
+
+        if (options->fast) {
+            ring_reserve(r, 1);
+            sqe = ring_sqe(r, IORING_OP_RECV, c->fd, c, STEP_READY, 0);
+            sqe->addr = (uint64_t) (uintptr_t) &c->ch;
+            sqe->len = 1;
+            c->pending++;
+        } else {
+            ring_queue_chain(w, r, c);
+        }
+    }
+    if (w->accepting)
+        ring_arm_accept(w, r);
+}
+
+static void ring_complete(Worker *w, Ring *r, RingConn *c, int step, int res)
+{
+    const Options *options = w->options;
+    uint64_t now = timestamp();
+    Stats *stats = &w->stats;
+
+    c->pending--;
+    switch (step) {
+    case STEP_READY:
+        if (res != 1 || c->ch != READY_BYTE) {
+            stats->ready_errors++;
+            ring_queue_close(r, c);
+        } else {
+            ring_queue_chain(w, r, c);
+        }
+        return;
+    case STEP_SEND:
+        trace_event(TEV_WRITE, c->fd, c->step_start, now, res > 0 ? res : 0,
+                    res < 0 ? -res : 0);
+        hist_record(&stats->timings.write, now - c->step_start);
+        stats->write_calls++;
+        if (res > 0)
+            stats->bytes_sent += res;
+        if (res != (int) w->payload->size)
+            stats->write_errors++;
+        break;
+    case STEP_SHUTDOWN:
+        trace_event(TEV_SHUTDOWN, c->fd, c->step_start, now, 0,
+                    res < 0 ? -res : 0);
+        hist_record(&stats->timings.shutdown, now - c->step_start);
+        if (res < 0)
+            stats->shutdown_errors++;
+        if (split_chain(options)) {
+            if (options->linger_sock == OPT_CSOCK_LATE)
+                apply_linger(c->fd, options->linger_time);
+            c->step_start = now;
+            ring_reserve(r, eof_close_count(options));
+            ring_queue_eof_close(w, r, c);
+            return;
+        }
+        break;
+    case STEP_EOF:
+        trace_event(TEV_EOF, c->fd, c->step_start, now, res > 0 ? res : 0,
+                    res == -ECANCELED ? ETIMEDOUT : res < 0 ? -res : 0);
+        if (res == 0)
+            hist_record(&stats->timings.eof, now - c->step_start);
+        else if (res == -ECANCELED && options->shutdown_time > 0)
+            stats->eof_timeouts++;
+        else
+            stats->eof_errors++;    /* Error, or illegal data from peer */
+        break;
+    case STEP_TIMEOUT:
+        goto done;                  /* Not a step of its own */
+    case STEP_CLOSE:
+        trace_event(TEV_CLOSE, c->fd, c->step_start, now, CLOSE_NOW,
+                    res < 0 ? -res : 0);
+        hist_record(&stats->timings.close, now - c->step_start);
+        hist_record(&r->chain, now - c->submitted);
+        if (res == -EWOULDBLOCK) {
+            stats->close_wouldblock++;
+        } else if (res < 0) {
+            errno = -res;
+            die("closing connfd");
+        }
+        stats->closed++;
+        w->last_close = now;
+        w->active--;
+        break;
+    }
+    c->step_start = now;
+
+done:
+    if (c->pending == 0)
+        free(c);
+}
+
+static void ring_reap(Worker *w, Ring *r)
+{
+    unsigned head, tail;
+    struct io_uring_cqe *cqe;
+    uint64_t data;
+
+    head = *r->cq_head;
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        cqe = &r->cqes[head & *r->cq_mask];
+        data = cqe->user_data;
+        if ((data & STEP_MASK) == STEP_ACCEPT)
+            ring_accepted(w, r, cqe->res);
+        else if ((data & STEP_MASK) == STEP_CANCEL)
+            r->cancel_pending = FALSE;
+        else
+            ring_complete(w, r, (RingConn *) (uintptr_t) (data & ~STEP_MASK),
+                          (int) (data & STEP_MASK), cqe->res);
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void run_uring(int listenfd, const Payload *payload,
+                      const Options *options)
+{
+    Worker *w;
+    Ring *r;
+    struct sigaction sa;
+    sigset_t block_mask, wait_mask;
+
+    w = calloc(1, sizeof(Worker));
+    r = calloc(1, sizeof(Ring));
+    if (w == NULL || r == NULL)
+        fatal("out of memory");
+    w->options = options;
+    w->listenfd = listenfd;
+    w->payload = payload;
+    w->epfd = -1;
+    r->eof_timeout.tv_sec = options->shutdown_time;
+
+    if (options->linger_sock == OPT_CSOCK) {
+        printf("Linger timeout (secs): %d\n", options->linger_time);
+        puts("Linger: on (connected socket)");
+    }
+    if (options->nonblocking)
+        puts("Non-Blocking Socket");
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGINT, &sa, NULL) == -1 ||
+        sigaction(SIGTERM, &sa, NULL) == -1)
+        die("sigaction()");
+
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &block_mask, &wait_mask) == -1)
+        die("sigprocmask()");
+
+    ring_setup(r);
+    w->accepting = TRUE;
+    ring_arm_accept(w, r);
+
+    puts("-- waiting for client connections");
+    for (;;) {
+        if (stop_requested && w->accepting)
+            ring_stop_accepting(w, r);
+        if (!w->accepting && !r->accept_armed && !r->cancel_pending &&
+            w->active == 0)
+            break;
+
+        ring_enter(r, &wait_mask);
+        ring_reap(w, r);
+    }
+
+    puts("-- closing listening socket");
+    if (close(listenfd) == -1)
+        die("closing listenfd");
+    close(r->fd);
+
+    print_stats(w);
+    hist_print("Time in io_uring_enter()", &r->enter);
+    hist_print("Time from submit to close()", &r->chain);
+    free(r);
+    free(w);
+}
+
+#endif /* __linux__ */
+
+/* In fast mode the client tells us when it is ready to receive by sending a
+ * single byte back up the connection. This replaces the fixed sleep(1). */
+static void wait_client_ready(int connfd)
+{
+    struct pollfd pfds[1];
+    ssize_t n;
+    char c;
+
+    puts("-- waiting for client to be ready");
+#ifdef __linux__
+    if (deferred_closer != NULL)
+        closer_wait(deferred_closer, connfd, POLLIN, -1);
+#endif
+    pfds[0].fd = connfd;
+    pfds[0].events = POLLIN;
+    if (poll(pfds, 1, -1) == -1)
+        die("poll()");
+
+    n = read(connfd, &c, 1);
+    if (n == -1)
+        die("read() waiting for client");
+    if (n == 0 || c != READY_BYTE)
+        fatal("Bad ready signal from client");
+}
+
+/* Send the whole payload, or with -D as much as its time allows, waiting
+ * for the socket whenever it is non-blocking and full */
+static void send_payload(int connfd, const Payload *payload, Sender *snd)
+{
+    struct pollfd pfds[1];
+
+    for (;;) {
+        switch (sender_push(snd, connfd, payload, NULL)) {
+        case SEND_DONE:
+            return;
+        case SEND_ERROR:
+            die("write");
+        }
+#ifdef __linux__
+        if (deferred_closer != NULL) {
+            closer_wait(deferred_closer, connfd, snd->wait_events,
+                        sender_timeout(snd));
+            continue;
+        }
+#endif
+        pfds[0].fd = connfd;
+        pfds[0].events = snd->wait_events;
+        if (poll(pfds, 1, sender_timeout(snd)) == -1 && errno != EINTR)
+            die("poll()");
+    }
+}
+
+static void serve_conn(int listenfd, const Payload *payload,
+                       const Options *options, Timings *timings,
+                       long conn, Boolean last)
+{
+    int connfd, r, err, how;
+    uint64_t before, after;
+    TimelineSlot *tl;
+    CounterSnap snap;
+    Sender snd;
+#ifdef __linux__
+    DrainPlan plan;
+    uint64_t mem_before, mem_after;
+    int unacked, unsent;
+#endif
+
+    puts("-- waiting for client connection");
+#ifdef __linux__
+    if (deferred_closer != NULL)
+        closer_wait(deferred_closer, listenfd, POLLIN, -1);
+#endif
+    before = timestamp();
+    connfd = accept(listenfd, (struct sockaddr *) NULL, NULL);
+    if (connfd == -1)
+        die("accept()");
+    after = timestamp();
+    trace_event(TEV_ACCEPT, connfd, before, after, 0, 0);
+    tl = timeline_accept(connfd, after);
+    puts("-- client connected");
+    sampler_watch(connfd, conn);
+
+    if (options->nonblocking) {
+        set_nonblocking(connfd);
+        puts("Non-Blocking Socket");
+    }
+
+    /* Close the listening socket - we don't need it anymore */
+    if (last) {
+        puts("-- closing listening socket");
+        r = close(listenfd);
+        if (r == -1)
+            die("closing listenfd");
+    }
+
+    if (options->linger_sock == OPT_CSOCK) {
+        set_linger(connfd, options->linger_time);
+        puts("Linger: on (connected socket)");
+    }
+    if (options->fast)
+        wait_client_ready(connfd);
+#ifdef __linux__
+    else if (deferred_closer != NULL)
+        closer_wait(deferred_closer, -1, 0, 1000);
+#endif
+    else
+        sleep(1);
+
+    sender_init(&snd, options);
+#ifdef __linux__
+    if (options->backend == BACKEND_ZEROCOPY)
+        enable_zerocopy(connfd);
+#endif
+
+    /* A blocking send() wouldn't return in time to cut the stream, nor
+     * let -s deferred get on with the connections it already has */
+    if ((options->stream_msecs > 0 ||
+         options->linger_sock == OPT_DEFERRED) &&
+        !options->nonblocking)
+        set_nonblocking(connfd);
+
+    puts("-- writing payload");
+    sampler_phase(PHASE_WRITE);
+    counters_start(&snap);
+    before = timestamp();
+    timeline_mark(tl, write, before);
+    send_payload(connfd, payload, &snd);
+    after = timestamp();
+    counters_stop(&snap, &timings->write_counts);
+    timeline_mark(tl, write_done, after);
+    hist_record(&timings->write, after - before);
+    printf("Time to write(): %.9f secs\n", time_diff(before, after));
+    print_snap(&snap);
+    printf("Bytes written: %zu\n", snd.sent);
+    if (snd.calls > 1)
+        printf("Write calls: %ld (EWOULDBLOCK: %ld)\n", snd.calls,
+               snd.blocked);
+#ifdef __linux__
+    if (options->stream_msecs > 0) {
+        stream_done(&snd, timings);
+        printf("Stream %s after %.3f secs at %.0f bytes/sec\n",
+               snd.cut ? "cut" : "ended",
+               time_diff(snd.started, snd.stopped),
+               snd.stopped == snd.started ? 0.0 :
+               snd.sent / time_diff(snd.started, snd.stopped));
+        if (!options->nonblocking)
+            clear_nonblocking(connfd);
+    }
+#endif
+
+    if (options->use_shutdown)
+        shutdown_wait_eof(connfd, options, timings, tl);
+
+#ifdef __linux__
+    if (snd.backend == BACKEND_ZEROCOPY)
+        drain_zerocopy(&snd, connfd);
+#endif
+
+#ifdef __linux__
+    if (options->stream_msecs > 0) {
+        stream_inflight(connfd, timings, &unacked, &unsent);
+        printf("In flight at close: %d bytes unacked, %d unsent\n",
+               unacked, unsent);
+    }
+    if (close_memory(connfd, options, timings, &mem_before, &mem_after)) {
+        if (options->shrink_sndbuf > 0)
+            printf("Socket memory: %llu bytes (after shrinking SO_SNDBUF: "
+                   "%llu)\n", (unsigned long long) mem_before,
+                   (unsigned long long) mem_after);
+        else
+            printf("Socket memory: %llu bytes\n",
+                   (unsigned long long) mem_before);
+    }
+    if (options->adaptive_budget > 0 && deferred_closer == NULL) {
+        adaptive_linger(connfd, options->adaptive_budget, &plan);
+        printf("Adaptive linger: %llu bytes unacked, %llu bytes/sec, "
+               "drain estimate %.6f secs, timeout %llu secs\n",
+               (unsigned long long) plan.outq,
+               (unsigned long long) plan.rate,
+               (double) plan.estimate / NSECS_PER_SEC,
+               (unsigned long long) (plan.timeout / NSECS_PER_SEC));
+    }
+#endif
+
+    puts("-- closing connected socket");
+    sampler_phase(PHASE_CLOSE);
+    how = CLOSE_NOW;
+    counters_start(&snap);
+    before = timestamp();
+#ifdef __linux__
+    if (deferred_closer != NULL) {
+        /* The engine needs O_NONBLOCK, whatever -N says */
+        set_nonblocking(connfd);
+        closer_add(deferred_closer, connfd, tl);
+        closer_run(deferred_closer);
+        wheel_expire(deferred_wheel, timestamp());
+        how = CLOSE_DEFERRED;
+        r = 0;
+    } else
+#endif
+    {
+        timeline_mark(tl, close, before);
+        r = close(connfd);
+    }
+    after = timestamp();
+    err = r == -1 ? errno : 0;
+    counters_stop(&snap, &timings->close_counts);
+    if (how == CLOSE_NOW)
+        timeline_mark(tl, closed, after);
+    trace_event(TEV_CLOSE, connfd, before, after, how, err);
+    if (r == -1) {
+        if (err == EWOULDBLOCK)
+            puts("EWOULDBLOCK on close()");
+        else
+            die("closing connfd");
+    }
+    sampler_phase(PHASE_CLOSED);
+    hist_record(&timings->close, after - before);
+    printf("Time to close(): %.9f secs\n", time_diff(before, after));
+    print_snap(&snap);
+#ifdef __linux__
+    if (options->adaptive_budget > 0 && how == CLOSE_NOW)
+        adaptive_account(&timings->adaptive, &plan,
+                         options->linger_time * NSECS_PER_SEC,
+                         after - before);
+#endif
+
+    /* Completions still outstanding at close() are never reaped */
+    if (snd.backend == BACKEND_ZEROCOPY)
+        printf("Zerocopy sends: %u (completed before close: %u, "
+               "copied: %u)\n", snd.zc_sent, snd.zc_done, snd.zc_copied);
+    sender_free(&snd);
+}
+
+int main(int argc, char *argv[])
+{
+    int listenfd;
+    long i, conns;
+    Options sopts, *options = &sopts;
+    Payload payload;
+    Timings *timings;
+
+    parse_opts(argc, argv, options);
+
+#ifdef __linux__
+    if (options->wheel_bench) {
+        wheel_bench();
+        exit(EXIT_SUCCESS);
+    }
+#endif
+
+    payload_create(&payload, options->payload_size);
+
+    listenfd = open_listener(options);
+    if (options->timeline_name != NULL)
+        timeline_create(options->timeline_name);
+
+#ifdef __linux__
+    if (options->trace_path != NULL)
+        trace_start(options->trace_path);
+    if (options->mem_interval > 0)
+        memwatch_start(options->mem_interval);
+    if (options->counters) {
+        counters_enabled = TRUE;
+        counters_attach();              /* The main thread */
+        for (i = 0; i < NUM_COUNTERS; i++)
+            if (counters->slot[i] < 0)
+                printf("Perf counter not available: %s\n", counter_names[i]);
+    }
+
+    if (options->event_loop) {
+        run_event_loop(listenfd, &payload, options);
+        trace_finish();
+        memwatch_finish(options);
+        exit(EXIT_SUCCESS);
+    }
+    if (options->uring) {
+        run_uring(listenfd, &payload, options);
+        trace_finish();
+        memwatch_finish(options);
+        exit(EXIT_SUCCESS);
+    }
+#endif
+
+    timings = calloc(1, sizeof(Timings));
+    if (timings == NULL)
+        fatal("out of memory");
+
+#ifdef __linux__
+    if (options->sample_hz > 0)
+        sampler_start(options->sample_hz);
+#endif
+
+#ifdef __linux__
+    if (options->linger_sock == OPT_DEFERRED) {
+        deferred_closer = calloc(1, sizeof(Closer));
+        if (deferred_closer == NULL)
+            fatal("out of memory");
+        deferred_wheel = malloc(sizeof(TimerWheel));
+        if (deferred_wheel == NULL)
+            fatal("out of memory");
+        wheel_init(deferred_wheel, timestamp());
+        closer_init(deferred_closer, options->linger_time,
+                    options->adaptive_budget, deferred_wheel);
+        printf("Deferred close deadline (secs): %d\n", options->linger_time);
+    }
+#endif
+
+    conns = options->max_conns > 0 ? options->max_conns : 1;
+    for (i = 0; i < conns; i++)
+        serve_conn(listenfd, &payload, options, timings, i, i == conns - 1);
+
+#ifdef __linux__
+    if (deferred_closer != NULL) {
+        puts("-- waiting for deferred closes");
+        closer_wait(deferred_closer, -1, 0, -1);
+        closer_print(deferred_closer);
+        closer_free(deferred_closer);
+        free(deferred_closer);
+        free(deferred_wheel);
+    }
+#endif
+
+    if (conns > 1) {
+        printf("-- %ld connections served\n", conns);
+        print_timings(timings);
+    } else {
+        adaptive_print(&timings->adaptive);
+    }
+    free(timings);
+    trace_finish();
+#ifdef __linux__
+    memwatch_finish(options);
+#endif
+    sampler_finish();
 
     if (options->wait_on_exit) {
         printf("Press RETURN to exit: ");
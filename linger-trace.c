@@ -0,0 +1,519 @@
+/* linger-trace.c converts the binary event trace that linger-server -X
+ * writes into Chrome trace JSON, which chrome://tracing and Perfetto
+ * (ui.perfetto.dev) load as they are. Each server thread becomes a track;
+ * every event with a duration is a slice on it and an EWOULDBLOCK is an
+ * instant. The fd, bytes and error of each event are in its args.
+ *
+ * With -t it instead prints the shared timeline that linger-server -M and
+ * linger-client -M fill in between them: one line per connection with both
+ * sides' events on the one clock, and the delay from the server's
+ * shutdown() or close() to the client seeing the FIN or RST. It is
+ * released under the same license as linger-server.c.
+ */
+/*************************************************************************\
+*                  Copyright (C) Nybek Limited, 2015.                     *
+*                                                                         *
+* This program is free software. You may use, modify, and redistribute it *
+* under the terms of the GNU Affero General Public License as published   *
+* by the Free Software Foundation, either version 3 or (at your option)   *
+* any later version. This program is distributed without any warranty.    *
+* See the file COPYING.agpl-v3 for details.                               *
+\************************************************************************/
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef TRUE
+#undef TRUE
+#endif
+
+#ifdef FALSE
+#undef FALSE
+#endif
+
+typedef enum { FALSE, TRUE } Boolean;
+
+#define printable(ch) (isprint((unsigned char) ch) ? ch : '#')
+
+/* The file layout, as written by linger-server.c */
+
+#define TRACE_MAGIC "LNGTRACE"
+#define TRACE_VERSION 1
+
+#define TEV_ACCEPT 1
+#define TEV_LINGER 2                    /* arg: linger secs */
+#define TEV_WRITE 3                     /* arg: bytes written */
+#define TEV_WOULDBLOCK 4                /* arg: the event it cut short */
+#define TEV_SHUTDOWN 5
+#define TEV_EOF 6                       /* arg: bytes read */
+#define TEV_CLOSE 7                     /* arg: CLOSE_NOW or CLOSE_DEFERRED */
+#define TEV_DROPPED 8                   /* arg: events lost */
+
+#define CLOSE_NOW 0
+#define CLOSE_DEFERRED 1                /* Handed to the close engine */
+
+typedef struct {
+    uint64_t time;                      /* timestamp() at the start */
+    uint64_t dur;                       /* 0 for an instant */
+    int64_t arg;
+    int32_t fd;
+    uint16_t thread;
+    uint8_t event;
+    uint8_t error;                      /* errno, or 0 */
+} TraceRecord;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t pid;
+    uint64_t start;                     /* timestamp() when tracing began */
+} TraceHeader;
+
+static const char *event_names[] = {
+    "?", "accept", "SO_LINGER", "write", "EWOULDBLOCK", "shutdown", "EOF",
+    "close", "dropped"
+};
+
+#define EVENT_COUNT (sizeof(event_names) / sizeof(char *))
+
+/* The shared timeline, as laid out by linger-server.c */
+
+#define TIMELINE_MAGIC "LNGTIME2"
+#define TIMELINE_SLOTS 65536            /* One per client port */
+
+#define EVENT_EOF 0                     /* linger-client's stream ends */
+#define EVENT_RESET 1
+
+/* CLOCK_MONOTONIC ns, 0 until it has happened */
+typedef struct {
+    uint64_t connect;                   /* Client: connect() called */
+    uint64_t first_byte;                /* ...first payload read */
+    uint64_t end;                       /* ...the read that ended it */
+    uint64_t end_event;                 /* ...its EVENT_* + 1 */
+    uint64_t hangup;                    /* ...FIN or RST seen to arrive */
+    uint64_t accept;                    /* Server: accept() returned */
+    uint64_t write;                     /* ...first write called */
+    uint64_t write_done;                /* ...last byte taken by the socket */
+    uint64_t shutdown;                  /* ...shutdown() called */
+    uint64_t close;                     /* ...close() called */
+    uint64_t closed;                    /* ...close() returned */
+} TimelineSlot;
+
+typedef struct {
+    char magic[8];
+    uint64_t start;                     /* When the server cleared it */
+    TimelineSlot slots[TIMELINE_SLOTS];
+} Timeline;
+
+static const char *end_names[] = { "", "EOF", "reset", "timeout", "error" };
+
+typedef struct {
+    const char *in_path;
+    const char *out_path;
+    const char *timeline_name;
+} Options;
+
+static void fatal(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static void die(const char *where)
+{
+    perror(where);
+    exit(EXIT_FAILURE);
+}
+
+static void usage_exit(const char *prog_name, const char *msg, int opt)
+{
+    if (msg != NULL && opt != 0)
+        fprintf(stderr, "%s (-%c)\n", msg, printable(opt));
+    else if (msg != NULL)
+        fprintf(stderr, "%s\n", msg);
+    fprintf(stderr, "Usage: %s [-o file] trace_file\n"
+                    "       %s [-o file] -t name\n", prog_name, prog_name);
+    fprintf(stderr,
+            "     -h             Print usage and exit.\n"
+            "     -o file        Write to file instead of stdout.\n"
+            "     -t name        Print the shared timeline name as CSV, then\n"
+            "                    the spread of the delay from the server's\n"
+            "                    shutdown() or close() to the client seeing\n"
+            "                    the FIN or RST.\n"
+            "\n"
+            "trace_file is what linger-server -X wrote. Timestamps in the\n"
+            "JSON are in microseconds since tracing began, and in the\n"
+            "timeline since the server started.\n");
+    exit(EXIT_FAILURE);
+}
+
+static void parse_opts(int argc, char *argv[], Options *options)
+{
+    int opt;
+    char *prog_name;
+
+    options->in_path = NULL;
+    options->out_path = NULL;
+    options->timeline_name = NULL;
+    prog_name = argv[0] ? argv[0] : "[prog_name]";
+
+    while ((opt = getopt(argc, argv, ":ho:t:")) != -1) {
+        switch (opt) {
+        case 'h':
+            usage_exit(prog_name, NULL, opt);
+            break;
+        case 'o':
+            options->out_path = optarg;
+            break;
+        case 't':
+            options->timeline_name = optarg;
+            break;
+        case ':':
+            usage_exit(prog_name, "Missing argument", optopt);
+            break;
+        case '?':
+            usage_exit(prog_name, "Unrecognised option", optopt);
+            break;
+        default:
+            fatal("Unexpected case in switch()");
+        }
+    }
+
+    if (options->timeline_name != NULL) {
+        if (optind != argc)
+            usage_exit(prog_name, "No trace file with -t", 0);
+        return;
+    }
+    if (optind != argc - 1)
+        usage_exit(prog_name, "Expected one trace file", 0);
+    options->in_path = argv[optind];
+}
+
+/* Read every record in. Each thread's events are in order in the file,
+ * but the writer interleaves the threads a batch at a time. */
+static TraceRecord *read_trace(FILE *in, TraceHeader *hdr, size_t *count)
+{
+    TraceRecord *recs = NULL, *grown;
+    size_t n = 0, cap = 0;
+
+    if (fread(hdr, sizeof(*hdr), 1, in) != 1 ||
+        memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0)
+        fatal("Not a linger-server trace file");
+    if (hdr->version != TRACE_VERSION)
+        fatal("Unsupported trace file version");
+
+    for (;;) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 4096;
+            grown = realloc(recs, cap * sizeof(TraceRecord));
+            if (grown == NULL)
+                fatal("out of memory");
+            recs = grown;
+        }
+        n += fread(recs + n, sizeof(TraceRecord), cap - n, in);
+        if (n < cap)
+            break;
+    }
+    if (ferror(in))
+        die("fread() trace file");
+    *count = n;
+    return recs;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const TraceRecord *x = a, *y = b;
+
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    /* An instant at the end of a slice comes after it */
+    if (x->dur != y->dur)
+        return x->dur > y->dur ? -1 : 1;
+    return 0;
+}
+
+/* Chrome trace timestamps are microseconds; keep the nanoseconds */
+static void print_usecs(FILE *out, uint64_t nsecs)
+{
+    fprintf(out, "%llu.%03u", (unsigned long long) (nsecs / 1000),
+            (unsigned) (nsecs % 1000));
+}
+
+static void print_args(FILE *out, const TraceRecord *rec)
+{
+    fprintf(out, "\"args\":{");
+    if (rec->event == TEV_DROPPED) {
+        fprintf(out, "\"events\":%lld}", (long long) rec->arg);
+        return;
+    }
+    fprintf(out, "\"fd\":%d", (int) rec->fd);
+    switch (rec->event) {
+    case TEV_LINGER:
+        fprintf(out, ",\"linger_secs\":%lld", (long long) rec->arg);
+        break;
+    case TEV_WRITE:
+    case TEV_EOF:
+        fprintf(out, ",\"bytes\":%lld", (long long) rec->arg);
+        break;
+    case TEV_WOULDBLOCK:
+        fprintf(out, ",\"during\":\"%s\"",
+                rec->arg > 0 && (size_t) rec->arg < EVENT_COUNT ?
+                event_names[rec->arg] : "?");
+        break;
+    case TEV_CLOSE:
+        fprintf(out, ",\"deferred\":%s",
+                rec->arg == CLOSE_DEFERRED ? "true" : "false");
+        break;
+    }
+    if (rec->error != 0)
+        fprintf(out, ",\"error\":\"%s\"", strerror(rec->error));
+    fputc('}', out);
+}
+
+static void print_event(FILE *out, const TraceHeader *hdr,
+                        const TraceRecord *rec)
+{
+    const char *name;
+    Boolean instant;
+
+    name = rec->event < EVENT_COUNT ? event_names[rec->event] : "?";
+    if (rec->event == TEV_CLOSE && rec->arg == CLOSE_DEFERRED)
+        name = "close (deferred)";
+    instant = rec->event == TEV_WOULDBLOCK || rec->event == TEV_DROPPED;
+
+    fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":",
+            name, rec->error != 0 ? "error" : "conn", instant ? "i" : "X");
+    print_usecs(out, rec->time - hdr->start);
+    if (instant) {
+        fprintf(out, ",\"s\":\"t\"");
+    } else {
+        fprintf(out, ",\"dur\":");
+        print_usecs(out, rec->dur);
+    }
+    fprintf(out, ",\"pid\":%u,\"tid\":%u,", hdr->pid, (unsigned) rec->thread);
+    print_args(out, rec);
+    fputc('}', out);
+}
+
+static void convert_trace(FILE *out, const char *path)
+{
+    TraceHeader hdr;
+    TraceRecord *recs;
+    size_t i, count;
+    uint32_t threads;
+    FILE *in;
+
+    in = fopen(path, "rb");
+    if (in == NULL)
+        die("fopen() trace file");
+    recs = read_trace(in, &hdr, &count);
+    fclose(in);
+    qsort(recs, count, sizeof(TraceRecord), compare_records);
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,"
+            "\"args\":{\"name\":\"linger-server\"}}", hdr.pid);
+    threads = 0;
+    for (i = 0; i < count; i++)
+        if (recs[i].thread >= threads)
+            threads = recs[i].thread + 1;
+    /* Thread 0 is the main thread; with -R the workers follow */
+    for (i = 0; i < threads; i++) {
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,"
+                "\"tid\":%u,\"args\":{\"name\":", hdr.pid, (unsigned) i);
+        if (i == 0)
+            fprintf(out, "\"main\"}}");
+        else
+            fprintf(out, "\"worker %u\"}}", (unsigned) i - 1);
+    }
+    for (i = 0; i < count; i++)
+        print_event(out, &hdr, &recs[i]);
+    fprintf(out, "\n]}\n");
+    fprintf(stderr, "%zu events\n", count);
+    free(recs);
+}
+
+static const Timeline *map_timeline(const char *name)
+{
+    char path[NAME_MAX];
+    const Timeline *tl;
+    struct stat sb;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd == -1)
+        die("shm_open() timeline");
+    if (fstat(fd, &sb) == -1)
+        die("fstat() timeline");
+    if (sb.st_size < (off_t) sizeof(Timeline))
+        fatal("Timeline is too short");
+    tl = mmap(NULL, sizeof(Timeline), PROT_READ, MAP_SHARED, fd, 0);
+    if (tl == MAP_FAILED)
+        die("mmap() timeline");
+    close(fd);
+    if (memcmp(tl->magic, TIMELINE_MAGIC, sizeof(tl->magic)) != 0)
+        fatal("Not a linger-server timeline");
+    return tl;
+}
+
+/* As linger-client works it out: from shutdown() to a FIN, if it was
+ * called, and from close() to a RST or otherwise, both to the FIN or RST
+ * arriving and to the client's last read, which includes however far
+ * behind its reads were. The server's half of a slot only belongs to the
+ * client's if it was accepted after the connect.
+ */
+static Boolean fin_delay(const TimelineSlot *s, int64_t *delay,
+                         int64_t *read_delay)
+{
+    uint64_t at, hangup;
+    int event;
+
+    if (s->end == 0 || s->accept == 0 || s->accept < s->connect)
+        return FALSE;
+    event = (int) s->end_event - 1;
+    if (event == EVENT_EOF && s->shutdown != 0)
+        at = s->shutdown;
+    else if ((event == EVENT_EOF || event == EVENT_RESET) && s->close != 0)
+        at = s->close;
+    else if (event == EVENT_RESET && s->shutdown != 0)
+        at = s->shutdown;
+    else
+        return FALSE;
+    hangup = s->hangup >= at ? s->hangup : s->end;
+    *delay = hangup - at;
+    *read_delay = s->end - at;
+    return TRUE;
+}
+
+static uint64_t first_time(const TimelineSlot *s)
+{
+    return s->connect != 0 ? s->connect : s->accept;
+}
+
+static int compare_slots(const void *a, const void *b)
+{
+    uint64_t x = first_time(*(const TimelineSlot **) a);
+    uint64_t y = first_time(*(const TimelineSlot **) b);
+
+    return x < y ? -1 : x > y;
+}
+
+static int compare_delays(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* A time in usecs since the server started, or nothing if it is unset */
+static void print_time(FILE *out, const Timeline *tl, uint64_t t)
+{
+    if (t != 0)
+        fprintf(out, ",%.3f", (int64_t) (t - tl->start) / 1000.0);
+    else
+        fputc(',', out);
+}
+
+static void print_delays(FILE *out, const char *label, int64_t *delays,
+                         size_t n)
+{
+    if (n == 0)
+        return;
+    qsort(delays, n, sizeof(int64_t), compare_delays);
+    fprintf(out, "%s (usecs): min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  "
+            "max %.3f\n", label, delays[0] / 1000.0, delays[n / 2] / 1000.0,
+            delays[n * 9 / 10] / 1000.0, delays[n * 99 / 100] / 1000.0,
+            delays[n - 1] / 1000.0);
+}
+
+static void print_timeline(FILE *out, const char *name)
+{
+    const Timeline *tl;
+    const TimelineSlot **slots, *s;
+    int64_t *delays, *read_delays;
+    size_t i, count, ndelays;
+
+    tl = map_timeline(name);
+    slots = malloc(TIMELINE_SLOTS * sizeof(TimelineSlot *));
+    delays = malloc(TIMELINE_SLOTS * sizeof(int64_t));
+    read_delays = malloc(TIMELINE_SLOTS * sizeof(int64_t));
+    if (slots == NULL || delays == NULL || read_delays == NULL)
+        fatal("out of memory");
+    count = 0;
+    for (i = 0; i < TIMELINE_SLOTS; i++)
+        if (tl->slots[i].connect != 0 || tl->slots[i].accept != 0)
+            slots[count++] = &tl->slots[i];
+    qsort(slots, count, sizeof(TimelineSlot *), compare_slots);
+
+    fprintf(out, "port,connect,accept,write,write_done,shutdown,close,"
+            "closed,first_byte,hangup,end,end_event,fin_delay,"
+            "read_delay\n");
+    ndelays = 0;
+    for (i = 0; i < count; i++) {
+        s = slots[i];
+        fprintf(out, "%u", (unsigned) (s - tl->slots));
+        print_time(out, tl, s->connect);
+        print_time(out, tl, s->accept);
+        print_time(out, tl, s->write);
+        print_time(out, tl, s->write_done);
+        print_time(out, tl, s->shutdown);
+        print_time(out, tl, s->close);
+        print_time(out, tl, s->closed);
+        print_time(out, tl, s->first_byte);
+        print_time(out, tl, s->hangup);
+        print_time(out, tl, s->end);
+        fprintf(out, ",%s", s->end_event < 5 ? end_names[s->end_event] : "?");
+        if (fin_delay(s, &delays[ndelays], &read_delays[ndelays])) {
+            fprintf(out, ",%.3f,%.3f", delays[ndelays] / 1000.0,
+                    read_delays[ndelays] / 1000.0);
+            ndelays++;
+        } else {
+            fputs(",,", out);
+        }
+        fputc('\n', out);
+    }
+
+    fprintf(out, "-- connections: %zu (with both ends stamped: %zu)\n",
+            count, ndelays);
+    print_delays(out, "Server shutdown()/close() to FIN/RST arriving",
+                 delays, ndelays);
+    print_delays(out, "Server shutdown()/close() to last read",
+                 read_delays, ndelays);
+    free(delays);
+    free(read_delays);
+    free(slots);
+    munmap((void *) tl, sizeof(Timeline));
+}
+
+int main(int argc, char *argv[])
+{
+    Options topts, *options = &topts;
+    FILE *out;
+
+    parse_opts(argc, argv, options);
+
+    out = stdout;
+    if (options->out_path != NULL) {
+        out = fopen(options->out_path, "w");
+        if (out == NULL)
+            die("fopen() output file");
+    }
+
+    if (options->timeline_name != NULL)
+        print_timeline(out, options->timeline_name);
+    else
+        convert_trace(out, options->in_path);
+
+    if (ferror(out) || (out != stdout && fclose(out) == EOF))
+        die("writing output");
+    exit(EXIT_SUCCESS);
+}
@@ -36,6 +36,7 @@ typedef enum { FALSE, TRUE } Boolean;
 #define PAYLOAD_SIZE (20 * 1024)
 #define BACKLOG 128
 #define TIME_MAX 86400
+#define PATTERN_STEP 0x9E3779B97F4A7C15ULL
 
 #define OPT_NOSOCK 0
 #define OPT_LSOCK 1
@@ -92,13 +93,19 @@ static void usage_exit(const char *prog_name, const char *msg)
     exit(EXIT_FAILURE);
 }
 
+/* The same position-dependent pattern as linger-server.c, so that
+ * linger-client can verify it */
 static void get_payload(char *buf, int size)
 {
-    int i;
-
-    for (i = 0; i < size; i++) {
-        buf[i] = '.';
-    }
+    unsigned char *p = (unsigned char *) buf;
+    unsigned long long word = PATTERN_STEP;
+    int i, j;
+
+    for (i = 0; i + 8 <= size; i += 8, word += PATTERN_STEP)
+        for (j = 0; j < 8; j++)
+            p[i + j] = (unsigned char) (word >> (8 * j));
+    for (j = 0; i < size; i++, j++)
+        p[i] = (unsigned char) (word >> (8 * j));
 }
 
 static void set_socket_options(int fd)